@@ -0,0 +1,518 @@
+/**
+ * H.264 archival, see archive.h.
+ *
+ * One archive thread at nice 19 and idle I/O priority works through the
+ * aged segments oldest first. Frames are decoded in batches, one frame per
+ * pool thread, and fed to the encoder in order. Reading the MJPEG input is
+ * paced to a rate limit, which bounds the whole pipeline.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "archive.h"
+#include "clock.h"
+#include "mkv.h"
+#include "pool.h"
+#include "retain.h"
+#include "store.h"
+#include "trace.h"
+
+#if defined(HAVE_JPEGLIB) && defined(HAVE_X264)
+#define ARCHIVE_SUPPORTED
+#include <stdint.h>
+#include <jpeglib.h>
+#include <x264.h>
+#endif
+
+#define ARCHIVE_IDLE_NS 10000000000ULL
+#define ARCHIVE_BATCH 4
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static unsigned long long archive_age;
+static unsigned int archive_threads = 2;
+static unsigned long long archive_rate = 4ULL << 20;
+static bool stopping;
+static bool running;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+/**
+ * \param hours archive segments older than this, 0 to never archive
+ * \param threads decoding threads, also used by the encoder
+ * \param megabytesPerSecond MJPEG read rate limit
+ */
+void archiveConfig(double hours, unsigned int threads, unsigned int megabytesPerSecond)
+{
+	if (hours > 0)
+		archive_age = hours * 3600e9;
+	if (threads)
+		archive_threads = threads;
+	if (megabytesPerSecond)
+		archive_rate = (unsigned long long)megabytesPerSecond << 20;
+}
+
+bool archiveEnabled(void)
+{
+	return archive_age != 0;
+}
+
+#ifdef ARCHIVE_SUPPORTED
+
+struct slot {
+	const struct index_entry* entry;
+	unsigned char* jpeg;
+	size_t jpegSize;
+	unsigned char* yuv;
+	unsigned char* rows;
+	bool ok;
+};
+
+struct batch {
+	unsigned int width;
+	unsigned int height;
+	struct slot* slots;
+};
+
+struct jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static void jpegFail(j_common_ptr cinfo)
+{
+	longjmp(((struct jpeg_error*)cinfo->err)->jump, 1);
+}
+
+/* broken frames are counted, not reported one by one */
+static void jpegQuiet(j_common_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+/**
+ * Decode one frame of a batch to I420, averaging chroma over 2x2 pixels.
+ */
+static void decodeJob(unsigned int index, void* arg)
+{
+	struct batch* b = arg;
+	struct slot* s = &b->slots[index];
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error err;
+	unsigned int w = b->width, h = b->height;
+
+	s->ok = false;
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpegFail;
+	err.mgr.output_message = jpegQuiet;
+	jpeg_create_decompress(&cinfo);
+
+	if (setjmp(err.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		return;
+	}
+
+	jpeg_mem_src(&cinfo, s->jpeg, s->entry->length);
+	jpeg_read_header(&cinfo, TRUE);
+	if (cinfo.image_width != w || cinfo.image_height != h) {
+		jpeg_destroy_decompress(&cinfo);
+		return;
+	}
+
+	cinfo.out_color_space = JCS_YCbCr;
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+	jpeg_start_decompress(&cinfo);
+
+	unsigned char* y = s->yuv;
+	unsigned char* u = y + w * h;
+	unsigned char* v = u + (w / 2) * (h / 2);
+	while (cinfo.output_scanline < h) {
+		unsigned int line = cinfo.output_scanline, x;
+		JSAMPROW rows[2] = { s->rows, s->rows + w * 3 };
+
+		while (cinfo.output_scanline < line + 2) {
+			JSAMPROW next = rows[cinfo.output_scanline - line];
+			jpeg_read_scanlines(&cinfo, &next, 1);
+		}
+
+		for (x = 0; x < w; x++) {
+			y[line * w + x] = rows[0][x * 3];
+			y[(line + 1) * w + x] = rows[1][x * 3];
+		}
+		for (x = 0; x < w / 2; x++) {
+			const unsigned char* a = rows[0] + x * 6;
+			const unsigned char* c = rows[1] + x * 6;
+			u[(line / 2) * (w / 2) + x] = (a[1] + a[4] + c[1] + c[4] + 2) / 4;
+			v[(line / 2) * (w / 2) + x] = (a[2] + a[5] + c[2] + c[5] + 2) / 4;
+		}
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	s->ok = true;
+}
+
+/**
+ * Size of the first decodable frame.
+ */
+static int frameSize(int data, const struct index_entry* e, size_t n, unsigned int* w, unsigned int* h)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		struct jpeg_decompress_struct cinfo;
+		struct jpeg_error err;
+		unsigned char* jpeg = malloc(e[i].length);
+
+		if (!jpeg || pread(data, jpeg, e[i].length, e[i].offset) != (ssize_t)e[i].length) {
+			free(jpeg);
+			continue;
+		}
+
+		cinfo.err = jpeg_std_error(&err.mgr);
+		err.mgr.error_exit = jpegFail;
+		err.mgr.output_message = jpegQuiet;
+		jpeg_create_decompress(&cinfo);
+
+		if (!setjmp(err.jump)) {
+			jpeg_mem_src(&cinfo, jpeg, e[i].length);
+			jpeg_read_header(&cinfo, TRUE);
+			*w = cinfo.image_width;
+			*h = cinfo.image_height;
+		}
+
+		jpeg_destroy_decompress(&cinfo);
+		free(jpeg);
+		if (*w && *h)
+			return 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Build the AVCDecoderConfigurationRecord from the encoder's SPS and PPS.
+ */
+static size_t avcConfig(x264_t* enc, unsigned char* out, size_t size)
+{
+	x264_nal_t* nals;
+	const unsigned char* sps = NULL;
+	const unsigned char* pps = NULL;
+	size_t spsSize = 0, ppsSize = 0;
+	int count, i;
+
+	if (x264_encoder_headers(enc, &nals, &count) < 0)
+		return 0;
+
+	/* without Annex B every NAL starts with its 4 byte length */
+	for (i = 0; i < count; i++) {
+		int type = nals[i].p_payload[4] & 0x1F;
+
+		if (type == 7) {
+			sps = nals[i].p_payload + 4;
+			spsSize = nals[i].i_payload - 4;
+		} else if (type == 8) {
+			pps = nals[i].p_payload + 4;
+			ppsSize = nals[i].i_payload - 4;
+		}
+	}
+
+	if (!sps || !pps || spsSize < 4 || 11 + spsSize + ppsSize > size)
+		return 0;
+
+	out[0] = 1;
+	out[1] = sps[1];
+	out[2] = sps[2];
+	out[3] = sps[3];
+	out[4] = 0xFF;  /* 4 byte NAL lengths */
+	out[5] = 0xE1;  /* one SPS */
+	out[6] = spsSize >> 8;
+	out[7] = spsSize;
+	memcpy(out + 8, sps, spsSize);
+	out[8 + spsSize] = 1;
+	out[9 + spsSize] = ppsSize >> 8;
+	out[10 + spsSize] = ppsSize;
+	memcpy(out + 11 + spsSize, pps, ppsSize);
+	return 11 + spsSize + ppsSize;
+}
+
+/**
+ * Write what the encoder returned. Input pts are frame numbers, mapped back
+ * to the capture times from the index.
+ */
+static int encoded(struct mkv* m, const struct index_entry* e, const x264_nal_t* nals, int size,
+	const x264_picture_t* pic, long* frames)
+{
+	if (size <= 0)
+		return size;
+
+	(*frames)++;
+	return mkvWrite(m, e[pic->i_pts].timestamp, pic->b_keyframe, nals[0].p_payload, size);
+}
+
+/**
+ * Transcode one segment to dest.
+ *
+ * \returns number of frames written, -1 on error
+ */
+static long transcode(const char* path, const char* dest, unsigned long long start)
+{
+	char name[PATH_MAX + NAME_MAX + 40];
+	unsigned char avcc[512];
+	struct stat st;
+	struct batch b = { 0, 0, NULL };
+	const struct index_entry* e = NULL;
+	struct mkv* m = NULL;
+	x264_t* enc = NULL;
+	x264_param_t param;
+	x264_picture_t pic, out;
+	x264_nal_t* nals;
+	unsigned int batch = archive_threads * ARCHIVE_BATCH, i;
+	size_t n = 0, next;
+	long frames = 0, good = 0;
+	int count;
+
+	snprintf(name, sizeof(name), "%s.idx", path);
+	int data = open(path, O_RDONLY | O_CLOEXEC);
+	int index = open(name, O_RDONLY | O_CLOEXEC);
+	if (data == -1 || index == -1 || fstat(index, &st) == -1)
+		goto fail;
+
+	n = st.st_size / sizeof(*e);
+	e = n ? mmap(NULL, n * sizeof(*e), PROT_READ, MAP_SHARED, index, 0) : NULL;
+	if (!e || e == MAP_FAILED || frameSize(data, e, n, &b.width, &b.height) == -1
+			|| (b.width | b.height) & 1) {
+		e = e == MAP_FAILED ? NULL : e;
+		goto fail;
+	}
+
+	x264_param_default_preset(&param, "medium", NULL);
+	param.i_threads = archive_threads;
+	param.i_width = b.width;
+	param.i_height = b.height;
+	param.i_csp = X264_CSP_I420;
+	param.i_bframe = 0;  /* decode order is display order, no reordering in the file */
+	param.b_annexb = 0;
+	param.b_repeat_headers = 0;
+	param.b_vfr_input = 0;
+	param.i_log_level = X264_LOG_WARNING;
+	param.rc.i_rc_method = X264_RC_CRF;
+	param.rc.f_rf_constant = 23;
+
+	unsigned long long span = e[n - 1].timestamp > e[0].timestamp ? e[n - 1].timestamp - e[0].timestamp : 0;
+	param.i_fps_num = span ? (n - 1) * 1000ULL : 15;
+	param.i_fps_den = span ? span / 1000000 : 1;
+	if (!param.i_fps_den)
+		param.i_fps_den = 1;
+	param.i_keyint_max = (param.i_fps_num / param.i_fps_den) * 10 + 1;
+	x264_param_apply_profile(&param, "high");
+
+	size_t avccSize = 0;
+	enc = x264_encoder_open(&param);
+	if (!enc || !(avccSize = avcConfig(enc, avcc, sizeof(avcc))))
+		goto fail;
+
+	m = mkvCreate(dest, b.width, b.height, avcc, avccSize, start);
+	b.slots = calloc(batch, sizeof(*b.slots));
+	if (!m || !b.slots)
+		goto fail;
+
+	size_t frame = b.width * b.height * 3 / 2;
+	for (i = 0; i < batch; i++) {
+		b.slots[i].yuv = malloc(frame);
+		b.slots[i].rows = malloc(b.width * 3 * 2);
+		if (!b.slots[i].yuv || !b.slots[i].rows)
+			goto fail;
+	}
+
+	unsigned long long begin = nowNs(), read = 0;
+	for (next = 0; next < n; next += batch) {
+		unsigned int jobs = n - next < batch ? n - next : batch;
+
+		if (__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+			goto fail;
+
+		for (i = 0; i < jobs; i++) {
+			struct slot* s = &b.slots[i];
+
+			s->entry = &e[next + i];
+			if (s->entry->length > s->jpegSize) {
+				unsigned char* grown = realloc(s->jpeg, s->entry->length);
+				if (!grown)
+					goto fail;
+				s->jpeg = grown;
+				s->jpegSize = s->entry->length;
+			}
+			if (pread(data, s->jpeg, s->entry->length, s->entry->offset) != (ssize_t)s->entry->length)
+				goto fail;
+			read += s->entry->length;
+		}
+
+		poolRun(jobs, archive_threads, decodeJob, &b);
+
+		for (i = 0; i < jobs; i++) {
+			struct slot* s = &b.slots[i];
+
+			if (!s->ok)
+				continue;
+
+			x264_picture_init(&pic);
+			pic.img.i_csp = X264_CSP_I420;
+			pic.img.i_plane = 3;
+			pic.img.plane[0] = s->yuv;
+			pic.img.plane[1] = s->yuv + b.width * b.height;
+			pic.img.plane[2] = pic.img.plane[1] + (b.width / 2) * (b.height / 2);
+			pic.img.i_stride[0] = b.width;
+			pic.img.i_stride[1] = pic.img.i_stride[2] = b.width / 2;
+			pic.i_pts = next + i;
+
+			if (encoded(m, e, nals, x264_encoder_encode(enc, &nals, &count, &pic, &out), &out, &frames) < 0)
+				goto fail;
+			good++;
+		}
+
+		pace(begin, read, archive_rate);
+	}
+
+	while (x264_encoder_delayed_frames(enc) > 0) {
+		int size = x264_encoder_encode(enc, &nals, &count, NULL, &out);
+		if (size <= 0 || encoded(m, e, nals, size, &out, &frames) < 0)
+			break;
+	}
+
+	int closed = mkvClose(m);
+	m = NULL;
+
+	if (closed == -1 || frames != good || mkvVerify(dest) != frames) {
+		fprintf(stderr, "%s: archive did not verify\n", dest);
+		goto fail;
+	}
+	if (good < (long)n)
+		fprintf(stderr, "%s: %ld of %zu frames could not be decoded\n", path, (long)n - good, n);
+
+	goto out;
+
+fail:
+	if (m)
+		mkvClose(m);
+	unlink(dest);
+	frames = -1;
+
+out:
+	if (enc)
+		x264_encoder_close(enc);
+	for (i = 0; b.slots && i < batch; i++) {
+		free(b.slots[i].jpeg);
+		free(b.slots[i].yuv);
+		free(b.slots[i].rows);
+	}
+	free(b.slots);
+	if (e)
+		munmap((void*)e, n * sizeof(*e));
+	if (data != -1)
+		close(data);
+	if (index != -1)
+		close(index);
+	return frames;
+}
+
+static void archiveOne(void)
+{
+	char path[PATH_MAX + NAME_MAX + 32], dest[PATH_MAX + NAME_MAX + 32];
+	const char* camera;
+	unsigned long long start;
+	struct root* root;
+
+	if (retainAged(realtimeNs() - archive_age, &camera, &start, path, sizeof(path), &root) == -1) {
+		struct timespec ts;
+
+		pthread_mutex_lock(&lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += ARCHIVE_IDLE_NS / 1000000000ULL;
+		if (!stopping)
+			pthread_cond_timedwait(&wake, &lock, &ts);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	snprintf(dest, sizeof(dest), "%s/%s/%llu.mkv", root->path, camera, start);
+
+	unsigned long long begin = traceBegin();
+	if (transcode(path, dest, start) >= 0 && retainReplace(camera, start, path, dest, "archive") == -1)
+		unlink(dest);
+	traceEnd("archive", begin, camera, 0);
+}
+
+static void* archiveThread(void* arg)
+{
+	(void)arg;
+
+	/* the decoding pool threads inherit both */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+	traceThreadName("archive");
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+		archiveOne();
+
+	return NULL;
+}
+
+#endif
+
+/**
+ * Start archiving in the background.
+ *
+ * \returns 0 on success, -1 on error or without libjpeg and x264
+ */
+int archiveStart(void)
+{
+#ifdef ARCHIVE_SUPPORTED
+	int err = pthread_create(&thread, NULL, archiveThread, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create error %d, %s\n", err, strerror(err));
+		return -1;
+	}
+
+	running = true;
+	return 0;
+#else
+	fprintf(stderr, "Archiving needs libjpeg and x264, rebuild with both installed\n");
+	return -1;
+#endif
+}
+
+/**
+ * Stop archiving, abandoning the segment in progress.
+ */
+void archiveStop(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	__atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+	running = false;
+}
@@ -0,0 +1,21 @@
+/**
+ * Archival of aged segments as H.264.
+ *
+ * Segments older than the archive age (-A) are decoded with libjpeg on a
+ * small pool of low priority threads, encoded with x264 and written as
+ * Matroska with the original frame times. The archive replaces the MJPEG
+ * segment in the catalog only once it has been read back and found
+ * complete. Only available when built with libjpeg and x264.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdbool.h>
+
+void archiveConfig(double hours, unsigned int threads, unsigned int megabytesPerSecond);
+bool archiveEnabled(void);
+int archiveStart(void);
+void archiveStop(void);
+
+#endif
@@ -0,0 +1,324 @@
+/**
+ * Segment catalog, see catalog.h.
+ *
+ * Lines are written with a single write() on an O_APPEND descriptor, so
+ * writer threads of different roots can append concurrently and a reader
+ * never sees half a line from one of them. Paths are the rest of the line
+ * and may contain spaces, camera names may not.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+
+#define CATALOG_NAME "catalog"
+
+static int catalog = -1;
+
+/**
+ * Open the catalog of a root for appending, creating it if needed.
+ *
+ * \returns 0 on success, -1 on error
+ */
+int catalogOpen(const char* root)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", root, CATALOG_NAME);
+	catalog = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (catalog == -1) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void catalogClose(void)
+{
+	if (catalog != -1)
+		close(catalog);
+	catalog = -1;
+}
+
+/**
+ * A camera name is one field of a catalog line.
+ */
+static bool validCamera(const char* camera)
+{
+	const char* c;
+
+	if (!*camera)
+		return false;
+	for (c = camera; *c; c++)
+		if (isspace((unsigned char)*c))
+			return false;
+	return true;
+}
+
+/**
+ * Record a change to a segment.
+ *
+ * \param op what happened to the segment
+ * \param camera camera the segment belongs to
+ * \param start start time of the segment, CLOCK_REALTIME ns
+ * \param path where the segment lives now
+ * \returns 0 on success, -1 on error
+ */
+int catalogAppend(const char* op, const char* camera, unsigned long long start, const char* path)
+{
+	char line[PATH_MAX + 128];
+
+	if (catalog == -1)
+		return 0;
+
+	if (!validCamera(camera) || (path && strchr(path, '\n'))) {
+		fprintf(stderr, "Cannot catalog camera '%s' at '%s', whitespace in the camera or a line break in the path\n",
+			camera, path ? path : "-");
+		return -1;
+	}
+
+	int n = snprintf(line, sizeof(line), "%s %s %llu %s\n", op, camera, start, path ? path : "-");
+	if (n < 0 || (size_t)n >= sizeof(line) || write(catalog, line, n) != n) {
+		fprintf(stderr, "catalog write error %d, %s\n", errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+#define CATALOG_READ (64 << 10)
+
+struct catalog_view {
+	char camera[NAME_MAX + 1];
+	int fd;
+	off_t offset;                 /* read up to here, always at a line start */
+	struct catalog_entry* entries;
+	size_t count, size;
+	size_t removed;               /* entries without a path, dropped after a refresh */
+	char* buffer;
+};
+
+/**
+ * Open a root's catalog to follow the segments of one camera.
+ *
+ * \returns the view, empty until refreshed, NULL on error
+ */
+struct catalog_view* catalogView(const char* root, const char* camera)
+{
+	char path[PATH_MAX];
+	struct catalog_view* v = calloc(1, sizeof(*v));
+
+	if (!v) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+
+	snprintf(v->camera, sizeof(v->camera), "%s", camera);
+	snprintf(path, sizeof(path), "%s/%s", root, CATALOG_NAME);
+	v->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (v->fd == -1) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", path, errno, strerror(errno));
+		free(v);
+		return NULL;
+	}
+
+	return v;
+}
+
+void catalogViewClose(struct catalog_view* v)
+{
+	if (!v)
+		return;
+
+	catalogFree(v->entries, v->count);
+	free(v->buffer);
+	close(v->fd);
+	free(v);
+}
+
+/**
+ * Index of the first entry that starts after a time, count if none does.
+ */
+size_t catalogAfter(const struct catalog_entry* entries, size_t count, unsigned long long start)
+{
+	size_t lo = 0, hi = count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (entries[mid].start <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * Apply one record. Segments start in the order they are added, so new
+ * ones nearly always go to the end.
+ */
+static int viewApply(struct catalog_view* v, unsigned long long start, const char* where)
+{
+	size_t i = catalogAfter(v->entries, v->count, start);
+	struct catalog_entry* e = i ? &v->entries[i - 1] : NULL;
+	char* path = strcmp(where, "-") ? strdup(where) : NULL;
+
+	if (!path && strcmp(where, "-")) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	if (e && e->start == start) {
+		if (e->path && !path)
+			v->removed++;
+		else if (!e->path && path)
+			v->removed--;
+		free(e->path);
+		e->path = path;
+		e->bytes = -1;
+		return 0;
+	}
+
+	if (!path)
+		return 0;
+
+	if (v->count == v->size) {
+		size_t size = v->size ? 2 * v->size : 256;
+		struct catalog_entry* grown = realloc(v->entries, size * sizeof(*grown));
+
+		if (!grown) {
+			free(path);
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		v->entries = grown;
+		v->size = size;
+	}
+
+	memmove(&v->entries[i + 1], &v->entries[i], (v->count - i) * sizeof(v->entries[0]));
+	v->entries[i].start = start;
+	v->entries[i].path = path;
+	v->entries[i].bytes = -1;
+	v->count++;
+	return 0;
+}
+
+/**
+ * Take in the lines appended since the last refresh. Only complete lines
+ * are read, a line being appended is left for the next time.
+ *
+ * \param entries receives the segments sorted by start time, valid until
+ *                the next refresh
+ * \param count receives the number of segments
+ * \returns 0 on success, -1 on error
+ */
+int catalogRefresh(struct catalog_view* v, struct catalog_entry** entries, size_t* count)
+{
+	struct stat st;
+	size_t i, kept;
+
+	if (!v->buffer && !(v->buffer = malloc(CATALOG_READ + 1))) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	if (fstat(v->fd, &st) == -1) {
+		fprintf(stderr, "catalog stat error %d, %s\n", errno, strerror(errno));
+		return -1;
+	}
+
+	while (v->offset < st.st_size) {
+		char* buffer = v->buffer;
+		ssize_t n = pread(v->fd, buffer, CATALOG_READ, v->offset);
+		char* line = buffer;
+		char* end;
+
+		if (n <= 0) {
+			if (n == -1)
+				fprintf(stderr, "catalog read error %d, %s\n", errno, strerror(errno));
+			break;
+		}
+		buffer[n] = '\0';
+
+		while ((end = memchr(line, '\n', buffer + n - line))) {
+			char op[16], cam[NAME_MAX + 1], where[PATH_MAX];
+			unsigned long long start;
+
+			*end = '\0';
+			if (sscanf(line, "%15s %255s %llu %4095[^\n]", op, cam, &start, where) == 4
+					&& strcmp(cam, v->camera) == 0 && viewApply(v, start, where) == -1)
+				return -1;
+			line = end + 1;
+		}
+
+		/* no line end at all, wait for the rest */
+		if (line == buffer)
+			break;
+		v->offset += line - buffer;
+	}
+
+	if (v->removed) {
+		for (i = kept = 0; i < v->count; i++)
+			if (v->entries[i].path)
+				v->entries[kept++] = v->entries[i];
+		v->count = kept;
+		v->removed = 0;
+	}
+
+	*entries = v->entries;
+	*count = v->count;
+	return 0;
+}
+
+/**
+ * Replay the catalog of a root and return the segments of one camera.
+ *
+ * \param root root holding the catalog
+ * \param camera camera to look for
+ * \param entries receives the segments sorted by start time
+ * \param count receives the number of segments
+ * \returns 0 on success, -1 on error
+ */
+int catalogLoad(const char* root, const char* camera, struct catalog_entry** entries, size_t* count)
+{
+	struct catalog_entry* e;
+	struct catalog_view* v = catalogView(root, camera);
+
+	if (!v)
+		return -1;
+
+	if (catalogRefresh(v, &e, count) == -1) {
+		catalogViewClose(v);
+		return -1;
+	}
+
+	/* hand the entries over */
+	*entries = v->entries;
+	v->entries = NULL;
+	v->count = 0;
+	catalogViewClose(v);
+	return 0;
+}
+
+void catalogFree(struct catalog_entry* entries, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		free(entries[i].path);
+	free(entries);
+}
@@ -0,0 +1,43 @@
+/**
+ * Catalog of recorded segments.
+ *
+ * The catalog is an append only text file in the first output root. Every
+ * line records one change to where a segment lives:
+ *
+ *   add <camera> <start ns> <path>       segment created
+ *   move <camera> <start ns> <path>      segment moved out of staging
+ *   decimate <camera> <start ns> <path>  segment replaced by fewer frames
+ *   archive <camera> <start ns> <path>   segment replaced by H.264 Matroska
+ *   del <camera> <start ns> -            segment deleted by retention
+ *
+ * Readers replay the file, the last line for a camera and start time wins.
+ * A view keeps the segments of one camera and on refresh only reads what
+ * was appended since, so following the catalog costs no more than it grows.
+ * Paths are absolute so segments can live on any root, and run to the end
+ * of the line.
+ */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+
+struct catalog_entry {
+	unsigned long long start;
+	char* path;
+	long long bytes;              /* for readers to fill in, -1 until then */
+};
+
+struct catalog_view;
+
+int catalogOpen(const char* root);
+void catalogClose(void);
+int catalogAppend(const char* op, const char* camera, unsigned long long start, const char* path);
+int catalogLoad(const char* root, const char* camera, struct catalog_entry** entries, size_t* count);
+void catalogFree(struct catalog_entry* entries, size_t count);
+struct catalog_view* catalogView(const char* root, const char* camera);
+int catalogRefresh(struct catalog_view* v, struct catalog_entry** entries, size_t* count);
+size_t catalogAfter(const struct catalog_entry* entries, size_t count, unsigned long long start);
+void catalogViewClose(struct catalog_view* v);
+
+#endif
@@ -0,0 +1,51 @@
+/**
+ * Timestamps and pacing shared by the probes, tracers, statistics and
+ * background jobs.
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <time.h>
+
+/**
+ * Monotonic clock in nanoseconds.
+ */
+static inline unsigned long long nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Wall clock in nanoseconds since the epoch.
+ */
+static inline unsigned long long realtimeNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Sleep off whatever a transfer is ahead of a rate limit.
+ *
+ * \param start nowNs() when the transfer started
+ * \param bytes bytes transferred since
+ * \param rate limit in bytes per second
+ */
+static inline void pace(unsigned long long start, unsigned long long bytes, unsigned long long rate)
+{
+	unsigned long long due = start + (bytes * 1000000000ULL) / rate;
+	unsigned long long now = nowNs();
+
+	if (due > now) {
+		struct timespec ts = { (due - now) / 1000000000ULL, (due - now) % 1000000000ULL };
+		nanosleep(&ts, NULL);
+	}
+}
+
+#endif
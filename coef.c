@@ -0,0 +1,827 @@
+/**
+ * Coefficient domain transforms, see coef.h.
+ *
+ * Requantising divides every coefficient by the ratio of the new to the old
+ * quantiser. The new tables are the standard ones at the target quality, but
+ * never finer than the frame's own, so a frame only ever loses detail it
+ * would not keep anyway.
+ *
+ * Restart markers and progressive scans only change the entropy coded data,
+ * the coefficients and so the decoded image stay the same.
+ *
+ * Downscaling follows Dugad and Ahuja: the k = 8 / scale lowest frequencies
+ * of a block, scaled by sqrt(k / 8), are the k point DCT of the block
+ * shrunk to k by k pixels. scale by scale such blocks make one block of the
+ * output, and the DCT of that is a fixed linear map of their coefficients,
+ *
+ *   out = sum over i, j of C[j] A[j][i] C[i]^T
+ *
+ * with A[j][i] the low frequencies of the input block in row j, column i,
+ * and C[i] the 8 by k matrix taking a k point spectrum to its share of the
+ * 8 point one. Horizontal and vertical factors can differ, which reducing
+ * 4:2:2 chroma to 4:2:0 uses: chroma blocks are merged in pairs vertically
+ * and only the sampling factors in the SOF change for luma.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "coef.h"
+
+#ifdef HAVE_JPEGLIB
+
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#define COEF_TRIES 5
+#define COEF_MIN_QUALITY 5
+#define COEF_MAX_SCALE 4
+#define COEF_MAX 2047
+
+struct coef_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+};
+
+static void coefFail(j_common_ptr cinfo)
+{
+	longjmp(((struct coef_error*)cinfo->err)->jump, 1);
+}
+
+/* broken frames are passed on unchanged, not reported */
+static void coefQuiet(j_common_ptr cinfo)
+{
+	(void)cinfo;
+}
+
+/**
+ * Scale the coefficients of every component from the source tables to the
+ * destination tables.
+ */
+static void requantize(j_decompress_ptr src, j_compress_ptr dst, jvirt_barray_ptr* coefs, int quality)
+{
+	int c, t, k;
+
+	jpeg_set_quality(dst, quality, TRUE);
+
+	for (t = 0; t < NUM_QUANT_TBLS; t++) {
+		JQUANT_TBL* from = src->quant_tbl_ptrs[t];
+		JQUANT_TBL* to = dst->quant_tbl_ptrs[t];
+
+		if (!from || !to)
+			continue;
+		for (k = 0; k < DCTSIZE2; k++)
+			if (to->quantval[k] < from->quantval[k])
+				to->quantval[k] = from->quantval[k];
+	}
+
+	for (c = 0; c < src->num_components; c++) {
+		jpeg_component_info* comp = &src->comp_info[c];
+		const JQUANT_TBL* from = comp->quant_table;
+		const JQUANT_TBL* to = dst->quant_tbl_ptrs[dst->comp_info[c].quant_tbl_no];
+		float ratio[DCTSIZE2];
+		JDIMENSION row, x;
+
+		if (!from || !to || memcmp(from->quantval, to->quantval, sizeof(from->quantval)) == 0)
+			continue;
+
+		for (k = 0; k < DCTSIZE2; k++)
+			ratio[k] = (float)from->quantval[k] / to->quantval[k];
+
+		for (row = 0; row < comp->height_in_blocks; row++) {
+			JBLOCKARRAY blocks = (*src->mem->access_virt_barray)((j_common_ptr)src, coefs[c], row, 1, TRUE);
+
+			for (x = 0; x < comp->width_in_blocks; x++) {
+				JCOEF* b = blocks[0][x];
+
+				/* most coefficients are zero and stay zero */
+				for (k = 0; k < DCTSIZE2; k++)
+					if (b[k])
+						b[k] = (JCOEF)(b[k] * ratio[k] + (b[k] > 0 ? 0.5f : -0.5f));
+			}
+		}
+	}
+}
+
+/*
+ * Progressive scans by spectral selection only: the DC of all components,
+ * the lowest luma frequencies, the chroma, then the rest of the luma. There
+ * are no refinement scans, so every coefficient is sent once and a viewer
+ * can show a blurry preview after the first two scans.
+ */
+static const jpeg_scan_info colour_scans[] = {
+	{ 3, { 0, 1, 2, 0 }, 0, 0, 0, 0 },
+	{ 1, { 0, 0, 0, 0 }, 1, 5, 0, 0 },
+	{ 1, { 1, 0, 0, 0 }, 1, 63, 0, 0 },
+	{ 1, { 2, 0, 0, 0 }, 1, 63, 0, 0 },
+	{ 1, { 0, 0, 0, 0 }, 6, 63, 0, 0 },
+};
+
+static const jpeg_scan_info grey_scans[] = {
+	{ 1, { 0, 0, 0, 0 }, 0, 0, 0, 0 },
+	{ 1, { 0, 0, 0, 0 }, 1, 5, 0, 0 },
+	{ 1, { 0, 0, 0, 0 }, 6, 63, 0, 0 },
+};
+
+/**
+ * Switch an encoder to the progressive scans above. Frames with other
+ * component counts keep libjpeg's own progression.
+ */
+static void progressiveScans(j_compress_ptr dst)
+{
+	if (dst->num_components == 3) {
+		dst->scan_info = colour_scans;
+		dst->num_scans = sizeof(colour_scans) / sizeof(colour_scans[0]);
+	} else if (dst->num_components == 1) {
+		dst->scan_info = grey_scans;
+		dst->num_scans = sizeof(grey_scans) / sizeof(grey_scans[0]);
+	} else {
+		jpeg_simple_progression(dst);
+	}
+}
+
+static double dctBasis(int u, int x, int n)
+{
+	return (u ? 1 : M_SQRT1_2) * sqrt(2.0 / n) * cos((2 * x + 1) * u * M_PI / (2 * n));
+}
+
+/**
+ * The matrices C[i] for one scale, c[i][u][m] for output frequency u and
+ * input frequency m.
+ */
+static void scaleMatrix(unsigned int scale, float c[][DCTSIZE][DCTSIZE])
+{
+	int k = DCTSIZE / scale, u, m, n;
+	unsigned int i;
+
+	for (i = 0; i < scale; i++) {
+		for (u = 0; u < DCTSIZE; u++) {
+			for (m = 0; m < k; m++) {
+				double sum = 0;
+
+				for (n = 0; n < k; n++)
+					sum += dctBasis(u, i * k + n, DCTSIZE) * dctBasis(m, n, k);
+				c[i][u][m] = sum * sqrt((double)k / DCTSIZE);
+			}
+		}
+	}
+}
+
+/**
+ * Shrink one output block from xs by ys input blocks. Blocks past the edge
+ * of the input repeat its last row or column.
+ */
+static void scaleBlock(JCOEF* out, JBLOCKROW* rows, JDIMENSION x, JDIMENSION width,
+	unsigned int xs, unsigned int ys, float cx[][DCTSIZE][DCTSIZE], float cy[][DCTSIZE][DCTSIZE],
+	const UINT16* quant)
+{
+	float acc[DCTSIZE][DCTSIZE] = { { 0 } };
+	int kx = DCTSIZE / xs, ky = DCTSIZE / ys, a, b, u, v;
+	unsigned int i, j;
+
+	for (j = 0; j < ys; j++) {
+		float h[DCTSIZE][DCTSIZE] = { { 0 } };
+
+		/* h = sum over i of A[j][i] C[i]^T */
+		for (i = 0; i < xs; i++) {
+			JDIMENSION sx = x * xs + i < width ? x * xs + i : width - 1;
+			const JCOEF* in = rows[j][sx];
+
+			for (a = 0; a < ky; a++) {
+				for (b = 0; b < kx; b++) {
+					if (!in[a * DCTSIZE + b])
+						continue;
+
+					float value = (float)in[a * DCTSIZE + b] * quant[a * DCTSIZE + b];
+					if (xs == 1) {
+						/* C[0] is the identity */
+						h[a][b] = value;
+						continue;
+					}
+					for (u = 0; u < DCTSIZE; u++)
+						h[a][u] += value * cx[i][u][b];
+				}
+			}
+		}
+
+		/* acc += C[j] h, high frequency rows are mostly zero */
+		for (a = 0; a < ky; a++) {
+			for (u = 0; u < DCTSIZE && !h[a][u]; u++)
+				;
+			if (u == DCTSIZE)
+				continue;
+
+			if (ys == 1) {
+				memcpy(acc[a], h[a], sizeof(acc[a]));
+				continue;
+			}
+			for (v = 0; v < DCTSIZE; v++)
+				for (u = 0; u < DCTSIZE; u++)
+					acc[v][u] += cy[j][v][a] * h[a][u];
+		}
+	}
+
+	for (v = 0; v < DCTSIZE; v++) {
+		for (u = 0; u < DCTSIZE; u++) {
+			float q = acc[v][u] / quant[v * DCTSIZE + u];
+			int value = (int)(q + (q > 0 ? 0.5f : -0.5f));
+
+			out[v * DCTSIZE + u] = value > COEF_MAX ? COEF_MAX : value < -COEF_MAX ? -COEF_MAX : value;
+		}
+	}
+}
+
+/**
+ * Bring a frame to a new size and new sampling factors in the DCT domain,
+ * keeping its tables. Every component must shrink by 1, 2 or 4 along each
+ * axis.
+ *
+ * The frame's size, sampling and block counts are changed to the new ones,
+ * so everything after this, down to jpeg_copy_critical_parameters(), sees
+ * the new frame.
+ *
+ * \returns the new coefficient arrays, NULL if a component would not
+ * shrink by a supported factor
+ */
+static jvirt_barray_ptr* coefResample(j_decompress_ptr src, jvirt_barray_ptr* coefs,
+	JDIMENSION width, JDIMENSION height, const int* hSamp, const int* vSamp)
+{
+	float c[COEF_MAX_SCALE + 1][COEF_MAX_SCALE][DCTSIZE][DCTSIZE];
+	JDIMENSION blocksWide[MAX_COMPONENTS], blocksHigh[MAX_COMPONENTS];
+	unsigned int xs[MAX_COMPONENTS], ys[MAX_COMPONENTS];
+	int maxH = 1, maxV = 1, ci;
+
+	for (ci = 0; ci < src->num_components; ci++) {
+		maxH = hSamp[ci] > maxH ? hSamp[ci] : maxH;
+		maxV = vSamp[ci] > maxV ? vSamp[ci] : maxV;
+	}
+
+	for (ci = 0; ci < src->num_components; ci++) {
+		jpeg_component_info* comp = &src->comp_info[ci];
+
+		/* in samples of the component per sample of the output */
+		unsigned long xNum = (unsigned long)src->image_width * comp->h_samp_factor * maxH;
+		unsigned long xDen = (unsigned long)width * hSamp[ci] * src->max_h_samp_factor;
+		unsigned long yNum = (unsigned long)src->image_height * comp->v_samp_factor * maxV;
+		unsigned long yDen = (unsigned long)height * vSamp[ci] * src->max_v_samp_factor;
+		xs[ci] = (xNum + xDen / 2) / xDen;
+		ys[ci] = (yNum + yDen / 2) / yDen;
+		if ((xs[ci] != 1 && xs[ci] != 2 && xs[ci] != 4) || (ys[ci] != 1 && ys[ci] != 2 && ys[ci] != 4))
+			return NULL;
+	}
+
+	scaleMatrix(1, c[1]);
+	scaleMatrix(2, c[2]);
+	scaleMatrix(4, c[4]);
+
+	jvirt_barray_ptr* scaled = (*src->mem->alloc_small)((j_common_ptr)src, JPOOL_IMAGE,
+		src->num_components * sizeof(*scaled));
+	for (ci = 0; ci < src->num_components; ci++) {
+		long wide = (long)maxH * DCTSIZE, high = (long)maxV * DCTSIZE;
+
+		/* as libjpeg sizes them for the new frame */
+		blocksWide[ci] = ((long)width * hSamp[ci] + wide - 1) / wide;
+		blocksHigh[ci] = ((long)height * vSamp[ci] + high - 1) / high;
+		scaled[ci] = (*src->mem->request_virt_barray)((j_common_ptr)src, JPOOL_IMAGE, TRUE,
+			(blocksWide[ci] + hSamp[ci] - 1) / hSamp[ci] * hSamp[ci],
+			(blocksHigh[ci] + vSamp[ci] - 1) / vSamp[ci] * vSamp[ci], vSamp[ci]);
+	}
+	(*src->mem->realize_virt_arrays)((j_common_ptr)src);
+
+	for (ci = 0; ci < src->num_components; ci++) {
+		jpeg_component_info* comp = &src->comp_info[ci];
+		JDIMENSION y, x;
+
+		for (y = 0; y < blocksHigh[ci]; y++) {
+			JBLOCKROW rows[COEF_MAX_SCALE];
+			unsigned int j;
+
+			/* the arrays are all in memory, the rows stay put */
+			for (j = 0; j < ys[ci]; j++) {
+				JDIMENSION sy = y * ys[ci] + j < comp->height_in_blocks
+					? y * ys[ci] + j : comp->height_in_blocks - 1;
+				rows[j] = (*src->mem->access_virt_barray)((j_common_ptr)src, coefs[ci], sy, 1, FALSE)[0];
+			}
+
+			JBLOCKROW out = (*src->mem->access_virt_barray)((j_common_ptr)src, scaled[ci], y, 1, TRUE)[0];
+			if (xs[ci] == 1 && ys[ci] == 1) {
+				JDIMENSION n = blocksWide[ci] < comp->width_in_blocks ? blocksWide[ci] : comp->width_in_blocks;
+
+				memcpy(out, rows[0], n * sizeof(JBLOCK));
+				continue;
+			}
+
+			for (x = 0; x < blocksWide[ci]; x++)
+				scaleBlock(out[x], rows, x, comp->width_in_blocks, xs[ci], ys[ci],
+					c[xs[ci]], c[ys[ci]], comp->quant_table->quantval);
+		}
+
+		comp->h_samp_factor = hSamp[ci];
+		comp->v_samp_factor = vSamp[ci];
+		comp->width_in_blocks = blocksWide[ci];
+		comp->height_in_blocks = blocksHigh[ci];
+	}
+
+	src->max_h_samp_factor = maxH;
+	src->max_v_samp_factor = maxV;
+	src->image_width = width;
+	src->image_height = height;
+	return scaled;
+}
+
+/**
+ * Sampling factors for 4:2:0 chroma: luma gets twice the chroma's sampling
+ * along every axis where it had the same.
+ *
+ * \returns false if the frame is not YCbCr with full size luma
+ */
+static bool chromaSampling(j_decompress_ptr src, int* hSamp, int* vSamp)
+{
+	int ci;
+
+	if (src->num_components != 3 || src->jpeg_color_space != JCS_YCbCr)
+		return false;
+
+	for (ci = 0; ci < 3; ci++) {
+		hSamp[ci] = src->comp_info[ci].h_samp_factor;
+		vSamp[ci] = src->comp_info[ci].v_samp_factor;
+	}
+
+	if (hSamp[0] != src->max_h_samp_factor || vSamp[0] != src->max_v_samp_factor
+			|| hSamp[1] != hSamp[2] || vSamp[1] != vSamp[2])
+		return false;
+
+	if (hSamp[0] == hSamp[1])
+		hSamp[0] *= 2;
+	if (vSamp[0] == vSamp[1])
+		vSamp[0] *= 2;
+	return hSamp[0] <= MAX_SAMP_FACTOR && vSamp[0] <= MAX_SAMP_FACTOR;
+}
+
+/**
+ * Copy all coefficients of a frame out of its arrays, or back into them.
+ */
+static void coefCopy(j_decompress_ptr src, jvirt_barray_ptr* coefs, JBLOCK* saved, bool restore)
+{
+	int c;
+
+	for (c = 0; c < src->num_components; c++) {
+		jpeg_component_info* comp = &src->comp_info[c];
+		JDIMENSION row;
+
+		for (row = 0; row < comp->height_in_blocks; row++) {
+			JBLOCKARRAY blocks = (*src->mem->access_virt_barray)((j_common_ptr)src, coefs[c], row, 1, TRUE);
+
+			if (restore)
+				memcpy(blocks[0], saved, comp->width_in_blocks * sizeof(JBLOCK));
+			else
+				memcpy(saved, blocks[0], comp->width_in_blocks * sizeof(JBLOCK));
+			saved += comp->width_in_blocks;
+		}
+	}
+}
+
+static size_t coefBlocks(j_decompress_ptr src)
+{
+	size_t blocks = 0;
+	int c;
+
+	for (c = 0; c < src->num_components; c++)
+		blocks += (size_t)src->comp_info[c].width_in_blocks * src->comp_info[c].height_in_blocks;
+	return blocks;
+}
+
+bool coefAvailable(void)
+{
+	return true;
+}
+
+/* buffers to free when libjpeg bails out */
+struct coef_buffers {
+	unsigned char* out;
+	unsigned char* best;
+	JBLOCK* saved;
+};
+
+/**
+ * Transform a frame.
+ *
+ * The frame is entropy decoded once, then shrunk and its chroma reduced if
+ * asked to. With a byte cap the quality is searched for, encoding at most
+ * COEF_TRIES times from a saved copy of the coefficients. When no quality
+ * fits the smallest result is returned.
+ *
+ * \param out transformed frame, to be freed by the caller
+ * \param quality quality used, 0 if the tables were kept
+ * \returns 0 if out was set, 1 if the frame needs no change, -1 on error
+ */
+int coefTransform(const unsigned char* in, size_t length, const struct coef_options* o,
+	unsigned char** out, size_t* outLength, int* quality)
+{
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct coef_error err;
+	struct coef_buffers buf = { NULL, NULL, NULL };
+	size_t bestLength = 0;
+	bool cap = o->maxBytes && length > o->maxBytes;
+	bool requant = cap || o->quality;
+	int hi = o->quality ? o->quality : 95, tries;
+
+	*quality = o->quality;
+	if (!requant && o->scale <= 1 && !o->chroma420 && !o->restartRows && !o->progressive
+			&& !o->recode)
+		return 1;
+	if (o->scale > COEF_MAX_SCALE || (o->scale > 1 && DCTSIZE % o->scale))
+		return -1;
+
+	src.err = dst.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = coefFail;
+	err.mgr.output_message = coefQuiet;
+	jpeg_create_decompress(&src);
+	jpeg_create_compress(&dst);
+
+	if (setjmp(err.jump)) {
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		free(buf.out);
+		free(buf.best);
+		free(buf.saved);
+		return -1;
+	}
+
+	jpeg_mem_src(&src, in, length);
+	jpeg_read_header(&src, TRUE);
+	jvirt_barray_ptr* coefs = jpeg_read_coefficients(&src);
+	if (o->scale > 1 || o->chroma420) {
+		int hSamp[MAX_COMPONENTS], vSamp[MAX_COMPONENTS], ci;
+		bool chroma = o->chroma420 && chromaSampling(&src, hSamp, vSamp);
+		unsigned int scale = o->scale > 1 ? o->scale : 1;
+
+		for (ci = 0; ci < src.num_components && !chroma; ci++) {
+			hSamp[ci] = src.comp_info[ci].h_samp_factor;
+			vSamp[ci] = src.comp_info[ci].v_samp_factor;
+		}
+
+		if (scale > 1 || hSamp[0] != src.comp_info[0].h_samp_factor
+				|| vSamp[0] != src.comp_info[0].v_samp_factor) {
+			coefs = coefResample(&src, coefs, (src.image_width + scale - 1) / scale,
+				(src.image_height + scale - 1) / scale, hSamp, vSamp);
+			if (!coefs)
+				(*src.err->error_exit)((j_common_ptr)&src);
+		}
+	}
+
+	if (cap && (buf.saved = malloc(coefBlocks(&src) * sizeof(JBLOCK))))
+		coefCopy(&src, coefs, buf.saved, false);
+
+	/*
+	 * Size grows steadily with quality. Each next guess interpolates
+	 * between the closest results below and above the cap, starting from
+	 * size 0 at quality 0.
+	 */
+	int q = hi, belowQuality = 0, aboveQuality = 0;
+	size_t belowSize = 0, aboveSize = 0;
+	bool fits = false;
+	for (tries = 0; tries < (buf.saved ? COEF_TRIES : 1); tries++) {
+		unsigned long size = 0;
+
+		if (tries)
+			coefCopy(&src, coefs, buf.saved, true);
+
+		jpeg_copy_critical_parameters(&src, &dst);
+		if (requant)
+			requantize(&src, &dst, coefs, q);
+		dst.restart_in_rows = o->restartRows;
+		if (o->progressive)
+			progressiveScans(&dst);
+		dst.optimize_coding = TRUE;
+		buf.out = NULL;
+		jpeg_mem_dest(&dst, &buf.out, &size);
+		jpeg_write_coefficients(&dst, coefs);
+		jpeg_finish_compress(&dst);
+
+		bool under = cap && size <= o->maxBytes;
+		if ((under && q > belowQuality) || (!fits && (!buf.best || size < bestLength))) {
+			free(buf.best);
+			buf.best = buf.out;
+			bestLength = size;
+			*quality = requant ? q : 0;
+		} else {
+			free(buf.out);
+		}
+		buf.out = NULL;
+
+		if (under) {
+			fits = true;
+			belowQuality = q;
+			belowSize = size;
+		} else {
+			aboveQuality = q;
+			aboveSize = size;
+		}
+
+		/* close enough, or nothing left to try */
+		if (!cap || (fits && (q == hi || size >= o->maxBytes - o->maxBytes / 16)))
+			break;
+		if (aboveQuality && aboveQuality - belowQuality <= 1)
+			break;
+
+		int next = belowQuality + (int)((double)(aboveQuality - belowQuality)
+			* (o->maxBytes - belowSize) / (aboveSize - belowSize));
+		if (next <= belowQuality)
+			next = belowQuality + 1;
+		if (next >= aboveQuality)
+			next = aboveQuality - 1;
+		if (next < COEF_MIN_QUALITY) {
+			if (q == COEF_MIN_QUALITY)
+				break;
+			next = COEF_MIN_QUALITY;
+		}
+		q = next;
+	}
+
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_compress(&dst);
+	jpeg_destroy_decompress(&src);
+	free(buf.saved);
+
+	*out = buf.best;
+	*outLength = bestLength;
+	return 0;
+}
+
+/**
+ * Average scale by scale pixels of rows into out, which is width pixels of
+ * components samples wide.
+ */
+static void boxFilter(JSAMPARRAY rows, unsigned int count, unsigned int scale,
+	JDIMENSION inWidth, JDIMENSION width, int components, JSAMPROW out)
+{
+	JDIMENSION x;
+	int c;
+
+	for (x = 0; x < width; x++) {
+		for (c = 0; c < components; c++) {
+			unsigned int sum = 0, n = 0, i, j;
+
+			for (j = 0; j < count; j++) {
+				for (i = 0; i < scale && x * scale + i < inWidth; i++) {
+					sum += rows[j][(x * scale + i) * components + c];
+					n++;
+				}
+			}
+			out[x * components + c] = (sum + n / 2) / n;
+		}
+	}
+}
+
+/**
+ * The pixel domain equivalent of coefTransform() for comparison: decode to
+ * YCbCr, shrink with a box filter and encode again, at a quality or with the
+ * frame's own tables.
+ *
+ * \returns 0 on success, -1 on error
+ */
+int pixelTranscode(const unsigned char* in, size_t length, const struct coef_options* o, int quality,
+	unsigned char** out, size_t* outLength)
+{
+	struct jpeg_decompress_struct src;
+	struct jpeg_compress_struct dst;
+	struct coef_error err;
+	unsigned long size = 0;
+	unsigned int scale = o->scale > 1 ? o->scale : 1;
+	int hSamp[MAX_COMPONENTS], vSamp[MAX_COMPONENTS], c, t;
+
+	*out = NULL;
+	src.err = dst.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = coefFail;
+	err.mgr.output_message = coefQuiet;
+	jpeg_create_decompress(&src);
+	jpeg_create_compress(&dst);
+
+	if (setjmp(err.jump)) {
+		jpeg_destroy_compress(&dst);
+		jpeg_destroy_decompress(&src);
+		free(*out);
+		*out = NULL;
+		return -1;
+	}
+
+	jpeg_mem_src(&src, in, length);
+	jpeg_read_header(&src, TRUE);
+	src.out_color_space = src.jpeg_color_space;
+	jpeg_start_decompress(&src);
+
+	dst.image_width = (src.output_width + scale - 1) / scale;
+	dst.image_height = (src.output_height + scale - 1) / scale;
+	dst.input_components = src.output_components;
+	dst.in_color_space = src.out_color_space;
+	jpeg_set_defaults(&dst);
+	if (quality) {
+		jpeg_set_quality(&dst, quality, TRUE);
+	} else {
+		for (t = 0; t < NUM_QUANT_TBLS; t++) {
+			if (!src.quant_tbl_ptrs[t])
+				continue;
+			if (!dst.quant_tbl_ptrs[t])
+				dst.quant_tbl_ptrs[t] = jpeg_alloc_quant_table((j_common_ptr)&dst);
+			memcpy(dst.quant_tbl_ptrs[t]->quantval, src.quant_tbl_ptrs[t]->quantval,
+				sizeof(src.quant_tbl_ptrs[t]->quantval));
+		}
+	}
+	bool chroma = o->chroma420 && chromaSampling(&src, hSamp, vSamp);
+	for (c = 0; c < src.num_components && c < dst.num_components; c++) {
+		dst.comp_info[c].h_samp_factor = chroma ? hSamp[c] : src.comp_info[c].h_samp_factor;
+		dst.comp_info[c].v_samp_factor = chroma ? vSamp[c] : src.comp_info[c].v_samp_factor;
+		if (!quality)
+			dst.comp_info[c].quant_tbl_no = src.comp_info[c].quant_tbl_no;
+	}
+	dst.optimize_coding = TRUE;
+	dst.restart_in_rows = o->restartRows;
+	if (o->progressive)
+		progressiveScans(&dst);
+	jpeg_mem_dest(&dst, out, &size);
+	jpeg_start_compress(&dst, TRUE);
+
+	JSAMPARRAY rows = (*src.mem->alloc_sarray)((j_common_ptr)&src, JPOOL_IMAGE,
+		src.output_width * src.output_components, scale);
+	JSAMPARRAY shrunk = (*src.mem->alloc_sarray)((j_common_ptr)&src, JPOOL_IMAGE,
+		dst.image_width * dst.input_components, 1);
+	while (src.output_scanline < src.output_height) {
+		unsigned int count = 0;
+
+		while (count < scale && src.output_scanline < src.output_height)
+			count += jpeg_read_scanlines(&src, rows + count, scale - count);
+
+		if (scale == 1) {
+			jpeg_write_scanlines(&dst, rows, 1);
+		} else {
+			boxFilter(rows, count, scale, src.output_width, dst.image_width,
+				src.output_components, shrunk[0]);
+			jpeg_write_scanlines(&dst, shrunk, 1);
+		}
+	}
+
+	jpeg_finish_compress(&dst);
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_compress(&dst);
+	jpeg_destroy_decompress(&src);
+	*outLength = size;
+	return 0;
+}
+
+/**
+ * Decode a frame to luma, or luma and chroma, shrunk by scale with a box
+ * filter.
+ *
+ * \returns the samples, to be freed by the caller, NULL on error
+ */
+static unsigned char* planeDecode(const unsigned char* in, size_t length, unsigned int scale,
+	JDIMENSION* width, JDIMENSION* height, int* components)
+{
+	struct jpeg_decompress_struct src;
+	struct coef_error err;
+	unsigned char* samples = NULL;
+
+	src.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = coefFail;
+	err.mgr.output_message = coefQuiet;
+	jpeg_create_decompress(&src);
+
+	if (setjmp(err.jump)) {
+		jpeg_destroy_decompress(&src);
+		free(samples);
+		return NULL;
+	}
+
+	jpeg_mem_src(&src, in, length);
+	jpeg_read_header(&src, TRUE);
+	src.out_color_space = src.jpeg_color_space == JCS_YCbCr ? JCS_YCbCr : JCS_GRAYSCALE;
+	jpeg_start_decompress(&src);
+
+	*width = (src.output_width + scale - 1) / scale;
+	*height = (src.output_height + scale - 1) / scale;
+	*components = src.output_components;
+	size_t stride = (size_t)*width * *components;
+	samples = malloc(stride * *height);
+	if (!samples) {
+		jpeg_destroy_decompress(&src);
+		return NULL;
+	}
+
+	JSAMPARRAY rows = (*src.mem->alloc_sarray)((j_common_ptr)&src, JPOOL_IMAGE,
+		src.output_width * src.output_components, scale);
+	JDIMENSION y;
+	for (y = 0; src.output_scanline < src.output_height; y++) {
+		unsigned int count = 0;
+
+		while (count < scale && src.output_scanline < src.output_height)
+			count += jpeg_read_scanlines(&src, rows + count, scale - count);
+		boxFilter(rows, count, scale, src.output_width, *width, *components, samples + y * stride);
+	}
+
+	jpeg_finish_decompress(&src);
+	jpeg_destroy_decompress(&src);
+	return samples;
+}
+
+static double psnrOf(double error, double samples)
+{
+	error /= samples;
+	return error > 0 ? 10 * log10(255.0 * 255.0 / error) : 99;
+}
+
+/**
+ * PSNR of a transformed frame against the original, decoded and shrunk by
+ * scale with a box filter. Chroma is compared at full resolution, a frame
+ * without chroma gets 99 dB for it.
+ *
+ * \returns 0 on success, -1 if either frame cannot be decoded
+ */
+int coefPsnr(const unsigned char* original, size_t length, const unsigned char* in, size_t inLength,
+	unsigned int scale, double* luma, double* chroma)
+{
+	JDIMENSION refWidth, refHeight, width, height, x, y;
+	int refComponents, components, c;
+	double error[2] = { 0, 0 };
+
+	unsigned char* ref = planeDecode(original, length, scale ? scale : 1, &refWidth, &refHeight, &refComponents);
+	unsigned char* out = planeDecode(in, inLength, 1, &width, &height, &components);
+	if (!ref || !out || components != refComponents) {
+		free(ref);
+		free(out);
+		return -1;
+	}
+
+	JDIMENSION w = width < refWidth ? width : refWidth;
+	JDIMENSION h = height < refHeight ? height : refHeight;
+	for (y = 0; y < h; y++) {
+		const unsigned char* a = ref + (size_t)y * refWidth * components;
+		const unsigned char* b = out + (size_t)y * width * components;
+
+		for (x = 0; x < w * components; x += components) {
+			for (c = 0; c < components; c++) {
+				int d = a[x + c] - b[x + c];
+
+				error[c > 0] += d * d;
+			}
+		}
+	}
+
+	free(ref);
+	free(out);
+
+	*luma = psnrOf(error[0], (double)w * h);
+	*chroma = components > 1 ? psnrOf(error[1], (double)w * h * (components - 1)) : 99;
+	return 0;
+}
+
+#else
+
+bool coefAvailable(void)
+{
+	return false;
+}
+
+int coefTransform(const unsigned char* in, size_t length, const struct coef_options* o,
+	unsigned char** out, size_t* outLength, int* quality)
+{
+	(void)in;
+	(void)length;
+	(void)o;
+	(void)out;
+	(void)outLength;
+	(void)quality;
+	return -1;
+}
+
+int pixelTranscode(const unsigned char* in, size_t length, const struct coef_options* o, int quality,
+	unsigned char** out, size_t* outLength)
+{
+	(void)in;
+	(void)length;
+	(void)o;
+	(void)quality;
+	(void)out;
+	(void)outLength;
+	return -1;
+}
+
+int coefPsnr(const unsigned char* original, size_t length, const unsigned char* in, size_t inLength,
+	unsigned int scale, double* luma, double* chroma)
+{
+	(void)original;
+	(void)length;
+	(void)in;
+	(void)inLength;
+	(void)scale;
+	(void)luma;
+	(void)chroma;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,34 @@
+/**
+ * JPEG transforms in the coefficient domain.
+ *
+ * Frames are entropy decoded to their quantised DCT coefficients, changed
+ * there and entropy coded again. There is no IDCT, no colour conversion and
+ * no forward DCT, and no generation loss beyond what the transform itself
+ * throws away. Needs libjpeg.
+ */
+
+#ifndef COEF_H
+#define COEF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct coef_options {
+	int quality;        /* requantise to this quality, 0 to keep */
+	size_t maxBytes;    /* requantise frames larger than this, 0 for no cap */
+	unsigned int scale; /* shrink by 2 or 4, 0 or 1 to keep the size */
+	bool chroma420;     /* reduce chroma to 4:2:0 */
+	unsigned int restartRows;  /* restart marker every so many MCU rows, 0 for none */
+	bool progressive;   /* progressive scans, coarse spectrum first */
+	bool recode;        /* entropy code again even if nothing else changes */
+};
+
+bool coefAvailable(void);
+int coefTransform(const unsigned char* in, size_t length, const struct coef_options* o,
+	unsigned char** out, size_t* outLength, int* quality);
+int pixelTranscode(const unsigned char* in, size_t length, const struct coef_options* o, int quality,
+	unsigned char** out, size_t* outLength);
+int coefPsnr(const unsigned char* original, size_t length, const unsigned char* in, size_t inLength,
+	unsigned int scale, double* luma, double* chroma);
+
+#endif
@@ -0,0 +1,148 @@
+/**
+ * Segment decimation, see compact.h.
+ *
+ * Kept frames are copied with copy_file_range(), which on most filesystems
+ * stays in the page cache or shares extents, and never passes through user
+ * space. The new index is built from the old one.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "clock.h"
+#include "compact.h"
+#include "store.h"
+
+/**
+ * Copy a range of one file to the end of another.
+ */
+static int copyRange(int in, int out, off_t offset, size_t length, bool* fallback)
+{
+	while (length) {
+		ssize_t n = -1;
+
+		if (!*fallback) {
+			n = copy_file_range(in, &offset, out, NULL, length, 0);
+			if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+				*fallback = true;
+		}
+		if (*fallback)
+			n = sendfile(out, in, &offset, length);
+
+		if (n <= 0)
+			return -1;
+		length -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Decimate a segment.
+ *
+ * \param path segment to decimate, left untouched
+ * \param dest where to write the decimated segment and its index
+ * \param interval minimum time between kept frames, ns
+ * \param rate copy rate limit, bytes per second
+ * \param saved bytes the decimated segment and index are smaller by
+ * \returns 1 if dest was written, 0 if there was nothing to drop, -1 on error
+ */
+int compactSegment(const char* path, const char* dest, unsigned long long interval,
+	unsigned long long rate, unsigned long long* saved)
+{
+	char name[PATH_MAX + NAME_MAX + 48], destIndex[PATH_MAX + NAME_MAX + 48];
+	struct stat st, data_st;
+	struct index_entry* kept = NULL;
+	const struct index_entry* e = NULL;
+	bool fallback = false;
+	size_t n = 0, count = 0, i;
+	uint64_t copied = 0;
+	int out = -1, outIndex = -1, r = -1;
+
+	snprintf(name, sizeof(name), "%s.idx", path);
+	snprintf(destIndex, sizeof(destIndex), "%s.idx", dest);
+	int data = open(path, O_RDONLY | O_CLOEXEC);
+	int index = open(name, O_RDONLY | O_CLOEXEC);
+	if (data == -1 || index == -1 || fstat(index, &st) == -1 || fstat(data, &data_st) == -1)
+		goto out;
+
+	n = st.st_size / sizeof(*e);
+	if (!n) {
+		r = 0;
+		goto out;
+	}
+
+	e = mmap(NULL, n * sizeof(*e), PROT_READ, MAP_SHARED, index, 0);
+	kept = malloc(n * sizeof(*kept));
+	if (e == MAP_FAILED || !kept) {
+		e = NULL;
+		goto out;
+	}
+
+	/* a clock stepping back restarts the interval */
+	unsigned long long last = 0;
+	for (i = 0; i < n; i++) {
+		if (count && e[i].timestamp >= last && e[i].timestamp - last < interval)
+			continue;
+
+		kept[count++] = e[i];
+		last = e[i].timestamp;
+	}
+
+	if (count == n) {
+		r = 0;
+		goto out;
+	}
+
+	out = open(dest, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	outIndex = open(destIndex, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (out == -1 || outIndex == -1)
+		goto out;
+
+	unsigned long long start = nowNs();
+	for (i = 0; i < count; i++) {
+		if (copyRange(data, out, kept[i].offset, kept[i].length, &fallback) == -1)
+			goto out;
+
+		kept[i].offset = copied;
+		copied += kept[i].length;
+		pace(start, copied, rate);
+	}
+
+	ssize_t size = count * sizeof(*kept);
+	if (write(outIndex, kept, size) != size || fsync(out) == -1 || fsync(outIndex) == -1)
+		goto out;
+
+	*saved = (data_st.st_size - copied) + (st.st_size - size);
+	r = 1;
+
+out:
+	if (r == -1)
+		fprintf(stderr, "Cannot decimate '%s': %d, %s\n", path, errno, strerror(errno));
+	if (out != -1 && close(out) == -1)
+		r = -1;
+	if (outIndex != -1 && close(outIndex) == -1)
+		r = -1;
+	if (r == -1 && out != -1) {
+		unlink(dest);
+		unlink(destIndex);
+	}
+	if (e)
+		munmap((void*)e, n * sizeof(*e));
+	free(kept);
+	if (data != -1)
+		close(data);
+	if (index != -1)
+		close(index);
+	return r;
+}
@@ -0,0 +1,15 @@
+/**
+ * Decimation of recorded segments.
+ *
+ * Rewrites a segment keeping at most one frame per interval, picked by the
+ * index timestamps. The result is written next to the original under a new
+ * name, so the caller can switch the catalog over to it in one step.
+ */
+
+#ifndef COMPACT_H
+#define COMPACT_H
+
+int compactSegment(const char* path, const char* dest, unsigned long long interval,
+	unsigned long long rate, unsigned long long* saved);
+
+#endif
@@ -0,0 +1,355 @@
+/**
+ * CRC-32C, see crc.h.
+ *
+ * The implementation is picked on first use: the crc32 instruction of SSE
+ * 4.2 on x86-64, the CRC32C instructions of ARMv8, or slicing by 8 tables.
+ * The copying variant checksums and searches for the JPEG end marker on
+ * the words it copies, so a frame is read from memory only once.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+#include "clock.h"
+#include "crc.h"
+
+#define CRC32C_POLY 0x82f63b78
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+static uint32_t (*update)(uint32_t crc, const unsigned char* p, size_t length);
+static uint32_t (*copy)(unsigned char* dst, const unsigned char* src, size_t length, size_t* eoi);
+static const char* kind;
+
+struct crc_bench {
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned long long fusedNs;
+	unsigned long long separateNs;
+	unsigned long long mismatches;
+};
+
+static struct crc_bench bench;
+
+/**
+ * Mark the bytes of a little endian word that may be 0xD9. Bytes above a
+ * real one can be marked too, candidates are checked anyway.
+ */
+static inline uint64_t markD9(uint64_t w)
+{
+	uint64_t t = w ^ (ONES * 0xD9);
+
+	return (t - ONES) & ~t & HIGHS;
+}
+
+/**
+ * Position after the last FF D9 among the marked bytes of the word at i.
+ */
+static inline size_t scanEoi(const unsigned char* src, size_t i, uint64_t marks, size_t last)
+{
+	while (marks) {
+		size_t at = i + (__builtin_ctzll(marks) >> 3);
+
+		if (at && src[at] == 0xD9 && src[at - 1] == 0xFF)
+			last = at + 1;
+		marks &= marks - 1;
+	}
+
+	return last;
+}
+
+static inline uint32_t tableByte(uint32_t crc, unsigned char c)
+{
+	return table[0][(crc ^ c) & 0xff] ^ (crc >> 8);
+}
+
+static inline uint32_t tableWord(uint32_t crc, uint64_t w)
+{
+	w ^= crc;
+	return table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff]
+		^ table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff]
+		^ table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff]
+		^ table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+}
+
+static uint32_t tableUpdate(uint32_t crc, const unsigned char* p, size_t length)
+{
+	size_t i = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; i + 8 <= length; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, p + i, sizeof(w));
+		crc = tableWord(crc, w);
+	}
+#endif
+	for (; i < length; i++)
+		crc = tableByte(crc, p[i]);
+	return crc;
+}
+
+static uint32_t tableCopy(unsigned char* dst, const unsigned char* src, size_t length, size_t* eoi)
+{
+	uint32_t crc = ~0U;
+	size_t i = 0, last = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	for (; i + 8 <= length; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, src + i, sizeof(w));
+		memcpy(dst + i, &w, sizeof(w));
+		crc = tableWord(crc, w);
+		if (markD9(w))
+			last = scanEoi(src, i, markD9(w), last);
+	}
+#endif
+	for (; i < length; i++) {
+		dst[i] = src[i];
+		crc = tableByte(crc, src[i]);
+		if (i && src[i] == 0xD9 && src[i - 1] == 0xFF)
+			last = i + 1;
+	}
+
+	*eoi = last;
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t sse42Update(uint32_t crc, const unsigned char* p, size_t length)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, p + i, sizeof(w));
+		crc = _mm_crc32_u64(crc, w);
+	}
+	for (; i < length; i++)
+		crc = _mm_crc32_u8(crc, p[i]);
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t sse42Copy(unsigned char* dst, const unsigned char* src, size_t length, size_t* eoi)
+{
+	uint32_t crc = ~0U;
+	size_t i = 0, last = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, src + i, sizeof(w));
+		memcpy(dst + i, &w, sizeof(w));
+		crc = _mm_crc32_u64(crc, w);
+		if (markD9(w))
+			last = scanEoi(src, i, markD9(w), last);
+	}
+	for (; i < length; i++) {
+		dst[i] = src[i];
+		crc = _mm_crc32_u8(crc, src[i]);
+		if (i && src[i] == 0xD9 && src[i - 1] == 0xFF)
+			last = i + 1;
+	}
+
+	*eoi = last;
+	return ~crc;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t armUpdate(uint32_t crc, const unsigned char* p, size_t length)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, p + i, sizeof(w));
+		crc = __crc32cd(crc, w);
+	}
+	for (; i < length; i++)
+		crc = __crc32cb(crc, p[i]);
+	return crc;
+}
+
+__attribute__((target("+crc")))
+static uint32_t armCopy(unsigned char* dst, const unsigned char* src, size_t length, size_t* eoi)
+{
+	uint32_t crc = ~0U;
+	size_t i = 0, last = 0;
+
+	for (; i + 8 <= length; i += 8) {
+		uint64_t w;
+
+		memcpy(&w, src + i, sizeof(w));
+		memcpy(dst + i, &w, sizeof(w));
+		crc = __crc32cd(crc, w);
+		if (markD9(w))
+			last = scanEoi(src, i, markD9(w), last);
+	}
+	for (; i < length; i++) {
+		dst[i] = src[i];
+		crc = __crc32cb(crc, src[i]);
+		if (i && src[i] == 0xD9 && src[i - 1] == 0xFF)
+			last = i + 1;
+	}
+
+	*eoi = last;
+	return ~crc;
+}
+#endif
+
+static void crcInit(void)
+{
+	uint32_t i, k;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (k = 1; k < 8; k++)
+			table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+
+	update = tableUpdate;
+	copy = tableCopy;
+	kind = "table";
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		update = sse42Update;
+		copy = sse42Copy;
+		kind = "sse4.2";
+	}
+#elif defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		update = armUpdate;
+		copy = armCopy;
+		kind = "armv8 crc";
+	}
+#endif
+}
+
+/**
+ * Continue a CRC-32C over more data. Start with 0.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+	pthread_once(&table_once, crcInit);
+	return ~update(~crc, data, length);
+}
+
+/**
+ * Copy a JPEG, computing its CRC-32C and finding its end on the way.
+ *
+ * \param eoi set to the position after the last FF D9 marker, 0 if none
+ * \returns the CRC-32C of the data
+ */
+uint32_t crc32cCopy(void* dst, const void* src, size_t length, size_t* eoi)
+{
+	pthread_once(&table_once, crcInit);
+	return copy(dst, src, length, eoi);
+}
+
+/**
+ * Name of the implementation in use, for reports.
+ */
+const char* crc32cKind(void)
+{
+	pthread_once(&table_once, crcInit);
+	return kind;
+}
+
+/**
+ * Position after the last FF D9 marker, one byte at a time.
+ */
+static size_t eoiScan(const unsigned char* p, size_t length)
+{
+	size_t i, last = 0;
+
+	for (i = 1; i < length; i++)
+		if (p[i] == 0xD9 && p[i - 1] == 0xFF)
+			last = i + 1;
+	return last;
+}
+
+/**
+ * Time the copy of a frame done both ways: fused, and as separate memcpy,
+ * CRC and EOI scan passes. Which goes first alternates, so each gets the
+ * frame from cold memory half of the time. The CRCs of both, and of the
+ * tables when the instructions are used, and the EOI positions must match.
+ */
+void crc32cBench(const void* src, size_t length)
+{
+	unsigned char* fused = malloc(length);
+	unsigned char* separate = malloc(length);
+
+	pthread_once(&table_once, crcInit);
+	if (!fused || !separate) {
+		free(fused);
+		free(separate);
+		return;
+	}
+
+	uint32_t fusedCrc = 0, separateCrc = 0;
+	size_t fusedEoi = 0, separateEoi = 0;
+	unsigned long long fusedNs = 0, separateNs = 0;
+
+	for (unsigned int pass = 0; pass < 2; pass++) {
+		unsigned long long start = nowNs();
+
+		if ((pass ^ bench.frames) & 1) {
+			memcpy(separate, src, length);
+			separateCrc = ~update(~0U, separate, length);
+			separateEoi = eoiScan(separate, length);
+			separateNs = nowNs() - start;
+		} else {
+			fusedCrc = copy(fused, src, length, &fusedEoi);
+			fusedNs = nowNs() - start;
+		}
+	}
+
+	uint32_t tableCrc = ~tableUpdate(~0U, src, length);
+
+	bench.frames++;
+	bench.bytes += length;
+	bench.fusedNs += fusedNs;
+	bench.separateNs += separateNs;
+	if (fusedCrc != separateCrc || fusedCrc != tableCrc || fusedEoi != separateEoi
+			|| memcmp(fused, separate, length))
+		bench.mismatches++;
+
+	free(fused);
+	free(separate);
+}
+
+void crc32cReport(FILE* fp)
+{
+	if (!bench.frames)
+		return;
+
+	fprintf(fp, "crc32c (%s): %llu frames, fused copy %.3f ms per frame (%.2f GB/s),"
+		" memcpy, crc and eoi scan %.3f ms per frame (%.2f GB/s), %llu mismatches\n",
+		kind, bench.frames, bench.fusedNs / 1e6 / bench.frames,
+		bench.fusedNs ? (double)bench.bytes / bench.fusedNs : 0,
+		bench.separateNs / 1e6 / bench.frames,
+		bench.separateNs ? (double)bench.bytes / bench.separateNs : 0, bench.mismatches);
+}
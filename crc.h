@@ -0,0 +1,19 @@
+/**
+ * CRC-32C (Castagnoli), the checksum of loop recordings. Frames get it
+ * while they are copied out of the driver's buffer.
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+uint32_t crc32cCopy(void* dst, const void* src, size_t length, size_t* eoi);
+const char* crc32cKind(void);
+void crc32cBench(const void* src, size_t length);
+void crc32cReport(FILE* fp);
+
+#endif
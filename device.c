@@ -0,0 +1,543 @@
+/**
+ * Opening and configuring V4L2 devices, see device.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+#include <libv4l2.h>
+
+#include "clock.h"
+#include "device.h"
+#include "flight.h"
+#include "probes.h"
+
+#define CLEAR(x) memset (&(x), 0, sizeof (x))
+#define BUFFER_COUNT 4
+#define BUFFER_MAX VIDEO_MAX_FRAME
+/* after changing the depth, ignore reasons to grow for this long */
+#define QUEUE_HOLDOFF 1000000000ULL
+/* halve the queue after this long without a reason to grow */
+#define QUEUE_QUIET 30000000000ULL
+
+/**
+ *	Do ioctl and retry if error was EINTR ("A signal was caught during the ioctl() operation."). Parameters are the same as on ioctl.
+ *
+ *	\param fd file descriptor
+ *	\param request request
+ *	\param argp argument
+ *	\returns result from ioctl
+*/
+static int xioctl(int fd, unsigned long request, void* argp)
+{
+	int r;
+
+	do r = v4l2_ioctl(fd, request, argp);
+	while (-1 == r && EINTR == errno);
+
+	return r;
+}
+
+static int errnoFail(struct device* dev, const char* s)
+{
+	fprintf(stderr, "%s: %s error %d, %s\n", dev->name, s, errno, strerror(errno));
+	return -1;
+}
+
+/**
+ * Report how long a startup step took when running verbose.
+ *
+ * \param dev device the step was done for
+ * \param step name of the step that just finished
+ */
+void deviceStep(struct device* dev, const char* step)
+{
+	unsigned long long now = nowNs();
+
+	if (dev->verbose)
+		fprintf(stderr, "%s: %-20s %9.3f ms\n", dev->name, step, (now - dev->stepStart) / 1e6);
+	dev->stepStart = now;
+}
+
+/**
+ * Map a buffer the driver allocated.
+ */
+static int bufferMap(struct device* dev, unsigned int index)
+{
+	struct v4l2_buffer buf;
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+
+	if (xioctl(dev->fd, VIDIOC_QUERYBUF, &buf) == -1)
+		return errnoFail(dev, "VIDIOC_QUERYBUF");
+
+	struct buffer* b = &dev->buffers[index];
+	b->length = buf.length;
+	b->queued = false;
+	b->start = v4l2_mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+		dev->fd, buf.m.offset);
+
+	if (b->start == MAP_FAILED) {
+		b->start = NULL;
+		return errnoFail(dev, "mmap");
+	}
+
+	return 0;
+}
+
+static int bufferQueue(struct device* dev, unsigned int index)
+{
+	struct v4l2_buffer buf;
+
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+
+	if (xioctl(dev->fd, VIDIOC_QBUF, &buf) == -1)
+		return errnoFail(dev, "VIDIOC_QBUF");
+
+	dev->buffers[index].queued = true;
+	dev->queued++;
+	return 0;
+}
+
+static int mmapInit(struct device* dev)
+{
+	struct v4l2_requestbuffers req;
+
+	CLEAR(req);
+	req.count = BUFFER_COUNT;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+
+	if (xioctl(dev->fd, VIDIOC_REQBUFS, &req) == -1) {
+		if (errno == EINVAL) {
+			fprintf(stderr, "%s does not support memory mapping\n", dev->name);
+			return -1;
+		}
+		return errnoFail(dev, "VIDIOC_REQBUFS");
+	}
+
+	if (req.count < 2) {
+		fprintf(stderr, "Insufficient buffer memory on %s\n", dev->name);
+		return -1;
+	}
+
+	/* room for all the buffers the queue may grow to */
+	dev->buffers = calloc(BUFFER_MAX, sizeof(*dev->buffers));
+	if (!dev->buffers) {
+		fprintf (stderr, "Out of memory\n");
+		return -1;
+	}
+
+	for (dev->n_buffers = 0; dev->n_buffers < req.count; dev->n_buffers++)
+		if (bufferMap(dev, dev->n_buffers) == -1)
+			return -1;
+
+	dev->depth = dev->maxDepth = req.count;
+#ifdef V4L2_BUF_CAP_SUPPORTS_REMOVE_BUFS
+	dev->removable = req.capabilities & V4L2_BUF_CAP_SUPPORTS_REMOVE_BUFS;
+#endif
+	return 0;
+}
+
+int deviceInit(struct device* dev, unsigned int width, unsigned int height, unsigned int fps)
+{
+	struct v4l2_capability cap;
+	struct v4l2_format fmt;
+	struct v4l2_streamparm frameint;
+
+	if (xioctl(dev->fd, VIDIOC_QUERYCAP, &cap) == -1) {
+		if (errno == EINVAL) {
+			fprintf(stderr, "%s is no V4L2 device\n", dev->name);
+			return -1;
+		} else {
+			return errnoFail(dev, "VIDIOC_QUERYCAP");
+		}
+	}
+
+	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+		fprintf(stderr, "%s is no video capture device\n", dev->name);
+		return -1;
+	}
+
+	if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+		fprintf(stderr, "%s does not support streaming i/o\n", dev->name);
+		return -1;
+	}
+
+	deviceStep(dev, "VIDIOC_QUERYCAP");
+
+	/* Select video input, video standard and tune here. */
+	CLEAR(fmt);
+
+	/*
+	 * S_FMT renegotiates with the camera even when nothing changes, which
+	 * for UVC means USB control transfers. Skip it if the device is already
+	 * set up the way we want it.
+	 */
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	bool fmtSet = xioctl(dev->fd, VIDIOC_G_FMT, &fmt) == 0
+		&& fmt.fmt.pix.width == width
+		&& fmt.fmt.pix.height == height
+		&& fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG;
+
+	deviceStep(dev, "VIDIOC_G_FMT");
+
+	if (!fmtSet) {
+		CLEAR(fmt);
+
+		// v4l2_format
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		fmt.fmt.pix.width = width;
+		fmt.fmt.pix.height = height;
+		fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
+
+		/* Set a video format for the v4l2 driver */
+		if (xioctl(dev->fd, VIDIOC_S_FMT, &fmt) == -1)
+			return errnoFail(dev, "VIDIOC_S_FMT");
+
+		deviceStep(dev, "VIDIOC_S_FMT");
+	}
+
+	if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG) {
+		fprintf(stderr,"%s: Libv4l didn't accept MJPEG format. Can't proceed.\n", dev->name);
+		return -1;
+	}
+
+	CLEAR(frameint);
+
+	/* Same for the frame interval */
+	frameint.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	bool parmSet = xioctl(dev->fd, VIDIOC_G_PARM, &frameint) == 0
+		&& frameint.parm.capture.timeperframe.numerator == 1
+		&& frameint.parm.capture.timeperframe.denominator == fps;
+
+	deviceStep(dev, "VIDIOC_G_PARM");
+
+	if (!parmSet) {
+		CLEAR(frameint);
+
+		/* Attempt to set the frame interval. */
+		frameint.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		frameint.parm.capture.timeperframe.numerator = 1;
+		frameint.parm.capture.timeperframe.denominator = fps;
+		if (xioctl(dev->fd, VIDIOC_S_PARM, &frameint) == -1)
+			fprintf(stderr,"%s: Unable to set frame interval.\n", dev->name);
+
+		deviceStep(dev, "VIDIOC_S_PARM");
+	}
+
+	if (mmapInit(dev) == -1)
+		return -1;
+	dev->interval = fps ? 1000000000ULL / fps : 0;
+
+	deviceStep(dev, "buffer setup");
+	dev->initNs = nowNs() - dev->openStart;
+
+	return 0;
+}
+
+void deviceUninit(struct device* dev)
+{
+	struct v4l2_requestbuffers req;
+	unsigned int i;
+
+	if (!dev->buffers)
+		return;
+
+	deviceStreamOff(dev);
+
+	for (i = 0; i < dev->n_buffers; i++)
+		if (dev->buffers[i].start && v4l2_munmap(dev->buffers[i].start, dev->buffers[i].length) == -1)
+			errnoFail(dev, "munmap");
+
+	/* hand the buffers back to the driver, failure is harmless on close */
+	CLEAR(req);
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	xioctl(dev->fd, VIDIOC_REQBUFS, &req);
+
+	free(dev->buffers);
+	dev->buffers = NULL;
+	dev->n_buffers = 0;
+}
+
+/**
+ * Queue the buffers and start streaming. Buffers stay mapped across
+ * deviceStreamOff() and deviceStreamOn() cycles.
+ */
+int deviceStreamOn(struct device* dev)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+
+	for (i = 0; i < dev->depth; i++)
+		if (bufferQueue(dev, i) == -1)
+			return -1;
+
+	if (xioctl(dev->fd, VIDIOC_STREAMON, &type) == -1)
+		return errnoFail(dev, "VIDIOC_STREAMON");
+
+	dev->streaming = true;
+	dev->haveSequence = false;
+	return 0;
+}
+
+/**
+ * Stop streaming. The driver returns all buffers to us.
+ */
+int deviceStreamOff(struct device* dev)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+
+	if (!dev->streaming)
+		return 0;
+
+	dev->streaming = false;
+	for (i = 0; i < dev->n_buffers; i++)
+		dev->buffers[i].queued = false;
+	dev->queued = 0;
+
+	if (xioctl(dev->fd, VIDIOC_STREAMOFF, &type) == -1)
+		return errnoFail(dev, "VIDIOC_STREAMOFF");
+
+	return 0;
+}
+
+/**
+ * Double the queue, using buffers set aside by queueShrink() first and
+ * creating the rest. Buffers are created while streaming, so this costs a
+ * few ms once instead of frames every time the writer stalls.
+ *
+ * \param held index of the buffer the caller holds, deviceRequeue() queues it
+ */
+static void queueGrow(struct device* dev, enum queue_trigger trigger, unsigned int held)
+{
+	unsigned long long now = nowNs();
+	unsigned int target = dev->depth * 2 < BUFFER_MAX ? dev->depth * 2 : BUFFER_MAX;
+	unsigned int i;
+
+	dev->lastTrigger = now;
+	if (dev->depth >= BUFFER_MAX || now - dev->lastChange < QUEUE_HOLDOFF)
+		return;
+
+	if (target > dev->n_buffers && !dev->fixedDepth) {
+		struct v4l2_create_buffers create;
+
+		CLEAR(create);
+		create.count = target - dev->n_buffers;
+		create.memory = V4L2_MEMORY_MMAP;
+		create.format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+		if (xioctl(dev->fd, VIDIOC_G_FMT, &create.format) == -1
+				|| xioctl(dev->fd, VIDIOC_CREATE_BUFS, &create) == -1
+				|| create.index != dev->n_buffers) {
+			fprintf(stderr, "%s: cannot add capture buffers, queue depth stays %u\n",
+				dev->name, dev->n_buffers);
+			dev->fixedDepth = true;
+		} else {
+			for (i = 0; i < create.count && bufferMap(dev, dev->n_buffers) == 0; i++)
+				dev->n_buffers++;
+		}
+	}
+
+	if (target > dev->n_buffers)
+		target = dev->n_buffers;
+	if (target <= dev->depth)
+		return;
+
+	/* set aside buffers may still be with the driver */
+	for (i = dev->depth; i < target; i++)
+		if (i != held && !dev->buffers[i].queued && bufferQueue(dev, i) == -1)
+			break;
+
+	dev->depth = i;
+	if (dev->depth > dev->maxDepth)
+		dev->maxDepth = dev->depth;
+	dev->grown[trigger]++;
+	dev->lastChange = now;
+	flightRecord(FLIGHT_DEPTH, dev->index, dev->lastSequence, dev->depth);
+}
+
+/**
+ * Free the buffers above the depth once the driver gave them all back.
+ */
+static void queueRelease(struct device* dev)
+{
+#ifdef VIDIOC_REMOVE_BUFS
+	struct v4l2_remove_buffers remove;
+	unsigned int i;
+
+	if (!dev->removable)
+		return;
+
+	for (i = dev->depth; i < dev->n_buffers; i++)
+		if (dev->buffers[i].queued)
+			return;
+
+	for (i = dev->depth; i < dev->n_buffers; i++)
+		v4l2_munmap(dev->buffers[i].start, dev->buffers[i].length);
+
+	CLEAR(remove);
+	remove.index = dev->depth;
+	remove.count = dev->n_buffers - dev->depth;
+	remove.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (xioctl(dev->fd, VIDIOC_REMOVE_BUFS, &remove) == -1) {
+		errnoFail(dev, "VIDIOC_REMOVE_BUFS");
+		dev->removable = false;
+	}
+
+	/* unmapped either way, created again when needed */
+	dev->n_buffers = dev->depth;
+#else
+	(void)dev;
+#endif
+}
+
+/**
+ * Halve the queue after a quiet period. Buffers above the new depth are
+ * not given back to the driver when they come in.
+ */
+static void queueShrink(struct device* dev)
+{
+	unsigned long long now = nowNs();
+	unsigned long long last = dev->lastTrigger > dev->lastChange ? dev->lastTrigger : dev->lastChange;
+
+	if (dev->depth <= BUFFER_COUNT || now - last < QUEUE_QUIET)
+		return;
+
+	dev->depth = dev->depth / 2 > BUFFER_COUNT ? dev->depth / 2 : BUFFER_COUNT;
+	dev->shrunk++;
+	dev->lastChange = now;
+	flightRecord(FLIGHT_DEPTH, dev->index, dev->lastSequence, dev->depth);
+}
+
+/**
+ * Dequeue a filled buffer. Gaps in the driver's sequence numbers are frames
+ * the driver dropped because we did not give buffers back in time. Drops,
+ * frames that waited in the queue for half as many frame intervals as
+ * there are buffers and a driver down to its last quarter of buffers all
+ * deepen the queue.
+ *
+ * \param dev streaming device
+ * \param buf receives the buffer, hand it back with deviceRequeue()
+ * \returns 1 if a frame was dequeued, 0 if none was ready, -1 on error
+ */
+int deviceDequeue(struct device* dev, struct v4l2_buffer* buf)
+{
+	CLEAR(*buf);
+	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf->memory = V4L2_MEMORY_MMAP;
+
+	if (xioctl(dev->fd, VIDIOC_DQBUF, buf) == -1) {
+		if (errno == EAGAIN)
+			return 0;
+		return errnoFail(dev, "VIDIOC_DQBUF");
+	}
+
+	unsigned long long now = nowNs();
+	PROBE4(frame_dequeue, dev->name, buf->sequence, buf->bytesused, now);
+
+	if (buf->index < dev->n_buffers && dev->buffers[buf->index].queued) {
+		dev->buffers[buf->index].queued = false;
+		dev->queued--;
+	}
+
+	if (dev->haveSequence && buf->sequence != dev->lastSequence + 1) {
+		unsigned int lost = buf->sequence - dev->lastSequence - 1;
+
+		PROBE3(frame_drop, dev->name, buf->sequence, lost);
+		flightTrigger(FLIGHT_DROP, dev->index, buf->sequence, lost);
+		dev->dropped += lost;
+		queueGrow(dev, QUEUE_DROP, buf->index);
+	}
+	dev->haveSequence = true;
+	dev->lastSequence = buf->sequence;
+
+	unsigned long long captured = (unsigned long long)buf->timestamp.tv_sec * 1000000000ULL
+		+ buf->timestamp.tv_usec * 1000ULL;
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+			&& dev->interval && now > captured + dev->depth * dev->interval / 2)
+		queueGrow(dev, QUEUE_LATE, buf->index);
+	else if (dev->queued * 4 <= dev->depth)
+		queueGrow(dev, QUEUE_LOW, buf->index);
+
+	return 1;
+}
+
+/**
+ * Give a dequeued buffer back to the driver, unless the queue shrank below
+ * it.
+ */
+int deviceRequeue(struct device* dev, struct v4l2_buffer* buf)
+{
+	PROBE4(frame_requeue, dev->name, buf->sequence, buf->index, nowNs());
+
+	queueShrink(dev);
+	if (buf->index >= dev->depth) {
+		queueRelease(dev);
+		return 0;
+	}
+
+	if (xioctl(dev->fd, VIDIOC_QBUF, buf) == -1)
+		return errnoFail(dev, "VIDIOC_QBUF");
+
+	dev->buffers[buf->index].queued = true;
+	dev->queued++;
+	return 0;
+}
+
+/**
+ * Print how the capture queue depth changed.
+ */
+void deviceReport(FILE* fp, const struct device* dev)
+{
+	fprintf(fp, "%s: %llu frames dropped by the driver, queue depth %u, max %u, "
+		"grew %llu times (%llu drops, %llu late, %llu low), shrank %llu times\n",
+		dev->name, dev->dropped, dev->depth, dev->maxDepth,
+		dev->grown[QUEUE_DROP] + dev->grown[QUEUE_LATE] + dev->grown[QUEUE_LOW],
+		dev->grown[QUEUE_DROP], dev->grown[QUEUE_LATE], dev->grown[QUEUE_LOW], dev->shrunk);
+}
+
+int deviceClose(struct device* dev)
+{
+	if (dev->fd == -1)
+		return 0;
+
+	int r = v4l2_close(dev->fd);
+	dev->fd = -1;
+
+	if (r == -1)
+		return errnoFail(dev, "close");
+
+	return 0;
+}
+
+int deviceOpen(struct device* dev)
+{
+	dev->openStart = dev->stepStart = nowNs();
+
+	// open device
+	dev->fd = v4l2_open(dev->name, O_RDWR | O_NONBLOCK, 0);
+
+	// check if opening was successfull
+	if (dev->fd == -1) {
+		fprintf(stderr, "Cannot open '%s': %d, %s\n", dev->name, errno, strerror(errno));
+		return -1;
+	}
+
+	deviceStep(dev, "v4l2_open");
+	return 0;
+}
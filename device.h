@@ -0,0 +1,83 @@
+/**
+ * V4L2 capture device handling.
+ *
+ * Functions report problems on stderr and return -1 instead of exiting, so
+ * one broken camera does not take the others down with it.
+ *
+ * Capture starts with a few buffers. When frames are dropped, dequeued late
+ * or the driver runs low on buffers the queue doubles, with
+ * VIDIOC_CREATE_BUFS while streaming, up to the V4L2 limit. After a quiet
+ * half minute it halves again: buffers above the new depth are no longer
+ * given back to the driver and, where the driver supports
+ * VIDIOC_REMOVE_BUFS, freed.
+ */
+
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/videodev2.h>
+
+/* reasons to deepen the capture queue */
+enum queue_trigger {
+	QUEUE_DROP,  /* the driver dropped frames */
+	QUEUE_LATE,  /* a frame waited for half the queue's worth of intervals */
+	QUEUE_LOW,   /* the driver was down to its last buffers */
+	QUEUE_TRIGGERS
+};
+
+struct buffer {
+	void* start;
+	size_t length;
+	bool queued;  /* held by the driver */
+};
+
+struct device {
+	const char* name;
+	const char* output;
+	unsigned int index;
+	int fd;
+	struct buffer* buffers;
+	unsigned int n_buffers;
+	bool streaming;
+	bool haveSequence;
+	unsigned int lastSequence;
+	unsigned int sequence;
+	bool verbose;
+	bool failed;
+	unsigned long long openStart;
+	unsigned long long stepStart;
+	unsigned long long initNs;
+
+	/* adaptive queue depth, see deviceDequeue() */
+	unsigned int depth;               /* buffers kept queued */
+	unsigned int queued;              /* buffers the driver holds */
+	unsigned int maxDepth;
+	bool fixedDepth;                  /* driver cannot add buffers */
+	bool removable;                   /* driver can free buffers */
+	unsigned long long interval;      /* frame interval, ns */
+	unsigned long long lastTrigger;   /* nowNs() of the last reason to grow */
+	unsigned long long lastChange;
+	unsigned long long grown[QUEUE_TRIGGERS];
+	unsigned long long shrunk;
+	unsigned long long dropped;       /* frames the driver dropped */
+
+	/* camera clock timestamps, see meta.h */
+	const char* metaName;             /* UVC metadata node, NULL for none */
+	struct meta* meta;
+};
+
+int deviceOpen(struct device* dev);
+int deviceInit(struct device* dev, unsigned int width, unsigned int height, unsigned int fps);
+void deviceUninit(struct device* dev);
+int deviceClose(struct device* dev);
+void deviceStep(struct device* dev, const char* step);
+int deviceStreamOn(struct device* dev);
+int deviceStreamOff(struct device* dev);
+int deviceDequeue(struct device* dev, struct v4l2_buffer* buf);
+int deviceRequeue(struct device* dev, struct v4l2_buffer* buf);
+void deviceReport(FILE* fp, const struct device* dev);
+
+#endif
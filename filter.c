@@ -0,0 +1,429 @@
+/**
+ * Frame filters, see filter.h.
+ *
+ * A frame the filters cannot parse is passed on unchanged. Smaller results
+ * are copied over the original frame, larger ones get a new frame.
+ *
+ * The filter threads are started with the first batch and shared by all
+ * writers. A batch is queued for them and its writer works on it too, then
+ * waits until the last of its frames is done. Frames are claimed one at a
+ * time, so batches of different writers are worked on side by side.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "clock.h"
+#include "coef.h"
+#include "filter.h"
+#include "writer.h"
+
+#define FILTER_MAX_THREADS 64
+
+struct filter_stats {
+	unsigned long long frames;
+	unsigned long long failed;
+	unsigned long long in;
+	unsigned long long out;
+	unsigned long long ns;
+	unsigned long long pixelFrames;
+	unsigned long long pixelOut;
+	unsigned long long pixelNs;
+	unsigned long long plainOut;   /* the same frames baseline, without restart markers */
+	unsigned long long psnrFrames;
+	unsigned long long coefPsnr;   /* 1/1000 dB */
+	unsigned long long pixelPsnr;
+	unsigned long long coefChroma;
+	unsigned long long pixelChroma;
+};
+
+struct batch {
+	struct batch* next;
+	struct frame** frames;
+	unsigned int n;
+	unsigned int claimed;
+	unsigned int done;
+};
+
+static struct coef_options options;
+static unsigned int filter_threads = 4;
+static bool bench;
+static struct filter_stats stats;
+
+static pthread_t workers[FILTER_MAX_THREADS];
+static unsigned int worker_count;
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+static bool stopping;
+static struct batch* queue;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+
+void filterQuality(int quality)
+{
+	options.quality = quality;
+}
+
+void filterMaxBytes(size_t bytes)
+{
+	options.maxBytes = bytes;
+}
+
+/**
+ * Shrink frames flagged FRAME_SCALE to 1/2 or 1/4 of their size.
+ *
+ * \returns 0 on success, -1 if the scale is not supported
+ */
+int filterScale(unsigned int scale)
+{
+	if (scale != 2 && scale != 4) {
+		fprintf(stderr, "Frames can be shrunk by 2 or 4, not %u\n", scale);
+		return -1;
+	}
+
+	options.scale = scale;
+	return 0;
+}
+
+/**
+ * \returns what frames are shrunk by, 0 if they are not
+ */
+unsigned int filterScaling(void)
+{
+	return options.scale;
+}
+
+/**
+ * Put a restart marker every rows MCU rows, so frames can be decoded in
+ * parallel and decoding can resync after corrupt data.
+ */
+void filterRestart(unsigned int rows)
+{
+	options.restartRows = rows;
+}
+
+/**
+ * Write frames as progressive JPEG, so previews over slow links sharpen
+ * as they load instead of filling in top down.
+ */
+void filterProgressive(bool progressive)
+{
+	options.progressive = progressive;
+}
+
+/**
+ * Reduce the chroma of YCbCr frames to 4:2:0.
+ */
+void filterChroma(bool reduce)
+{
+	options.chroma420 = reduce;
+}
+
+void filterThreads(unsigned int threads)
+{
+	if (threads)
+		filter_threads = threads;
+}
+
+/**
+ * Also time the pixel domain path on every frame, for comparison.
+ */
+void filterBench(bool on)
+{
+	bench = on;
+}
+
+bool filterEnabled(void)
+{
+	return options.quality || options.maxBytes || options.scale || options.chroma420
+		|| options.restartRows || options.progressive;
+}
+
+/**
+ * \returns 0 if the filters asked for can be run, -1 if not
+ */
+int filterCheck(void)
+{
+	if (filterEnabled() && !coefAvailable()) {
+		fprintf(stderr, "Frame filters need libjpeg, rebuild with it installed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Time the pixel domain path on a frame and compare the quality of both.
+ * With restart markers or progressive scans also measure what they change
+ * in size.
+ */
+static void filterCompare(const struct frame* f, const struct coef_options* o,
+	const unsigned char* out, size_t length, int quality)
+{
+	unsigned char* pixel;
+	size_t pixelLength;
+	double coef, coefChroma, ref, refChroma;
+
+	if (o->restartRows || o->progressive) {
+		struct coef_options plain = *o;
+		int unused;
+
+		plain.restartRows = 0;
+		plain.progressive = false;
+		plain.recode = true;
+		int r = coefTransform(f->data, f->length, &plain, &pixel, &pixelLength, &unused);
+		if (r == 0)
+			free(pixel);
+		__atomic_add_fetch(&stats.plainOut, r == 0 ? pixelLength : f->length, __ATOMIC_RELAXED);
+	}
+
+	unsigned long long start = nowNs();
+	if (pixelTranscode(f->data, f->length, o, quality, &pixel, &pixelLength) == -1)
+		return;
+
+	__atomic_add_fetch(&stats.pixelNs, nowNs() - start, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.pixelOut, pixelLength, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.pixelFrames, 1, __ATOMIC_RELAXED);
+
+	if (coefPsnr(f->data, f->length, out, length, o->scale, &coef, &coefChroma) == 0
+			&& coefPsnr(f->data, f->length, pixel, pixelLength, o->scale, &ref, &refChroma) == 0) {
+		__atomic_add_fetch(&stats.coefPsnr, (unsigned long long)(coef * 1000), __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats.pixelPsnr, (unsigned long long)(ref * 1000), __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats.coefChroma, (unsigned long long)(coefChroma * 1000), __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats.pixelChroma, (unsigned long long)(refChroma * 1000), __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats.psnrFrames, 1, __ATOMIC_RELAXED);
+	}
+
+	free(pixel);
+}
+
+static void filterJob(struct frame** frames, unsigned int index)
+{
+	struct frame* f = frames[index];
+	struct coef_options o = options;
+	unsigned char* out;
+	size_t length;
+	int quality;
+
+	if (!(f->flags & FRAME_SCALE))
+		o.scale = 0;
+
+	unsigned long long start = nowNs();
+	int r = coefTransform(f->data, f->length, &o, &out, &length, &quality);
+	unsigned long long end = nowNs();
+
+	__atomic_add_fetch(&stats.frames, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.in, f->length, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.ns, end - start, __ATOMIC_RELAXED);
+
+	if (r == 0 && bench)
+		filterCompare(f, &o, out, length, quality);
+
+	if (r == -1)
+		__atomic_add_fetch(&stats.failed, 1, __ATOMIC_RELAXED);
+	if (r != 0) {
+		__atomic_add_fetch(&stats.out, f->length, __ATOMIC_RELAXED);
+		return;
+	}
+
+	__atomic_add_fetch(&stats.out, length, __ATOMIC_RELAXED);
+	f->flags &= ~FRAME_CRC;
+	if (length <= f->length) {
+		memcpy(f->data, out, length);
+		f->length = length;
+	} else {
+		struct frame* g = frameAlloc(length);
+
+		if (g) {
+			memcpy(g, f, sizeof(*g));
+			memcpy(g->data, out, length);
+			g->length = length;
+			frames[index] = g;
+		}
+	}
+
+	free(out);
+}
+
+/**
+ * Claim the next frame of a queued batch, taking the batch off the queue
+ * with its last frame. Called with the lock held.
+ */
+static unsigned int batchClaim(struct batch* b)
+{
+	struct batch** p;
+	unsigned int index = b->claimed++;
+
+	if (b->claimed == b->n) {
+		for (p = &queue; *p != b; p = &(*p)->next)
+			;
+		*p = b->next;
+	}
+
+	return index;
+}
+
+/**
+ * Filter one claimed frame, with the lock held on entry and return.
+ */
+static void batchRun(struct batch* b, unsigned int index)
+{
+	pthread_mutex_unlock(&lock);
+	filterJob(b->frames, index);
+	pthread_mutex_lock(&lock);
+
+	if (++b->done == b->n)
+		pthread_cond_broadcast(&finished);
+}
+
+static void* filterThread(void* arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!queue && !stopping)
+			pthread_cond_wait(&work, &lock);
+		if (!queue)
+			break;
+
+		struct batch* b = queue;
+		batchRun(b, batchClaim(b));
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/**
+ * Start the filter threads, the writers count as one.
+ */
+static void filterStart(void)
+{
+	unsigned int i;
+
+	for (i = 1; i < filter_threads && worker_count < FILTER_MAX_THREADS; i++) {
+		int err = pthread_create(&workers[worker_count], NULL, filterThread, NULL);
+		if (err) {
+			fprintf(stderr, "pthread_create error %d, %s\n", err, strerror(err));
+			break;
+		}
+		worker_count++;
+	}
+}
+
+/**
+ * Stop the filter threads once no more batches come.
+ */
+void filterStop(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&work);
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < worker_count; i++)
+		pthread_join(workers[i], NULL);
+	worker_count = 0;
+}
+
+/**
+ * Run the filters over a list of frames, keeping its order.
+ *
+ * \param growth set to how many bytes the frames grew, negative if shrunk
+ * \returns the new list
+ */
+struct frame* filterList(struct frame* list, long long* growth)
+{
+	struct frame* f;
+	struct frame** link;
+	size_t n = 0, i = 0;
+	long long before = 0, after = 0;
+
+	*growth = 0;
+	if (!filterEnabled())
+		return list;
+
+	for (f = list; f; f = f->next)
+		if (!(f->flags & FRAME_CLOSE))
+			n++;
+
+	struct frame** frames = n ? malloc(n * sizeof(*frames)) : NULL;
+	if (!frames)
+		return list;
+
+	for (f = list; f; f = f->next) {
+		if (!(f->flags & FRAME_CLOSE)) {
+			frames[i++] = f;
+			before += f->length;
+		}
+	}
+
+	struct batch b = { NULL, frames, n, 0, 0 };
+
+	pthread_once(&workers_once, filterStart);
+	struct batch** last;
+
+	pthread_mutex_lock(&lock);
+	for (last = &queue; *last; last = &(*last)->next)
+		;
+	*last = &b;
+	pthread_cond_broadcast(&work);
+	while (b.claimed < b.n)
+		batchRun(&b, batchClaim(&b));
+	while (b.done < b.n)
+		pthread_cond_wait(&finished, &lock);
+	pthread_mutex_unlock(&lock);
+
+	for (link = &list, i = 0; *link; link = &(*link)->next) {
+		f = *link;
+		if (f->flags & FRAME_CLOSE)
+			continue;
+
+		struct frame* g = frames[i++];
+		if (g != f) {
+			g->next = f->next;
+			*link = g;
+			frameFree(f);
+		}
+		after += g->length;
+	}
+
+	free(frames);
+	*growth = after - before;
+	return list;
+}
+
+void filterReport(FILE* fp)
+{
+	if (!stats.frames)
+		return;
+
+	fprintf(fp, "filter: %llu frames, %llu unreadable, %.1f MB in, %.1f MB out (%.1f%%), %.2f ms per frame\n",
+		stats.frames, stats.failed, stats.in / 1e6, stats.out / 1e6,
+		stats.in ? 100.0 * stats.out / stats.in : 0, stats.ns / 1e6 / stats.frames);
+
+	if (stats.plainOut)
+		fprintf(fp, "  %s: %+.2f%% size against baseline\n",
+			!options.progressive ? "restart markers" : options.restartRows
+				? "progressive scans and restart markers" : "progressive scans",
+			100.0 * ((double)stats.out - stats.plainOut) / stats.plainOut);
+
+	if (stats.pixelFrames)
+		fprintf(fp, "  pixel domain: %.2f ms per frame, %.1f MB out, coefficient domain %.1fx faster\n",
+			stats.pixelNs / 1e6 / stats.pixelFrames, stats.pixelOut / 1e6,
+			stats.ns ? (double)stats.pixelNs / stats.pixelFrames / ((double)stats.ns / stats.frames) : 0);
+
+	if (stats.psnrFrames)
+		fprintf(fp, "  PSNR against the original%s: coefficient domain luma %.2f dB, chroma %.2f dB,"
+			" pixel domain luma %.2f dB, chroma %.2f dB\n",
+			options.scale ? " shrunk with a box filter" : "",
+			stats.coefPsnr / 1e3 / stats.psnrFrames, stats.coefChroma / 1e3 / stats.psnrFrames,
+			stats.pixelPsnr / 1e3 / stats.psnrFrames, stats.pixelChroma / 1e3 / stats.psnrFrames);
+}
@@ -0,0 +1,38 @@
+/**
+ * Frame filters.
+ *
+ * Optional coefficient domain transforms (see coef.h) applied to frames on
+ * their way to disk. Each writer thread runs them over a whole batch before
+ * writing it, spread over filter threads shared by all writers, so capture
+ * never waits for them. Extraction (-x) runs the same filters, which makes it a batch
+ * converter for recordings.
+ *
+ * Shrinking applies to frames flagged FRAME_SCALE: the copies the store
+ * makes for a camera's small secondary stream, and all frames extracted.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct frame;
+
+void filterQuality(int quality);
+void filterMaxBytes(size_t bytes);
+int filterScale(unsigned int scale);
+unsigned int filterScaling(void);
+void filterChroma(bool reduce);
+void filterRestart(unsigned int rows);
+void filterProgressive(bool progressive);
+void filterThreads(unsigned int threads);
+void filterBench(bool bench);
+bool filterEnabled(void);
+int filterCheck(void);
+struct frame* filterList(struct frame* list, long long* growth);
+void filterStop(void);
+void filterReport(FILE* fp);
+
+#endif
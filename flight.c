@@ -0,0 +1,168 @@
+/**
+ * Always on event rings, see flight.h.
+ *
+ * Recording is a clock read and a 24 byte store into memory owned by the
+ * calling thread. Rings are registered on a lock free list the first time a
+ * thread records and are never freed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "clock.h"
+#include "flight.h"
+
+#define FLIGHT_CAPACITY 16384
+
+struct flight_ring {
+	struct flight_ring* next;
+	long tid;
+	unsigned long head;
+	struct flight_event events[FLIGHT_CAPACITY];
+};
+
+static const char* flightPath;
+static unsigned long long window = 10ULL * 1000000000ULL;
+static unsigned long long lastDump;
+static unsigned int dumps;
+static struct flight_ring* rings;
+static __thread struct flight_ring* local;
+
+static struct flight_ring* localRing(void)
+{
+	if (local)
+		return local;
+
+	struct flight_ring* r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->tid = syscall(SYS_gettid);
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	local = r;
+	return r;
+}
+
+/**
+ * Set where dumps go and how much history they contain.
+ *
+ * \param path dump file prefix, dumps are disabled when NULL
+ * \param seconds length of the window written on a dump
+ */
+void flightInit(const char* path, unsigned int seconds)
+{
+	flightPath = path;
+	window = seconds * 1000000000ULL;
+}
+
+/**
+ * Append an event to the calling thread's ring.
+ */
+void flightRecord(enum flight_type type, unsigned int device, uint32_t seq, uint32_t value)
+{
+	struct flight_ring* r = localRing();
+
+	if (!r)
+		return;
+
+	unsigned long head = r->head;
+	struct flight_event* e = &r->events[head % FLIGHT_CAPACITY];
+
+	e->timestamp = nowNs();
+	e->seq = seq;
+	e->value = value;
+	e->type = type;
+	e->device = device;
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void dumpRing(FILE* fp, const struct flight_ring* r, unsigned long long since)
+{
+	static struct flight_event copy[FLIGHT_CAPACITY];
+	unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	unsigned long tail = head > FLIGHT_CAPACITY ? head - FLIGHT_CAPACITY : 0;
+	struct flight_thread t = { r->tid, 0 };
+	unsigned long i;
+
+	for (i = tail; i < head; i++) {
+		struct flight_event e = r->events[i % FLIGHT_CAPACITY];
+
+		/* skip slots the owner reused while we were copying */
+		unsigned long now = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (now > FLIGHT_CAPACITY && i < now - FLIGHT_CAPACITY)
+			continue;
+
+		if (e.timestamp >= since)
+			copy[t.count++] = e;
+	}
+
+	fwrite(&t, sizeof(t), 1, fp);
+	fwrite(copy, sizeof(copy[0]), t.count, fp);
+}
+
+/**
+ * Record an anomaly and dump the recent history of all threads.
+ *
+ * Automatic dumps are rate limited to one per window, the events of a burst
+ * of anomalies end up in the next dump anyway. Not async signal safe.
+ */
+void flightTrigger(enum flight_type type, unsigned int device, uint32_t seq, uint32_t value)
+{
+	static unsigned long long busy;
+	struct flight_header h;
+	struct flight_ring* r;
+	char name[4096];
+
+	flightRecord(type, device, seq, value);
+
+	unsigned long long now = nowNs();
+	if (!flightPath)
+		return;
+
+	/* explicit requests are always honoured */
+	if (type != FLIGHT_SIGNAL && dumps && now - lastDump < window)
+		return;
+
+	/* only one thread dumps at a time, the others just carry on */
+	if (__atomic_exchange_n(&busy, 1, __ATOMIC_ACQUIRE))
+		return;
+
+	lastDump = now;
+	snprintf(name, sizeof(name), "%s.%u", flightPath, dumps++);
+
+	FILE* fp = fopen(name, "wb");
+	if (!fp) {
+		fprintf(stderr, "Cannot write flight recorder dump '%s': %d, %s\n", name, errno, strerror(errno));
+		__atomic_store_n(&busy, 0, __ATOMIC_RELEASE);
+		return;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, FLIGHT_MAGIC, sizeof(h.magic));
+	h.version = FLIGHT_VERSION;
+	h.event_size = sizeof(struct flight_event);
+	h.timestamp = now;
+	h.reason = type;
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+		h.threads++;
+
+	fwrite(&h, sizeof(h), 1, fp);
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r && h.threads--; r = r->next)
+		dumpRing(fp, r, now > window ? now - window : 0);
+
+	fclose(fp);
+	fprintf(stderr, "Flight recorder dumped to '%s'\n", name);
+	__atomic_store_n(&busy, 0, __ATOMIC_RELEASE);
+}
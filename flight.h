@@ -0,0 +1,61 @@
+/**
+ * Flight recorder of recent pipeline events.
+ *
+ * Every thread keeps its last FLIGHT_CAPACITY events in a fixed ring. When
+ * something goes wrong the last few seconds of all rings are written to a
+ * numbered dump file, path.0, path.1 and so on. A dump file is:
+ *
+ *   struct flight_header
+ *   per thread: struct flight_thread followed by count struct flight_event
+ *
+ * all in host byte order, events of a thread in time order.
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+
+#define FLIGHT_MAGIC "MJFR"
+#define FLIGHT_VERSION 1
+
+enum flight_type {
+	FLIGHT_POLL,     /* value: poll wait in us */
+	FLIGHT_DEQUEUE,  /* value: frame size */
+	FLIGHT_WRITE,    /* value: write latency in us */
+	FLIGHT_DROP,     /* value: bytes lost */
+	FLIGHT_STALL,    /* value: stall length in us */
+	FLIGHT_ERROR,    /* value: errno */
+	FLIGHT_SIGNAL,   /* value: signal number */
+	FLIGHT_DEPTH,    /* value: new capture queue depth */
+};
+
+struct flight_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t event_size;
+	uint32_t threads;
+	uint64_t timestamp;  /* CLOCK_MONOTONIC ns of the dump */
+	uint32_t reason;     /* enum flight_type that triggered it */
+	uint32_t reserved;
+};
+
+struct flight_thread {
+	int32_t tid;
+	uint32_t count;
+};
+
+struct flight_event {
+	uint64_t timestamp;  /* CLOCK_MONOTONIC ns */
+	uint32_t seq;
+	uint32_t value;
+	uint16_t type;
+	uint16_t device;
+	uint32_t reserved;
+};
+
+void flightInit(const char* path, unsigned int seconds);
+void flightRecord(enum flight_type type, unsigned int device, uint32_t seq, uint32_t value);
+void flightTrigger(enum flight_type type, unsigned int device, uint32_t seq, uint32_t value);
+
+#endif
@@ -0,0 +1,536 @@
+/**
+ * Loop recording, see loop.h.
+ *
+ * All loop writes happen on the one writer thread of the loop's
+ * filesystem, so the header needs no lock: the writer is the only one to
+ * change it and readers only trust what the checksums and positions
+ * confirm.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/futex.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "crc.h"
+#include "filter.h"
+#include "loop.h"
+#include "writer.h"
+
+#define LOOP_DEVICES 64
+#define LOOP_IOV 64
+/* one index slot per this many bytes of data, far more than frames need */
+#define LOOP_SLOT_BYTES 8192
+#define LOOP_EXPORT_BATCH 64
+#define LOOP_PAGE 4096
+
+static char path[PATH_MAX];
+static unsigned long long requested;
+static int fd = -1;
+static struct loop_header* header;
+static struct loop_entry* ring;
+static size_t mapped;
+static int cameras[LOOP_DEVICES];
+static unsigned long long dropped;
+static unsigned long long wraps;
+static unsigned long long held;
+static unsigned long long window;
+static unsigned long long size;
+
+/**
+ * Record into a loop.
+ *
+ * \param spec path of a file or block device, for a file followed by
+ *             :megabytes to create or resize it
+ * \returns 0 on success, -1 if the size cannot be parsed
+ */
+int loopSet(const char* spec)
+{
+	const char* colon = strrchr(spec, ':');
+	size_t length = strlen(spec);
+
+	if (colon && colon[1]) {
+		char* end;
+		unsigned long long megabytes = strtoull(colon + 1, &end, 10);
+
+		if (*end) {
+			fprintf(stderr, "Bad loop size in '%s'\n", spec);
+			return -1;
+		}
+		requested = megabytes << 20;
+		length = colon - spec;
+	}
+
+	if (length >= sizeof(path)) {
+		fprintf(stderr, "Loop path too long\n");
+		return -1;
+	}
+
+	memcpy(path, spec, length);
+	path[length] = '\0';
+	return 0;
+}
+
+bool loopEnabled(void)
+{
+	return path[0] != '\0';
+}
+
+const char* loopPath(void)
+{
+	return path;
+}
+
+static uint64_t recordBytes(size_t length)
+{
+	return (sizeof(struct loop_record) + length + 7) & ~7ULL;
+}
+
+/**
+ * Lay out a new loop of the given size in a header.
+ */
+static void loopLayout(struct loop_header* h, unsigned long long bytes)
+{
+	unsigned long long entries = bytes / LOOP_SLOT_BYTES;
+	unsigned long long ringBytes;
+
+	if (entries > UINT32_MAX)
+		entries = UINT32_MAX;
+	ringBytes = (entries * sizeof(struct loop_entry) + LOOP_PAGE - 1) / LOOP_PAGE * LOOP_PAGE;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, LOOP_MAGIC, sizeof(h->magic));
+	h->entries = entries;
+	h->index = LOOP_HEADER;
+	h->data = LOOP_HEADER + ringBytes;
+	h->size = (bytes - h->data) & ~7ULL;
+}
+
+static bool loopValid(const struct loop_header* h, unsigned long long bytes)
+{
+	return memcmp(h->magic, LOOP_MAGIC, sizeof(h->magic)) == 0 && h->entries
+		&& h->index >= LOOP_HEADER
+		&& h->index + (unsigned long long)h->entries * sizeof(struct loop_entry) <= h->data
+		&& h->data + h->size <= bytes && h->position <= h->head;
+}
+
+/**
+ * Open or create the loop. An existing loop of the same size is continued.
+ *
+ * \returns 0 on success, -1 on error
+ */
+int loopOpen(void)
+{
+	struct loop_header h;
+	struct stat st;
+	unsigned long long bytes;
+	unsigned int i;
+
+	for (i = 0; i < LOOP_DEVICES; i++)
+		cameras[i] = -1;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "Cannot open loop '%s': %d, %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, &bytes) == -1) {
+			fprintf(stderr, "%s: cannot get size: %d, %s\n", path, errno, strerror(errno));
+			return -1;
+		}
+	} else {
+		bytes = requested ? requested : (unsigned long long)st.st_size;
+	}
+
+	if (bytes < LOOP_HEADER + (1ULL << 20) + LOOP_SLOT_BYTES * 128) {
+		fprintf(stderr, "Loop '%s' needs a size of at least 2 MB (-L %s:MB)\n", path, path);
+		return -1;
+	}
+
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || !loopValid(&h, bytes)
+			|| (S_ISREG(st.st_mode) && (unsigned long long)st.st_size != bytes)) {
+		/* new or resized: everything in it is gone */
+		if (S_ISREG(st.st_mode) && (ftruncate(fd, 0) == -1 || posix_fallocate(fd, 0, bytes) != 0)) {
+			fprintf(stderr, "Cannot allocate %llu MB for loop '%s'\n", bytes >> 20, path);
+			return -1;
+		}
+
+		loopLayout(&h, bytes);
+		if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+			fprintf(stderr, "%s: write error %d, %s\n", path, errno, strerror(errno));
+			return -1;
+		}
+	}
+
+	mapped = h.data;
+	header = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED) {
+		header = NULL;
+		fprintf(stderr, "Cannot map loop '%s': %d, %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+	ring = (struct loop_entry*)((char*)header + header->index);
+
+	/* a record being written when we stopped is lost */
+	header->head = header->position;
+	return 0;
+}
+
+/**
+ * Give a camera its slot in the loop, the one it had if it recorded into
+ * this loop before.
+ *
+ * \returns 0 on success, -1 if the loop has no free slot
+ */
+int loopAddCamera(unsigned int device, const char* camera)
+{
+	int i, slot = -1;
+
+	if (device >= LOOP_DEVICES) {
+		fprintf(stderr, "%s: too many cameras\n", camera);
+		return -1;
+	}
+
+	for (i = 0; i < LOOP_CAMERAS; i++) {
+		if (!header->cameras[i][0] && slot == -1)
+			slot = i;
+		if (strncmp(header->cameras[i], camera, LOOP_NAME - 1) == 0)
+			break;
+	}
+
+	if (i == LOOP_CAMERAS) {
+		if (slot == -1) {
+			fprintf(stderr, "%s: loop already holds %d cameras\n", camera, LOOP_CAMERAS);
+			return -1;
+		}
+		i = slot;
+		snprintf(header->cameras[i], LOOP_NAME, "%s", camera);
+	}
+
+	cameras[device] = i;
+	return 0;
+}
+
+static bool writeAll(struct iovec* iov, unsigned int n, uint64_t offset, size_t length)
+{
+	unsigned int first = 0;
+	size_t done = 0;
+
+	while (done < length) {
+		ssize_t written = pwritev(fd, iov + first, n - first, offset + done);
+		if (written <= 0) {
+			fprintf(stderr, "%s: write error %d, %s\n", path, errno, strerror(errno));
+			return false;
+		}
+
+		done += written;
+		while (first < n && (size_t)written >= iov[first].iov_len) {
+			written -= iov[first].iov_len;
+			first++;
+		}
+		if (first < n) {
+			iov[first].iov_base = (char*)iov[first].iov_base + written;
+			iov[first].iov_len -= written;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Write one contiguous run of records and commit them.
+ *
+ * \returns bytes of frame data committed
+ */
+static size_t loopCommit(struct iovec* iov, unsigned int iovs, struct loop_entry* entries,
+	unsigned int n, uint64_t start, uint64_t end)
+{
+	size_t done = 0;
+	unsigned int i;
+
+	if (!n)
+		return 0;
+
+	/* readers must not trust what is about to be overwritten */
+	__atomic_store_n(&header->head, end, __ATOMIC_RELEASE);
+	if (!writeAll(iov, iovs, header->data + start % header->size, end - start))
+		return 0;
+
+	uint64_t frames = header->frames;
+	for (i = 0; i < n; i++) {
+		ring[(frames + i) % header->entries] = entries[i];
+		done += entries[i].length;
+	}
+
+	__atomic_store_n(&header->position, end, __ATOMIC_RELEASE);
+	__atomic_store_n(&header->frames, frames + n, __ATOMIC_RELEASE);
+
+	/* wake followers, see tail.h */
+	__atomic_add_fetch(&header->commits, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &header->commits, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	return done;
+}
+
+/**
+ * Append frames of one camera to the loop. Called on the writer thread.
+ *
+ * \returns bytes of frame data written
+ */
+size_t loopWrite(struct frame** frames, unsigned int n)
+{
+	static const char zero[8];
+	struct iovec iov[LOOP_IOV * 3];
+	struct loop_record records[LOOP_IOV];
+	struct loop_entry entries[LOOP_IOV];
+	int camera = frames[0]->device < LOOP_DEVICES ? cameras[frames[0]->device] : -1;
+	uint64_t position = header->position, start = position;
+	unsigned int i, iovs = 0, run = 0;
+	size_t done = 0;
+
+	if (camera == -1 || n > LOOP_IOV)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		struct frame* f = frames[i];
+		uint64_t bytes = recordBytes(f->length);
+
+		if (bytes > header->size) {
+			dropped++;
+			continue;
+		}
+
+		/* records never wrap, the rest of the data area is skipped */
+		if (position % header->size + bytes > header->size) {
+			done += loopCommit(iov, iovs, entries, run, start, position);
+			position += header->size - position % header->size;
+			start = position;
+			iovs = run = 0;
+			wraps++;
+		}
+
+		struct loop_record* r = &records[i];
+		memset(r, 0, sizeof(*r));
+		r->magic = LOOP_RECORD_MAGIC;
+		r->length = f->length;
+		r->timestamp = f->timestamp;
+		r->sequence = f->sequence;
+		r->camera = camera;
+		r->crc = f->flags & FRAME_CRC ? f->crc : crc32c(0, f->data, f->length);
+
+		iov[iovs].iov_base = r;
+		iov[iovs++].iov_len = sizeof(*r);
+		iov[iovs].iov_base = f->data;
+		iov[iovs++].iov_len = f->length;
+		if (bytes > sizeof(*r) + f->length) {
+			iov[iovs].iov_base = (void*)zero;
+			iov[iovs++].iov_len = bytes - sizeof(*r) - f->length;
+		}
+
+		entries[run].timestamp = f->timestamp;
+		entries[run].position = position;
+		entries[run].length = f->length;
+		entries[run].camera = camera;
+		entries[run].reserved = 0;
+		run++;
+		position += bytes;
+	}
+
+	return done + loopCommit(iov, iovs, entries, run, start, position);
+}
+
+/**
+ * First frame number whose record has not been overwritten. Record
+ * positions grow with the frame number, so this is a binary search.
+ */
+uint64_t loopOldest(const struct loop_header* h, const struct loop_entry* slots, uint64_t frames)
+{
+	uint64_t lo = frames > h->entries ? frames - h->entries : 0, hi = frames;
+	uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (slots[mid % h->entries].position + h->size < head)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+void loopClose(void)
+{
+	if (header && header->frames) {
+		uint64_t frames = header->frames;
+		uint64_t oldest = loopOldest(header, ring, frames);
+
+		held = frames - oldest;
+		window = ring[(frames - 1) % header->entries].timestamp - ring[oldest % header->entries].timestamp;
+		size = header->size;
+	}
+
+	if (header) {
+		if (msync(header, mapped, MS_SYNC) == -1)
+			fprintf(stderr, "%s: sync error %d, %s\n", path, errno, strerror(errno));
+		munmap(header, mapped);
+		header = NULL;
+	}
+
+	if (fd != -1) {
+		if (fsync(fd) == -1)
+			fprintf(stderr, "%s: sync error %d, %s\n", path, errno, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+}
+
+/**
+ * Print how much the loop held when it was closed.
+ */
+void loopReport(FILE* fp)
+{
+	if (!held)
+		return;
+
+	fprintf(fp, "loop %s: %llu frames held, %.1f s, %llu MB, %llu wraps, %llu too large\n", path,
+		held, window / 1e9, size >> 20, wraps, dropped);
+}
+
+static void exportFlush(struct frame* list, FILE* out)
+{
+	long long growth;
+
+	list = filterList(list, &growth);
+	while (list) {
+		struct frame* next = list->next;
+
+		fwrite(list->data, 1, list->length, out);
+		frameFree(list);
+		list = next;
+	}
+}
+
+/**
+ * Read one frame of a loop, NULL if it was overwritten or is damaged.
+ */
+static struct frame* exportFrame(int in, const struct loop_header* h, const struct loop_entry* e)
+{
+	struct loop_record r;
+	uint64_t offset = h->data + e->position % h->size;
+	struct frame* f = frameAlloc(e->length);
+
+	if (!f)
+		return NULL;
+
+	if (pread(in, &r, sizeof(r), offset) != sizeof(r) || r.magic != LOOP_RECORD_MAGIC
+			|| r.length != e->length || r.timestamp != e->timestamp || r.camera != e->camera
+			|| pread(in, f->data, r.length, offset + sizeof(r)) != (ssize_t)r.length
+			|| crc32c(0, f->data, r.length) != r.crc
+			|| __atomic_load_n(&h->head, __ATOMIC_ACQUIRE) > e->position + h->size) {
+		frameFree(f);
+		return NULL;
+	}
+
+	f->next = NULL;
+	f->flags = filterScaling() ? FRAME_SCALE : 0;
+	f->timestamp = r.timestamp;
+	f->sequence = r.sequence;
+	f->length = r.length;
+	return f;
+}
+
+/**
+ * Copy the frames of one camera in [from, to] out of a loop, oldest first.
+ * Works while the loop is being recorded.
+ *
+ * \returns number of frames copied, -1 on error
+ */
+int loopExport(const char* file, const char* camera, unsigned long long from, unsigned long long to, FILE* out)
+{
+	struct loop_header h;
+	struct stat st;
+	struct frame* list = NULL;
+	struct frame** tail = &list;
+	unsigned int batched = 0;
+	int id, frames = 0, lost = 0;
+
+	int in = open(file, O_RDONLY | O_CLOEXEC);
+	if (in == -1 || fstat(in, &st) == -1 || pread(in, &h, sizeof(h), 0) != sizeof(h)) {
+		fprintf(stderr, "Cannot read loop '%s': %d, %s\n", file, errno, strerror(errno));
+		if (in != -1)
+			close(in);
+		return -1;
+	}
+
+	if (memcmp(h.magic, LOOP_MAGIC, sizeof(h.magic)) != 0) {
+		fprintf(stderr, "'%s' is not a loop recording\n", file);
+		close(in);
+		return -1;
+	}
+
+	for (id = 0; id < LOOP_CAMERAS; id++)
+		if (strncmp(h.cameras[id], camera, LOOP_NAME - 1) == 0)
+			break;
+	if (id == LOOP_CAMERAS) {
+		fprintf(stderr, "No camera '%s' in loop '%s'\n", camera, file);
+		close(in);
+		return -1;
+	}
+
+	const struct loop_header* live = mmap(NULL, h.data, PROT_READ, MAP_SHARED, in, 0);
+	if (live == MAP_FAILED) {
+		fprintf(stderr, "Cannot map loop '%s': %d, %s\n", file, errno, strerror(errno));
+		close(in);
+		return -1;
+	}
+	const struct loop_entry* slots = (const struct loop_entry*)((const char*)live + h.index);
+
+	uint64_t count = __atomic_load_n(&live->frames, __ATOMIC_ACQUIRE);
+	uint64_t n;
+	for (n = loopOldest(live, slots, count); n < count; n++) {
+		struct loop_entry e = slots[n % h.entries];
+
+		if (e.camera != id || e.timestamp < from || e.timestamp > to)
+			continue;
+
+		struct frame* f = exportFrame(in, live, &e);
+		if (!f) {
+			lost++;
+			continue;
+		}
+
+		*tail = f;
+		tail = &f->next;
+		frames++;
+
+		if (++batched == LOOP_EXPORT_BATCH) {
+			exportFlush(list, out);
+			list = NULL;
+			tail = &list;
+			batched = 0;
+		}
+	}
+	exportFlush(list, out);
+
+	if (lost)
+		fprintf(stderr, "%s: %d frames overwritten or damaged while exporting\n", file, lost);
+
+	munmap((void*)live, h.data);
+	close(in);
+	return frames;
+}
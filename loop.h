@@ -0,0 +1,84 @@
+/**
+ * Loop recording.
+ *
+ * With -L all cameras record into one preallocated file or block device
+ * that is overwritten round robin, like a dashcam: the oldest frames make
+ * room for new ones and no file is ever created or deleted while
+ * recording. The loop is laid out as
+ *
+ *   header      struct loop_header, LOOP_HEADER bytes
+ *   index ring  entries times struct loop_entry, frame n (counting every
+ *               frame ever written) at slot n % entries
+ *   data        per frame a struct loop_record, the frame and padding to 8
+ *               bytes, at position % size
+ *
+ * Positions count the bytes written since the loop was created and never
+ * wrap. A record that would run past the end of the data area starts at
+ * its beginning instead. Header and index ring are mmap()ed. The writer
+ * moves head past a record before writing it and bumps position and frames
+ * once the record and its index slot are complete, so a reader knows a
+ * frame is intact when its checksum matches and head has not moved past
+ * its position plus size. Recording resumes where it stopped, and a loop
+ * can be exported or followed (see tail.h) while it is being written.
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LOOP_MAGIC "MJLOOP1"
+#define LOOP_HEADER 4096
+#define LOOP_CAMERAS 32
+#define LOOP_NAME 32
+#define LOOP_RECORD_MAGIC 0x524a4d4c
+
+struct frame;
+
+struct loop_header {
+	char magic[8];
+	uint32_t entries;     /* slots in the index ring */
+	uint32_t commits;     /* futex, bumped after every commit */
+	uint64_t size;        /* bytes in the data area */
+	uint64_t index;       /* file offset of the index ring */
+	uint64_t data;        /* file offset of the data area */
+	uint64_t frames;      /* frames committed */
+	uint64_t head;        /* end of the data being written */
+	uint64_t position;    /* end of the committed data */
+	char cameras[LOOP_CAMERAS][LOOP_NAME];
+};
+
+struct loop_entry {
+	uint64_t timestamp;   /* CLOCK_REALTIME ns */
+	uint64_t position;    /* of the record */
+	uint32_t length;      /* of the frame */
+	uint16_t camera;
+	uint16_t reserved;
+};
+
+struct loop_record {
+	uint32_t magic;
+	uint32_t length;
+	uint64_t timestamp;
+	uint32_t sequence;
+	uint16_t camera;
+	uint16_t reserved;
+	uint32_t crc;         /* CRC-32C of the frame */
+	uint32_t pad;
+};
+
+int loopSet(const char* spec);
+bool loopEnabled(void);
+const char* loopPath(void);
+int loopOpen(void);
+int loopAddCamera(unsigned int device, const char* camera);
+size_t loopWrite(struct frame** frames, unsigned int n);
+void loopClose(void);
+void loopReport(FILE* fp);
+uint64_t loopOldest(const struct loop_header* h, const struct loop_entry* slots, uint64_t frames);
+int loopExport(const char* path, const char* camera, unsigned long long from, unsigned long long to, FILE* out);
+
+#endif
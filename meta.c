@@ -0,0 +1,467 @@
+/**
+ * UVC metadata and clock recovery, see meta.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <linux/usb/video.h>
+#include <linux/uvcvideo.h>
+#include <linux/videodev2.h>
+#include <libv4l2.h>
+
+#include "clock.h"
+#include "meta.h"
+
+#define CLEAR(x) memset (&(x), 0, sizeof (x))
+/* metadata buffers are small, keep as many as video buffers may queue */
+#define META_BUFFERS VIDEO_MAX_FRAME
+#define META_SAMPLES 64
+#define META_TIMES 64
+/* SOF is an 11 bit counter of 1 ms USB frames */
+#define SOF_MASK 2047
+/* a frame's metadata arrives with it, older entries belong to an earlier stream */
+#define META_MAX_AGE 1000000000ULL
+/* longer gaps than the SOF counter spans cannot be unwrapped, start over */
+#define META_MAX_GAP 1000000000ULL
+
+struct ring {
+	uint64_t x[META_SAMPLES];
+	uint64_t y[META_SAMPLES];
+	unsigned int n, next;
+};
+
+struct stamp {
+	unsigned int sequence;
+	unsigned long long arrived;   /* nowNs() when it was dequeued */
+	unsigned long long ns;        /* CLOCK_MONOTONIC of the capture */
+};
+
+struct meta {
+	const char* node;
+	int fd;
+	void* start[META_BUFFERS];
+	size_t length[META_BUFFERS];
+	unsigned int buffers;
+
+	struct ring camera;           /* camera clock to SOF, from SCRs */
+	struct ring host;             /* SOF to CLOCK_MONOTONIC, from arrivals */
+	bool haveClock, haveSof;
+	uint64_t stc;                 /* last camera clock, unwrapped */
+	uint64_t sof;                 /* last host SOF, unwrapped */
+	uint64_t lastNs;              /* host time of the last header */
+
+	struct stamp stamps[META_TIMES];
+	unsigned int nextStamp;
+	unsigned int lastSequence;
+
+	unsigned long long stamped;
+	unsigned long long missed;
+	double lateSum;               /* driver timestamp minus camera time, ns */
+};
+
+static int xioctl(int fd, unsigned long request, void* argp)
+{
+	int r;
+
+	do r = v4l2_ioctl(fd, request, argp);
+	while (-1 == r && EINTR == errno);
+
+	return r;
+}
+
+static struct meta* metaFail(struct meta* m, const char* s)
+{
+	fprintf(stderr, "%s: %s error %d, %s\n", m->node, s, errno, strerror(errno));
+	metaClose(m);
+	return NULL;
+}
+
+/**
+ * Open a UVC metadata node and start streaming it. Metadata only flows
+ * while the video node streams, so it can stay on across snapshot turns;
+ * clock recovery starts over after each.
+ *
+ * \returns the node, NULL on error
+ */
+struct meta* metaOpen(const char* node)
+{
+	struct v4l2_capability cap;
+	struct v4l2_format fmt;
+	struct v4l2_requestbuffers req;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+
+	struct meta* m = calloc(1, sizeof(*m));
+	if (!m) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+
+	m->node = node;
+	m->fd = v4l2_open(node, O_RDWR | O_NONBLOCK, 0);
+	if (m->fd == -1)
+		return metaFail(m, "open");
+
+	if (xioctl(m->fd, VIDIOC_QUERYCAP, &cap) == -1)
+		return metaFail(m, "VIDIOC_QUERYCAP");
+
+	unsigned int caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ? cap.device_caps : cap.capabilities;
+	if (!(caps & V4L2_CAP_META_CAPTURE) || !(caps & V4L2_CAP_STREAMING)) {
+		fprintf(stderr, "%s is no metadata capture device\n", node);
+		metaClose(m);
+		return NULL;
+	}
+
+	CLEAR(fmt);
+	fmt.type = V4L2_BUF_TYPE_META_CAPTURE;
+	if (xioctl(m->fd, VIDIOC_G_FMT, &fmt) == -1)
+		return metaFail(m, "VIDIOC_G_FMT");
+
+	if (fmt.fmt.meta.dataformat != V4L2_META_FMT_UVC) {
+		fmt.fmt.meta.dataformat = V4L2_META_FMT_UVC;
+		if (xioctl(m->fd, VIDIOC_S_FMT, &fmt) == -1 || fmt.fmt.meta.dataformat != V4L2_META_FMT_UVC) {
+			fprintf(stderr, "%s does not deliver UVC payload headers\n", node);
+			metaClose(m);
+			return NULL;
+		}
+	}
+
+	CLEAR(req);
+	req.count = META_BUFFERS;
+	req.type = V4L2_BUF_TYPE_META_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(m->fd, VIDIOC_REQBUFS, &req) == -1)
+		return metaFail(m, "VIDIOC_REQBUFS");
+
+	for (m->buffers = 0; m->buffers < req.count && m->buffers < META_BUFFERS; m->buffers++) {
+		struct v4l2_buffer buf;
+
+		CLEAR(buf);
+		buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = m->buffers;
+
+		if (xioctl(m->fd, VIDIOC_QUERYBUF, &buf) == -1)
+			return metaFail(m, "VIDIOC_QUERYBUF");
+
+		m->length[m->buffers] = buf.length;
+		m->start[m->buffers] = v4l2_mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+			m->fd, buf.m.offset);
+		if (m->start[m->buffers] == MAP_FAILED) {
+			m->start[m->buffers] = NULL;
+			return metaFail(m, "mmap");
+		}
+
+		if (xioctl(m->fd, VIDIOC_QBUF, &buf) == -1)
+			return metaFail(m, "VIDIOC_QBUF");
+	}
+
+	if (xioctl(m->fd, VIDIOC_STREAMON, &type) == -1)
+		return metaFail(m, "VIDIOC_STREAMON");
+
+	return m;
+}
+
+static void ringAdd(struct ring* r, uint64_t x, uint64_t y)
+{
+	r->x[r->next] = x;
+	r->y[r->next] = y;
+	r->next = (r->next + 1) % META_SAMPLES;
+	if (r->n < META_SAMPLES)
+		r->n++;
+}
+
+/**
+ * Least squares line through a ring, evaluated at x. The result is
+ * relative to y0, the y of the oldest sample, so nanoseconds keep their
+ * precision in a double.
+ *
+ * \returns false if the samples do not define a line yet
+ */
+static bool ringFit(const struct ring* r, double x, uint64_t* y0, double* dy)
+{
+	unsigned int oldest = r->n < META_SAMPLES ? 0 : r->next;
+	uint64_t x0 = r->x[oldest];
+	double mx = 0, my = 0, sxx = 0, sxy = 0;
+	unsigned int i;
+
+	if (r->n < 2)
+		return false;
+
+	for (i = 0; i < r->n; i++) {
+		mx += (double)(int64_t)(r->x[i] - x0);
+		my += (double)(int64_t)(r->y[i] - r->y[oldest]);
+	}
+	mx /= r->n;
+	my /= r->n;
+
+	for (i = 0; i < r->n; i++) {
+		double dx = (double)(int64_t)(r->x[i] - x0) - mx;
+
+		sxx += dx * dx;
+		sxy += dx * ((double)(int64_t)(r->y[i] - r->y[oldest]) - my);
+	}
+
+	if (sxx == 0)
+		return false;
+
+	*y0 = r->y[oldest];
+	*dy = my + sxy / sxx * (x - (double)x0 - mx);
+	return true;
+}
+
+/**
+ * Forget the clock samples, after a gap the counters cannot be unwrapped
+ * across, such as a snapshot turn with the stream off.
+ */
+static void metaReset(struct meta* m)
+{
+	CLEAR(m->camera);
+	CLEAR(m->host);
+	m->haveClock = m->haveSof = false;
+	m->stc = m->sof = m->lastNs = 0;
+}
+
+/**
+ * Unwrap an 11 bit SOF against the last host SOF.
+ */
+static uint64_t sofUnwrap(const struct meta* m, unsigned int sof)
+{
+	int delta = (int)((sof - m->sof) & SOF_MASK);
+
+	if (delta > SOF_MASK / 2)
+		delta -= SOF_MASK + 1;
+	return m->sof + delta;
+}
+
+/**
+ * Unwrap a 32 bit camera clock value against the last one seen.
+ */
+static uint64_t stcUnwrap(const struct meta* m, uint32_t stc)
+{
+	return m->stc + (int32_t)(stc - (uint32_t)m->stc);
+}
+
+/**
+ * Host time of a camera clock value, 0 if the clocks are not locked yet.
+ */
+static unsigned long long cameraToHost(const struct meta* m, uint64_t stc)
+{
+	uint64_t sof0, ns0;
+	double sof, ns;
+
+	if (m->camera.n < META_SAMPLES / 8 || !ringFit(&m->camera, (double)stc, &sof0, &sof)
+			|| !ringFit(&m->host, (double)sof0 + sof, &ns0, &ns))
+		return 0;
+
+	return ns0 + (long long)llround(ns);
+}
+
+/**
+ * Take the samples out of one metadata buffer.
+ *
+ * \returns the capture time of the frame, 0 if it cannot be told
+ */
+static unsigned long long metaParse(struct meta* m, const unsigned char* p, size_t n)
+{
+	const size_t head = offsetof(struct uvc_meta_buf, length);
+	bool havePts = false;
+	uint32_t pts = 0;
+
+	while (n >= head + 2) {
+		const struct uvc_meta_buf* b = (const struct uvc_meta_buf*)p;
+		size_t size = head + b->length;
+		const unsigned char* q = b->buf;
+		uint64_t ns;
+		uint16_t sof;
+
+		if (b->length < 2 || size > n)
+			break;
+
+		memcpy(&ns, &b->ns, sizeof(ns));
+		memcpy(&sof, &b->sof, sizeof(sof));
+
+		if (m->haveSof && ns - m->lastNs > META_MAX_GAP)
+			metaReset(m);
+		m->lastNs = ns;
+
+		if (!m->haveSof) {
+			/* far from zero so unwrapping never goes below it */
+			m->sof = (1ULL << 32) + (sof & SOF_MASK);
+			m->haveSof = true;
+		}
+		m->sof = sofUnwrap(m, sof & SOF_MASK);
+		ringAdd(&m->host, m->sof, ns);
+
+		if ((b->flags & UVC_STREAM_PTS) && b->length >= 6) {
+			if (!havePts)
+				memcpy(&pts, q, sizeof(pts));
+			havePts = true;
+			q += 4;
+		}
+
+		if ((b->flags & UVC_STREAM_SCR) && (size_t)(q - p) + 6 <= size) {
+			uint32_t stc;
+			uint16_t scrSof;
+
+			memcpy(&stc, q, sizeof(stc));
+			memcpy(&scrSof, q + 4, sizeof(scrSof));
+			if (!m->haveClock) {
+				m->stc = stc;
+				m->haveClock = true;
+			}
+			m->stc = stcUnwrap(m, stc);
+			ringAdd(&m->camera, m->stc, sofUnwrap(m, scrSof & SOF_MASK));
+		}
+
+		p += size;
+		n -= size;
+	}
+
+	return havePts && m->haveClock ? cameraToHost(m, stcUnwrap(m, pts)) : 0;
+}
+
+/**
+ * Read the metadata buffers that are ready.
+ */
+static void metaDrain(struct meta* m)
+{
+	struct v4l2_buffer buf;
+
+	for (;;) {
+		CLEAR(buf);
+		buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+
+		if (xioctl(m->fd, VIDIOC_DQBUF, &buf) == -1) {
+			if (errno != EAGAIN)
+				fprintf(stderr, "%s: VIDIOC_DQBUF error %d, %s\n", m->node, errno, strerror(errno));
+			return;
+		}
+
+		if (buf.index < m->buffers && !(buf.flags & V4L2_BUF_FLAG_ERROR)) {
+			size_t used = buf.bytesused < m->length[buf.index] ? buf.bytesused : m->length[buf.index];
+
+			/* sequence numbers start over when the video node restarts */
+			if (buf.sequence < m->lastSequence) {
+				memset(m->stamps, 0, sizeof(m->stamps));
+				metaReset(m);
+			}
+			m->lastSequence = buf.sequence;
+
+			unsigned long long ns = metaParse(m, m->start[buf.index], used);
+
+			if (ns) {
+				struct stamp* s = &m->stamps[m->nextStamp++ % META_TIMES];
+
+				s->sequence = buf.sequence;
+				s->arrived = nowNs();
+				s->ns = ns;
+			}
+		}
+
+		if (xioctl(m->fd, VIDIOC_QBUF, &buf) == -1) {
+			fprintf(stderr, "%s: VIDIOC_QBUF error %d, %s\n", m->node, errno, strerror(errno));
+			return;
+		}
+	}
+}
+
+/**
+ * Capture time of a frame on the camera's clock.
+ *
+ * \param sequence sequence number of the video buffer
+ * \param driver the driver's timestamp of the buffer, CLOCK_MONOTONIC ns
+ * \returns CLOCK_MONOTONIC ns, 0 if the metadata does not tell
+ */
+unsigned long long metaTime(struct meta* m, unsigned int sequence, unsigned long long driver)
+{
+	unsigned long long now;
+	unsigned int i;
+
+	metaDrain(m);
+	now = nowNs();
+
+	for (i = 0; i < META_TIMES; i++) {
+		const struct stamp* s = &m->stamps[i];
+
+		if (s->arrived && s->sequence == sequence && now - s->arrived < META_MAX_AGE) {
+			m->stamped++;
+			if (driver)
+				m->lateSum += (double)(long long)(driver - s->ns);
+			return s->ns;
+		}
+	}
+
+	m->missed++;
+	return 0;
+}
+
+/**
+ * Print how many frames got camera timestamps and how the clocks relate.
+ */
+void metaReport(FILE* fp, const struct meta* m, const char* name)
+{
+	uint64_t sof0, ns0;
+	double sof, ns, rms = 0;
+	unsigned int i;
+
+	fprintf(fp, "%s: %llu frames on the camera clock, %llu on the driver's", name, m->stamped, m->missed);
+
+	/* camera clock rate from the SOFs it spans, one per ms */
+	if (m->camera.n >= 2 && ringFit(&m->camera, (double)m->stc + 1e6, &sof0, &sof)) {
+		double base;
+
+		ringFit(&m->camera, (double)m->stc, &sof0, &base);
+		fprintf(fp, ", camera clock %.4f MHz", 1e6 / (sof - base) / 1e3);
+	}
+
+	/* how far arrival times scatter around the SOF line */
+	for (i = 0; i < m->host.n; i++) {
+		if (ringFit(&m->host, (double)m->host.x[i], &ns0, &ns)) {
+			double d = (double)(int64_t)(m->host.y[i] - ns0) - ns;
+
+			rms += d * d;
+		}
+	}
+	if (m->host.n)
+		fprintf(fp, ", arrival jitter %.2f ms rms", sqrt(rms / m->host.n) / 1e6);
+
+	if (m->stamped)
+		fprintf(fp, ", driver timestamps %.2f ms later", m->lateSum / m->stamped / 1e6);
+	fprintf(fp, "\n");
+}
+
+void metaClose(struct meta* m)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+	struct v4l2_requestbuffers req;
+	unsigned int i;
+
+	if (!m)
+		return;
+
+	if (m->fd != -1) {
+		xioctl(m->fd, VIDIOC_STREAMOFF, &type);
+		for (i = 0; i < m->buffers; i++)
+			if (m->start[i])
+				v4l2_munmap(m->start[i], m->length[i]);
+
+		CLEAR(req);
+		req.type = V4L2_BUF_TYPE_META_CAPTURE;
+		req.memory = V4L2_MEMORY_MMAP;
+		xioctl(m->fd, VIDIOC_REQBUFS, &req);
+		v4l2_close(m->fd);
+	}
+
+	free(m);
+}
@@ -0,0 +1,32 @@
+/**
+ * Capture timestamps from the camera's clock, via the UVC metadata node.
+ *
+ * UVC drivers stamp a buffer when the last USB transfer of its frame
+ * completes, milliseconds after the sensor captured it and with as many
+ * milliseconds of jitter. The camera's payload headers carry better: a
+ * presentation time stamp (PTS) of the capture on the camera's clock, and
+ * source clock references (SCR) pairing that clock with the USB frame
+ * counter (SOF). The metadata node (V4L2_META_FMT_UVC) hands out these
+ * headers for every frame, each with the host time and SOF it arrived at.
+ *
+ * Clock recovery fits two lines over the recent samples: camera clock to
+ * SOF from the SCRs, and SOF to CLOCK_MONOTONIC from the arrival times.
+ * Camera and host count the same SOFs, so the PTS of a frame maps to host
+ * time with the arrival jitter averaged out. A metadata buffer carries the
+ * sequence number of its video buffer and is completed just before it, so
+ * a frame's timestamp is known by the time the frame is dequeued.
+ */
+
+#ifndef META_H
+#define META_H
+
+#include <stdio.h>
+
+struct meta;
+
+struct meta* metaOpen(const char* node);
+unsigned long long metaTime(struct meta* m, unsigned int sequence, unsigned long long driver);
+void metaReport(FILE* fp, const struct meta* m, const char* name);
+void metaClose(struct meta* m);
+
+#endif
@@ -2,34 +2,67 @@
  * Based on v4l2grab by Tobias Müller
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 #include <getopt.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <poll.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <linux/videodev2.h>
-#include <libv4l2.h>
+
+#include "archive.h"
+#include "clock.h"
+#include "crc.h"
+#include "device.h"
+#include "filter.h"
+#include "flight.h"
+#include "loop.h"
+#include "meta.h"
+#include "perf.h"
+#include "pool.h"
+#include "probes.h"
+#include "retain.h"
+#include "serve.h"
+#include "stage.h"
+#include "store.h"
+#include "tail.h"
+#include "trace.h"
+#include "writer.h"
 
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 #define VERSION "1.0"
-
-struct buffer {
-  void * start;
-  size_t length;
-} buffer;
+#define MAX_DEVICES 64
+#define INIT_THREADS 16
 
 // global state
-static int fd = -1;
 static unsigned int width = 1280;
 static unsigned int height = 720;
 static unsigned int fps = 30;
 static char* jpegFilename = "output.jpg";
-static char* deviceName = "/dev/video0";
+static char* flightFilename = NULL;
 static unsigned int frame_count = 1;
+static bool perf_enabled = false;
+static struct perf_counters perf = { .fd = { -1, -1, -1 } };
+static volatile sig_atomic_t dump_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+static bool verbose = false;
+static struct device devices[MAX_DEVICES];
+static unsigned int device_count = 0;
+static unsigned int max_streams = 0;
+static char* extractCamera = NULL;
+static unsigned long long extractFrom = 0;
+static unsigned long long extractTo = ULLONG_MAX;
+static bool follow = false;
+static const char* serveAddress = NULL;
+static bool checksums = false;
+static bool bench = false;
 
 /**
  * Print error message and terminate programm with EXIT_FAILURE return code.
@@ -38,184 +71,476 @@ static unsigned int frame_count = 1;
  */
 static void errno_exit(const char* s)
 {
+	int err = errno;
+	flightTrigger(FLIGHT_ERROR, 0, 0, err);
+	errno = err;
+
 	fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
 	exit(EXIT_FAILURE);
 }
 
 /**
- *	Do ioctl and retry if error was EINTR ("A signal was caught during the ioctl() operation."). Parameters are the same as on ioctl.
- *
- *	\param fd file descriptor
- *	\param request request
- *	\param argp argument
- *	\returns result from ioctl
-*/
-static int xioctl(int fd, int request, void* argp)
+ * A poll wait or write longer than a few frame intervals is a stall.
+ */
+static bool isStall(unsigned long long ns)
 {
-	int r;
-
-	do r = v4l2_ioctl(fd, request, argp);
-	while (-1 == r && EINTR == errno);
+	return fps && ns > 4000000000ULL / fps;
+}
 
-	return r;
+/**
+ * A frame is worth copying if the driver flagged no error and it starts
+ * like a JPEG. Whether it is complete is checked during the copy.
+ */
+static bool frameGood(const unsigned char* p, size_t n, unsigned int flags)
+{
+	return !(flags & V4L2_BUF_FLAG_ERROR) && n >= 4 && p[0] == 0xFF && p[1] == 0xD8;
 }
 
-static void rawWrite(const unsigned char* img, size_t length)
+/**
+ * A frame is complete if it ends with EOI, allowing for the zero padding
+ * some UVC cameras append.
+ *
+ * \param eoi position after the last EOI found while copying, 0 to look
+ *            for it at the end
+ */
+static bool frameComplete(const unsigned char* p, size_t n, size_t eoi)
 {
-	FILE *outfile = fopen( jpegFilename, "ab" );
-	if (!outfile)
-	{
-		errno_exit("fopen");
+	if (!eoi) {
+		while (n > 4 && p[n - 1] == 0)
+			n--;
+		return p[n - 2] == 0xFF && p[n - 1] == 0xD9;
 	}
 
-	fwrite(img, 1, length, outfile);
-	fclose(outfile);
+	while (n > eoi && p[n - 1] == 0)
+		n--;
+	return n == eoi;
 }
 
 /**
  * process image read
+ *
+ * The frame is copied out of the driver's buffer so the buffer can go back
+ * to the driver right away, the disk write happens on the writer thread.
+ * When frames are checksummed (loop recordings) the copy also computes
+ * the CRC-32C and finds the EOI marker, so the buffer is read only once.
+ *
+ * \returns false if the frame turned out to be incomplete
  */
-static void imageProcess(const void* p, size_t length)
+static bool imageProcess(struct device* dev, const void* p, size_t length, unsigned long long timestamp)
 {
-	rawWrite(p, length);
+	unsigned int sequence = dev->sequence + 1;
+	bool good;
+
+	PROBE4(process_entry, dev->name, sequence, length, nowNs());
+	unsigned long long start = traceBegin();
+	perfStageBegin(&perf);
+
+	struct frame* f = frameAlloc(length);
+	if (f && checksums) {
+		size_t eoi;
+
+		f->flags = FRAME_CRC;
+		f->crc = crc32cCopy(f->data, p, length, &eoi);
+		good = frameComplete(f->data, length, eoi);
+	} else if (f) {
+		f->flags = 0;
+		memcpy(f->data, p, length);
+		good = frameComplete(f->data, length, 0);
+	} else {
+		good = frameComplete(p, length, 0);
+	}
+
+	if (f) {
+		f->device = dev->index;
+		f->sequence = sequence;
+		f->timestamp = timestamp;
+	}
+
+	perfStageEnd(&perf, STAGE_COPY);
+	traceEnd("copy", start, dev->name, sequence);
+
+	if (checksums && bench)
+		crc32cBench(p, length);
+
+	if (!good) {
+		frameFree(f);
+		return false;
+	}
+
+	dev->sequence = sequence;
+	if (f)
+		storeSubmit(f);
+	else
+		flightTrigger(FLIGHT_DROP, dev->index, sequence, length);
+
+	PROBE4(process_exit, dev->name, sequence, length, nowNs());
+	return true;
 }
 
 /**
- * read single frame
+ * Give up after a device error that was already reported.
  */
-static int frameRead(void)
+static void deviceExit(struct device* dev)
 {
-	ssize_t n = v4l2_read(fd, buffer.start, buffer.length);
+	flightTrigger(FLIGHT_ERROR, dev->index, dev->sequence, errno);
+	exit(EXIT_FAILURE);
+}
 
-	if (n == -1) {
-		switch (errno) {
-			case EAGAIN:
-				return 0;
+/**
+ * Wall clock time a buffer was captured. Drivers stamp buffers with
+ * CLOCK_MONOTONIC, recordings are indexed by CLOCK_REALTIME. With a
+ * metadata node the camera's own capture time is used where known.
+ */
+static unsigned long long bufferTime(struct device* dev, const struct v4l2_buffer* buf)
+{
+	unsigned long long real = realtimeNs();
+	unsigned long long captured = 0;
 
-			case EIO:
-				// Could ignore EIO, see spec.
-				// fall through
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+		captured = (unsigned long long)buf->timestamp.tv_sec * 1000000000ULL
+			+ buf->timestamp.tv_usec * 1000ULL;
 
-			default:
-				errno_exit("read");
+	if (dev->meta) {
+		unsigned long long camera = metaTime(dev->meta, buf->sequence, captured);
+
+		if (camera)
+			captured = camera;
+	}
+
+	if (!captured)
+		return real;
+	return captured + (real - nowNs());
+}
+
+/**
+ * Dequeue a single frame, process it if it is good and give the buffer back
+ * to the driver.
+ *
+ * \returns 1 if a frame was processed, 0 otherwise
+ */
+static int frameRead(struct device* dev)
+{
+	struct v4l2_buffer buf;
+
+	unsigned long long start = traceBegin();
+	perfStageBegin(&perf);
+
+	int r = deviceDequeue(dev, &buf);
+	if (r == -1)
+		deviceExit(dev);
+	if (r == 0)
+		return 0;
+
+	perfStageEnd(&perf, STAGE_DEQUEUE);
+	traceEnd("dequeue", start, dev->name, buf.sequence);
+	flightRecord(FLIGHT_DEQUEUE, dev->index, buf.sequence, buf.bytesused);
+
+	const unsigned char* p = dev->buffers[buf.index].start;
+	bool good = frameGood(p, buf.bytesused, buf.flags)
+		&& imageProcess(dev, p, buf.bytesused, bufferTime(dev, &buf));
+
+	if (good) {
+		if (dev->sequence == 1) {
+			deviceStep(dev, "first frame");
+			if (verbose)
+				fprintf(stderr, "%s: %-20s %9.3f ms\n", dev->name, "time to first frame",
+					(nowNs() - dev->openStart) / 1e6);
 		}
+	} else {
+		PROBE3(frame_discard, dev->name, buf.sequence, buf.bytesused);
 	}
 
-	imageProcess(buffer.start, n);
+	if (deviceRequeue(dev, &buf) == -1)
+		deviceExit(dev);
 
-	return 1;
+	return good;
 }
 
 /**
- * Read frames and process them
+ * Wait for frames on a set of devices, taking care of the bookkeeping that
+ * goes with every wait.
+ *
+ * \returns number of ready devices, 0 if interrupted
  */
-static void mainLoop(void)
-{	
-	unsigned int count = frame_count;
+static int pollDevices(struct pollfd* pfd, struct device** polled, unsigned int n)
+{
+	int timeout = -1;
 
-	while (count > 0) {
-		struct pollfd pfd = {fd, POLLIN, 0};
-		int timeout = -1;
+	unsigned long long start = nowNs();
+	int r = poll(pfd, n, timeout);
+	unsigned long long wait = nowNs() - start;
+	traceEnd("poll", start, NULL, 0);
 
-		int r = poll(&pfd, 1, timeout);
+	flightRecord(FLIGHT_POLL, 0, 0, wait / 1000);
+	if (isStall(wait) && polled[0]->sequence > 0)
+		flightTrigger(FLIGHT_STALL, polled[0]->index, polled[0]->sequence, wait / 1000);
 
-		if (r == -1)
-			errno_exit("poll");
+	if (dump_requested) {
+		dump_requested = 0;
+		traceDump();
+		flightTrigger(FLIGHT_SIGNAL, 0, 0, SIGUSR1);
+	}
 
-		if (frameRead())
-			count--;
+	if (r == -1) {
+		if (errno == EINTR)
+			return 0;
+		errno_exit("poll");
 	}
-}
 
-static void deviceUninit(void)
-{
-	free(buffer.start);
+	return r;
 }
 
-static void readInit(unsigned int buffer_size)
+/**
+ * Read frames from all devices and process them
+ */
+static void mainLoop(void)
 {
-	buffer.length = buffer_size;
-	buffer.start = malloc(buffer_size);
+	unsigned int remaining[MAX_DEVICES];
+	unsigned int active = 0;
+	unsigned int i;
+
+	for (i = 0; i < device_count; i++) {
+		remaining[i] = devices[i].failed ? 0 : frame_count ? frame_count : UINT_MAX;
+		if (remaining[i])
+			active++;
+	}
 
-	if (!buffer.start) {
-		fprintf (stderr, "Out of memory\n");
-		exit(EXIT_FAILURE);
+	while (active > 0 && !stop_requested) {
+		struct pollfd pfd[MAX_DEVICES];
+		struct device* polled[MAX_DEVICES];
+		unsigned int n = 0;
+
+		for (i = 0; i < device_count; i++) {
+			if (!remaining[i])
+				continue;
+			pfd[n].fd = devices[i].fd;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			polled[n++] = &devices[i];
+		}
+
+		if (pollDevices(pfd, polled, n) <= 0)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			struct device* dev = polled[i];
+
+			if (!pfd[i].revents)
+				continue;
+
+			if (dev->sequence == 0)
+				deviceStep(dev, "poll");
+
+			if (frameRead(dev) && --remaining[dev->index] == 0)
+				active--;
+		}
 	}
 }
 
-static void deviceInit(void)
+/**
+ * Round robin snapshots for more cameras than the bus can stream at once.
+ *
+ * At most max_streams devices stream at the same time. As soon as a device
+ * has delivered a good frame it is stopped and the longest waiting device is
+ * started in its place, so the bus stays busy without being oversubscribed.
+ * Devices keep their buffers between turns, only streaming is toggled.
+ */
+static void snapshotLoop(void)
 {
-	struct v4l2_capability cap;
-	struct v4l2_format fmt;
-	struct v4l2_streamparm frameint;
+	unsigned int remaining[MAX_DEVICES];
+	unsigned int waiting[MAX_DEVICES];
+	unsigned int head = 0, nwaiting = 0;
+	struct device* streaming[MAX_DEVICES];
+	unsigned int nstreaming = 0;
+	unsigned long long snapshots = 0;
+	unsigned long long start = nowNs();
+	unsigned int i;
+
+	for (i = 0; i < device_count; i++) {
+		if (devices[i].failed)
+			continue;
+		remaining[i] = frame_count ? frame_count : UINT_MAX;
+		waiting[nwaiting++] = i;
+	}
 
-	if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
-		if (errno == EINVAL) {
-			fprintf(stderr, "%s is no V4L2 device\n",deviceName);
-			exit(EXIT_FAILURE);
-		} else {
-			errno_exit("VIDIOC_QUERYCAP");
+	while ((nwaiting || nstreaming) && !stop_requested) {
+		struct pollfd pfd[MAX_DEVICES];
+		struct device* polled[MAX_DEVICES];
+
+		while (nstreaming < max_streams && nwaiting) {
+			struct device* dev = &devices[waiting[head]];
+
+			head = (head + 1) % MAX_DEVICES;
+			nwaiting--;
+
+			if (deviceStreamOn(dev) == -1) {
+				fprintf(stderr, "%s: cannot start streaming, skipping device\n", dev->name);
+				deviceStreamOff(dev);
+				dev->failed = true;
+				continue;
+			}
+			streaming[nstreaming++] = dev;
+		}
+
+		if (!nstreaming)
+			break;
+
+		for (i = 0; i < nstreaming; i++) {
+			pfd[i].fd = streaming[i]->fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+			polled[i] = streaming[i];
+		}
+
+		unsigned int n = nstreaming;
+		if (pollDevices(pfd, polled, n) <= 0)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			struct device* dev = polled[i];
+			unsigned int j;
+
+			if (!pfd[i].revents || !frameRead(dev))
+				continue;
+
+			snapshots++;
+			if (deviceStreamOff(dev) == -1)
+				deviceExit(dev);
+
+			for (j = 0; streaming[j] != dev; j++)
+				;
+			streaming[j] = streaming[--nstreaming];
+
+			if (--remaining[dev->index])
+				waiting[(head + nwaiting++) % MAX_DEVICES] = dev->index;
 		}
 	}
 
-	if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-		fprintf(stderr, "%s is no video capture device\n",deviceName);
-		exit(EXIT_FAILURE);
+	if (verbose) {
+		double seconds = (nowNs() - start) / 1e9;
+		fprintf(stderr, "%llu snapshots in %.3f s, %.2f snapshots/s\n",
+			snapshots, seconds, seconds > 0 ? snapshots / seconds : 0);
 	}
+}
 
-	if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-		fprintf(stderr, "%s does not support read i/o\n",deviceName);
+static void dumpSignal(int sig)
+{
+	(void)sig;
+	dump_requested = 1;
+}
+
+static void stopSignal(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+/**
+ * Cameras are named after their device node, video0 for /dev/video0.
+ */
+static const char* cameraName(const char* device)
+{
+	const char* base = strrchr(device, '/');
+
+	return base ? base + 1 : device;
+}
+
+/**
+ * Derive the output file of a device. A single device writes to the output
+ * file as given, several devices get the camera name inserted before the
+ * extension, output-video0.jpg and so on.
+ */
+static const char* outputName(const char* device)
+{
+	if (device_count == 1)
+		return jpegFilename;
+
+	const char* base = cameraName(device);
+
+	const char* slash = strrchr(jpegFilename, '/');
+	const char* ext = strrchr(jpegFilename, '.');
+	if (!ext || (slash && ext < slash))
+		ext = jpegFilename + strlen(jpegFilename);
+
+	size_t size = strlen(jpegFilename) + strlen(base) + 2;
+	char* name = malloc(size);
+	if (!name) {
+		fprintf(stderr, "Out of memory\n");
 		exit(EXIT_FAILURE);
 	}
 
-	/* Select video input, video standard and tune here. */
-	CLEAR(fmt);
+	snprintf(name, size, "%.*s-%s%s", (int)(ext - jpegFilename), jpegFilename, base, ext);
+	return name;
+}
 
-	// v4l2_format
-	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	fmt.fmt.pix.width = width;
-	fmt.fmt.pix.height = height;
-	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
+static void initJob(unsigned int i, void* arg)
+{
+	struct device* dev = &devices[i];
+	(void)arg;
 
-	/* Set a video format for the v4l2 driver */
-	if (xioctl(fd, VIDIOC_S_FMT, &fmt) == -1)
-		errno_exit("VIDIOC_S_FMT");
+	if (deviceOpen(dev) == -1) {
+		dev->failed = true;
+		return;
+	}
 
-	if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG) {
-		fprintf(stderr,"Libv4l didn't accept MJPEG format. Can't proceed.\n");
-		exit(EXIT_FAILURE);
+	/* in snapshot mode streaming is started on the device's turn */
+	if (deviceInit(dev, width, height, fps) == -1
+			|| (!max_streams && deviceStreamOn(dev) == -1)) {
+		deviceUninit(dev);
+		deviceClose(dev);
+		dev->failed = true;
+		return;
 	}
-	
-	CLEAR(frameint);
-	
-	/* Attempt to set the frame interval. */
-	frameint.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	frameint.parm.capture.timeperframe.numerator = 1;
-	frameint.parm.capture.timeperframe.denominator = fps;
-	if (xioctl(fd, VIDIOC_S_PARM, &frameint) == -1)
-		fprintf(stderr,"Unable to set frame interval.\n");
-
-	readInit(fmt.fmt.pix.sizeimage);
+
+	/* without the metadata the driver's timestamps still do */
+	if (dev->metaName && !(dev->meta = metaOpen(dev->metaName)))
+		fprintf(stderr, "%s: using driver timestamps\n", dev->name);
 }
 
-static void deviceClose(void)
+static void closeJob(unsigned int i, void* arg)
 {
-	if (v4l2_close(fd) == -1)
-		errno_exit("close");
+	struct device* dev = &devices[i];
+	(void)arg;
 
-	fd = -1;
+	deviceUninit(dev);
+	deviceClose(dev);
 }
 
-static void deviceOpen(void)
+/**
+ * Open and set up all devices concurrently. UVC negotiation is dominated by
+ * USB round trips, so with many cameras this is much faster than doing them
+ * one after the other.
+ *
+ * \returns number of devices that are ready
+ */
+static unsigned int devicesInit(void)
 {
-	// open device
-	fd = v4l2_open(deviceName, O_RDWR | O_NONBLOCK, 0);
+	unsigned long long start = nowNs();
+	unsigned int ready = 0;
+	unsigned int i;
 
-	// check if opening was successfull
-	if (fd == -1) {
-		fprintf(stderr, "Cannot open '%s': %d, %s\n", deviceName, errno, strerror(errno));
-		exit(EXIT_FAILURE);
+	poolRun(device_count, INIT_THREADS, initJob, NULL);
+
+	for (i = 0; i < device_count; i++) {
+		if (devices[i].failed) {
+			fprintf(stderr, "%s: initialization failed, skipping device\n", devices[i].name);
+			continue;
+		}
+		ready++;
+		if (verbose)
+			fprintf(stderr, "%s: %-20s %9.3f ms\n", devices[i].name, "init", devices[i].initNs / 1e6);
 	}
+
+	if (verbose)
+		fprintf(stderr, "%-20s %9.3f ms, %u of %u devices ready\n", "init total",
+			(nowNs() - start) / 1e6, ready, device_count);
+
+	return ready;
+}
+
+static void devicesClose(void)
+{
+	poolRun(device_count, INIT_THREADS, closeJob, NULL);
 }
 
 static void usage(FILE* fp, const char* name)
@@ -223,18 +548,53 @@ static void usage(FILE* fp, const char* name)
 	fprintf(fp,
 		"Usage: %s [options]\n\n"
 		"Options:\n"
-		"-d | --device name   Video device name [/dev/video0]\n"
+		"-d | --device name   Video device name, repeat for more devices [/dev/video0]\n"
 		"-h | --help          Print this message\n"
 		"-o | --output        Set JPEG output filename [output.jpg]\n"
 		"-r | --resolution    Set resolution i.e 1280x720\n"
 		"-i | --interval      Set frame interval (fps)\n"
+		"-U | --meta node     UVC metadata node of the last --device, for camera clock timestamps\n"
 		"-v | --version       Print version\n"
-		"-c | --count         Number of jpeg's to capture [1]\n"
+		"-c | --count         Number of jpeg's to capture per device, 0 for no limit [1]\n"
+		"-s | --snapshot n    Round robin snapshots, at most n devices streaming at once\n"
+		"-p | --perf          Print per frame hardware counters on exit\n"
+		"-t | --trace file    Write a Chrome trace on exit and on SIGUSR1\n"
+		"-f | --flight file   Flight recorder dump prefix [<output>.flight]\n"
+		"-V | --verbose       Print startup step timings\n"
+		"-R | --root dir      Record segments under dir, repeat to stripe over disks\n"
+		"-S | --segment secs  Segment length [60]\n"
+		"-L | --loop file[:MB]  Record all cameras into a loop overwriting its oldest frames\n"
+		"-m | --staging dir   Write segments to dir (tmpfs) first, move them to the roots later\n"
+		"-M | --staging-size MB  Staged data before recording waits for the move [256]\n"
+		"-w | --migrate-rate MB  Move at most MB per second from staging [8]\n"
+		"-q | --quota cam:MB[:prio]  Keep at most MB of camera cam, higher prio is deleted last\n"
+		"-F | --min-free MB   Delete oldest segments to keep MB free on every root [off]\n"
+		"-a | --age hours     Thin out segments older than hours to the --keep-fps rate\n"
+		"-k | --keep-fps fps  Frame rate kept in old segments [1]\n"
+		"-W | --decimate-rate MB  Copy at most MB per second when thinning out [8]\n"
+		"-A | --archive hours Transcode segments older than hours to H.264 (libjpeg, x264)\n"
+		"-j | --archive-threads n  Threads decoding and encoding archives [2]\n"
+		"-X | --archive-rate MB  Read at most MB of MJPEG per second when archiving [4]\n"
+		"-Q | --quality q     Requantise frames to JPEG quality q without decoding them\n"
+		"-B | --max-kb KB     Requantise frames larger than KB down to about KB\n"
+		"-y | --scale n      Also record cameras at 1/n size (2 or 4) as <cam>-half or -quarter\n"
+		"-C | --chroma420    Reduce 4:2:2 chroma to 4:2:0 without decoding\n"
+		"-N | --restart rows Add restart markers every rows MCU rows, for parallel decoding\n"
+		"-P | --progressive  Write frames as progressive JPEG, losslessly\n"
+		"-J | --filter-threads n  Threads per writer running the frame filters [4]\n"
+		"-K | --bench         Also time decoding and encoding each filtered frame, and the copy of\n"
+		"                     checksummed frames as separate passes, for comparison\n"
+		"-x | --extract cam   Write the recording of camera cam to the output file\n"
+		"-b | --begin time    Extract from time, seconds since the epoch\n"
+		"-e | --end time      Extract until time, seconds since the epoch\n"
+		"-T | --follow        Keep extracting frames as they are recorded, from now or --begin\n"
+		"-H | --http [host:]port  Serve the recordings over HTTP, only that without --device\n"
+		"-E | --tls cert[:key]  Serve HTTPS with the PEM certificate chain and key (OpenSSL)\n"
 		"",
 		name);
 }
 
-static const char short_options [] = "d:ho:r:i:vc:";
+static const char short_options [] = "d:ho:r:i:vc:s:pt:f:VR:S:x:b:e:m:M:w:q:F:a:k:W:A:j:X:Q:B:J:Ky:CN:PL:TU:H:E:";
 
 static const struct option
 long_options [] = {
@@ -243,8 +603,42 @@ long_options [] = {
 	{ "output",     required_argument, NULL, 'o' },
 	{ "resolution", required_argument, NULL, 'r' },
 	{ "interval",   required_argument, NULL, 'I' },
+	{ "meta",       required_argument, NULL, 'U' },
 	{ "version",	  no_argument,		   NULL, 'v' },
 	{ "count",      required_argument, NULL, 'c' },
+	{ "snapshot",   required_argument, NULL, 's' },
+	{ "perf",       no_argument,       NULL, 'p' },
+	{ "trace",      required_argument, NULL, 't' },
+	{ "flight",     required_argument, NULL, 'f' },
+	{ "verbose",    no_argument,       NULL, 'V' },
+	{ "root",       required_argument, NULL, 'R' },
+	{ "segment",    required_argument, NULL, 'S' },
+	{ "extract",    required_argument, NULL, 'x' },
+	{ "begin",      required_argument, NULL, 'b' },
+	{ "end",        required_argument, NULL, 'e' },
+	{ "follow",     no_argument,       NULL, 'T' },
+	{ "http",       required_argument, NULL, 'H' },
+	{ "tls",        required_argument, NULL, 'E' },
+	{ "loop",       required_argument, NULL, 'L' },
+	{ "staging",    required_argument, NULL, 'm' },
+	{ "staging-size", required_argument, NULL, 'M' },
+	{ "migrate-rate", required_argument, NULL, 'w' },
+	{ "quota",      required_argument, NULL, 'q' },
+	{ "min-free",   required_argument, NULL, 'F' },
+	{ "age",        required_argument, NULL, 'a' },
+	{ "keep-fps",   required_argument, NULL, 'k' },
+	{ "decimate-rate", required_argument, NULL, 'W' },
+	{ "archive",    required_argument, NULL, 'A' },
+	{ "archive-threads", required_argument, NULL, 'j' },
+	{ "archive-rate", required_argument, NULL, 'X' },
+	{ "quality",    required_argument, NULL, 'Q' },
+	{ "max-kb",     required_argument, NULL, 'B' },
+	{ "scale",      required_argument, NULL, 'y' },
+	{ "chroma420",  no_argument,       NULL, 'C' },
+	{ "restart",    required_argument, NULL, 'N' },
+	{ "progressive", no_argument,       NULL, 'P' },
+	{ "filter-threads", required_argument, NULL, 'J' },
+	{ "bench",      no_argument,       NULL, 'K' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -264,7 +658,19 @@ int main(int argc, char **argv)
 				break;
 
 			case 'd':
-				deviceName = optarg;
+				if (device_count == MAX_DEVICES) {
+					fprintf(stderr, "At most %d devices are supported\n", MAX_DEVICES);
+					exit(EXIT_FAILURE);
+				}
+				devices[device_count++].name = optarg;
+				break;
+
+			case 'U':
+				if (device_count == 0) {
+					fprintf(stderr, "--meta follows the --device it belongs to\n");
+					exit(EXIT_FAILURE);
+				}
+				devices[device_count - 1].metaName = optarg;
 				break;
 
 			case 'h':
@@ -299,27 +705,309 @@ int main(int argc, char **argv)
 				frame_count = atoi(optarg);
 				break;
 
+			case 's':
+				max_streams = atoi(optarg);
+				break;
+
+			case 'p':
+				perf_enabled = true;
+				break;
+
+			case 't':
+				if (traceOpen(optarg) == -1)
+					errno_exit("traceOpen");
+				break;
+
+			case 'f':
+				flightFilename = optarg;
+				break;
+
+			case 'V':
+				verbose = true;
+				break;
+
+			case 'R':
+				if (storeAddRoot(optarg) == -1)
+					exit(EXIT_FAILURE);
+				break;
+
+			case 'S':
+				storeSegmentLength(atoi(optarg));
+				break;
+
+			case 'x':
+				extractCamera = optarg;
+				break;
+
+			case 'b':
+				extractFrom = strtod(optarg, NULL) * 1e9;
+				break;
+
+			case 'e':
+				extractTo = strtod(optarg, NULL) * 1e9;
+				break;
+
+			case 'T':
+				follow = true;
+				break;
+
+			case 'H':
+				serveAddress = optarg;
+				break;
+
+			case 'E':
+				if (serveTls(optarg) == -1)
+					exit(EXIT_FAILURE);
+				break;
+
+			case 'L':
+				if (loopSet(optarg) == -1)
+					exit(EXIT_FAILURE);
+				break;
+
+			case 'm':
+				if (stageSet(optarg) == -1)
+					exit(EXIT_FAILURE);
+				break;
+
+			case 'M':
+				stageLimits(atoi(optarg), 0);
+				break;
+
+			case 'w':
+				stageLimits(0, atoi(optarg));
+				break;
+
+			case 'q':
+				if (retainPolicy(optarg) == -1)
+					exit(EXIT_FAILURE);
+				break;
+
+			case 'F':
+				retainMinFree(atoi(optarg));
+				break;
+
+			case 'a':
+				retainDecimate(strtod(optarg, NULL), 0, 0);
+				break;
+
+			case 'k':
+				retainDecimate(0, strtod(optarg, NULL), 0);
+				break;
+
+			case 'W':
+				retainDecimate(0, 0, atoi(optarg));
+				break;
+
+			case 'A':
+				archiveConfig(strtod(optarg, NULL), 0, 0);
+				break;
+
+			case 'j':
+				archiveConfig(0, atoi(optarg), 0);
+				break;
+
+			case 'X':
+				archiveConfig(0, 0, atoi(optarg));
+				break;
+
+			case 'Q':
+				filterQuality(atoi(optarg));
+				break;
+
+			case 'B':
+				filterMaxBytes(atoi(optarg) * 1024);
+				break;
+
+			case 'y':
+				if (filterScale(atoi(optarg)) == -1)
+					exit(EXIT_FAILURE);
+				break;
+
+			case 'C':
+				filterChroma(true);
+				break;
+
+			case 'N':
+				filterRestart(atoi(optarg));
+				break;
+
+			case 'P':
+				filterProgressive(true);
+				break;
+
+			case 'J':
+				filterThreads(atoi(optarg));
+				break;
+
+			case 'K':
+				filterBench(true);
+				bench = true;
+				break;
+
 			default:
 				usage(stderr, argv[0]);
 				exit(EXIT_FAILURE);
 		}
 	}
 
-	/* truncate output file, make ready for frames */
-	FILE* f = fopen(jpegFilename, "wb");
-	if (f)
-		fclose(f);
+	if (!flightFilename) {
+		static char name[4096];
+		snprintf(name, sizeof(name), "%s.flight", jpegFilename);
+		flightFilename = name;
+	}
+	flightInit(flightFilename, 10);
 
-	// open and initialize device
-	deviceOpen();
-	deviceInit();
+	if (filterCheck() == -1)
+		exit(EXIT_FAILURE);
+
+	if (extractCamera) {
+		FILE* out = fopen(jpegFilename, "wb");
+		if (!out)
+			errno_exit("fopen");
+
+		int frames = follow
+			? storeFollow(extractCamera, extractFrom ? extractFrom : TAIL_END, extractTo, out)
+			: storeExtract(extractCamera, extractFrom, extractTo, out);
+		if (fclose(out) == EOF)
+			errno_exit("fclose");
+		if (frames == -1)
+			exit(EXIT_FAILURE);
+
+		if (verbose) {
+			fprintf(stderr, "%d frames extracted\n", frames);
+			filterReport(stderr);
+		}
+		exit(EXIT_SUCCESS);
+	}
+
+	if (serveAddress && device_count == 0) {
+		sigset_t stop;
+		int sig;
+
+		/* serve what is recorded until told to stop */
+		sigemptyset(&stop);
+		sigaddset(&stop, SIGINT);
+		sigaddset(&stop, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &stop, NULL);
+		if (serveStart(serveAddress) == -1)
+			exit(EXIT_FAILURE);
+		sigwait(&stop, &sig);
+		serveStop();
+		if (verbose)
+			serveReport(stderr);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (device_count == 0)
+		devices[device_count++].name = "/dev/video0";
+
+	for (unsigned int i = 0; i < device_count; i++) {
+		struct device* dev = &devices[i];
+
+		dev->index = i;
+		dev->fd = -1;
+		dev->verbose = verbose;
+		dev->output = outputName(dev->name);
+
+		if (storeSegmented() || loopEnabled())
+			continue;
+
+		/* truncate output file, make ready for frames */
+		FILE* f = fopen(dev->output, "wb");
+		if (f)
+			fclose(f);
+	}
+
+	/*
+	 * Stop on SIGINT and SIGTERM like at the end of -c, so queued frames are
+	 * written and segments closed. Only the capture thread takes them, the
+	 * threads started from here on inherit the mask.
+	 */
+	sigset_t stop;
+	struct sigaction sa;
+
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop, NULL);
+	CLEAR(sa);
+	sa.sa_handler = stopSignal;
+	sa.sa_flags = SA_RESETHAND;   /* a second one kills */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (storeOpen(perf_enabled) == -1)
+		exit(EXIT_FAILURE);
+	checksums = loopEnabled();
+	if (serveAddress && serveStart(serveAddress) == -1)
+		exit(EXIT_FAILURE);
+
+	// open and initialize devices
+	unsigned int ready = devicesInit();
+
+	for (unsigned int i = 0; i < device_count; i++) {
+		struct device* dev = &devices[i];
+
+		if (dev->failed)
+			continue;
+
+		if (storeAddCamera(i, cameraName(dev->name), dev->output, perf_enabled) == -1) {
+			fprintf(stderr, "%s: no output, skipping device\n", dev->name);
+			dev->failed = true;
+			ready--;
+		}
+	}
+
+	if (!ready)
+		exit(EXIT_FAILURE);
+
+	CLEAR(sa);
+	sa.sa_handler = dumpSignal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	pthread_sigmask(SIG_UNBLOCK, &stop, NULL);
+	traceThreadName("capture");
+
+	/* counters are per thread, open them on the thread that captures */
+	if (perf_enabled && perfOpen(&perf) == -1)
+		fprintf(stderr, "Unable to open performance counters: %s\n", strerror(errno));
 
 	// process frames
-	mainLoop();
+	if (max_streams)
+		snapshotLoop();
+	else
+		mainLoop();
+
+	if (perf.fd[0] != -1) {
+		perfReport(stderr, &perf);
+		perfClose(&perf);
+	}
+
+	// close devices, then let the writers finish
+	devicesClose();
+	serveStop();
+	storeClose();
+
+	if (verbose || perf_enabled) {
+		for (unsigned int i = 0; i < device_count; i++)
+			if (!devices[i].failed) {
+				deviceReport(stderr, &devices[i]);
+				if (devices[i].meta)
+					metaReport(stderr, devices[i].meta, devices[i].name);
+			}
+		writersReport(stderr);
+		filterReport(stderr);
+		crc32cReport(stderr);
+		loopReport(stderr);
+		if (serveAddress)
+			serveReport(stderr);
+	}
 
-	// close device
-	deviceUninit();
-	deviceClose();
+	// metadata nodes stay open for their report
+	for (unsigned int i = 0; i < device_count; i++)
+		metaClose(devices[i].meta);
 
-	return 0;
+	return ready == device_count ? EXIT_SUCCESS : EXIT_FAILURE;
 }
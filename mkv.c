@@ -0,0 +1,494 @@
+/**
+ * Matroska writer, see mkv.h.
+ *
+ * Everything but the segment is built in memory first, so element sizes
+ * are known when they are written. The segment size and the duration are
+ * patched in when the file is closed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "mkv.h"
+
+#define EBML_HEADER 0x1A45DFA3
+#define EBML_VERSION 0x4286
+#define EBML_READ_VERSION 0x42F7
+#define EBML_MAX_ID_LENGTH 0x42F2
+#define EBML_MAX_SIZE_LENGTH 0x42F3
+#define EBML_DOC_TYPE 0x4282
+#define EBML_DOC_TYPE_VERSION 0x4287
+#define EBML_DOC_TYPE_READ_VERSION 0x4285
+#define MKV_SEGMENT 0x18538067
+#define MKV_INFO 0x1549A966
+#define MKV_TIMESTAMP_SCALE 0x2AD7B1
+#define MKV_DURATION 0x4489
+#define MKV_DATE_UTC 0x4461
+#define MKV_MUXING_APP 0x4D80
+#define MKV_WRITING_APP 0x5741
+#define MKV_TRACKS 0x1654AE6B
+#define MKV_TRACK_ENTRY 0xAE
+#define MKV_TRACK_NUMBER 0xD7
+#define MKV_TRACK_UID 0x73C5
+#define MKV_TRACK_TYPE 0x83
+#define MKV_FLAG_LACING 0x9C
+#define MKV_CODEC_ID 0x86
+#define MKV_CODEC_PRIVATE 0x63A2
+#define MKV_VIDEO 0xE0
+#define MKV_PIXEL_WIDTH 0xB0
+#define MKV_PIXEL_HEIGHT 0xBA
+#define MKV_CLUSTER 0x1F43B675
+#define MKV_CLUSTER_TIMESTAMP 0xE7
+#define MKV_SIMPLE_BLOCK 0xA3
+#define MKV_CUES 0x1C53BB6B
+#define MKV_CUE_POINT 0xBB
+#define MKV_CUE_TIME 0xB3
+#define MKV_CUE_TRACK_POSITIONS 0xB7
+#define MKV_CUE_TRACK 0xF7
+#define MKV_CUE_CLUSTER_POSITION 0xF1
+
+/* 2001-01-01T00:00:00Z, the Matroska epoch */
+#define MKV_EPOCH_NS 978307200000000000ULL
+
+struct ebml {
+	unsigned char* data;
+	size_t size;
+	size_t capacity;
+	bool failed;
+};
+
+struct cue {
+	unsigned long long time;
+	unsigned long long position;
+};
+
+struct mkv {
+	FILE* file;
+	char* path;
+	unsigned long long start;
+	off_t segment;        /* offset of the segment size */
+	off_t duration;       /* offset of the duration value */
+	struct ebml cluster;
+	unsigned long long clusterTime;
+	bool clusterOpen;
+	unsigned long long last;
+	struct cue* cues;
+	size_t cueCount;
+	size_t cueCapacity;
+};
+
+static void ebmlBytes(struct ebml* e, const void* data, size_t size)
+{
+	if (e->failed)
+		return;
+
+	if (e->size + size > e->capacity) {
+		size_t capacity = e->capacity ? e->capacity : 4096;
+
+		while (capacity < e->size + size)
+			capacity *= 2;
+
+		unsigned char* grown = realloc(e->data, capacity);
+		if (!grown) {
+			e->failed = true;
+			return;
+		}
+		e->data = grown;
+		e->capacity = capacity;
+	}
+
+	memcpy(e->data + e->size, data, size);
+	e->size += size;
+}
+
+/* IDs keep their length marker, so they are written as is */
+static void ebmlId(struct ebml* e, uint32_t id)
+{
+	unsigned char b[4];
+	int n = id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1;
+	int i;
+
+	for (i = 0; i < n; i++)
+		b[i] = id >> (8 * (n - 1 - i));
+	ebmlBytes(e, b, n);
+}
+
+/* element sizes always take 8 bytes, simple and patchable */
+static void ebmlSize(unsigned char* b, uint64_t size)
+{
+	int i;
+
+	b[0] = 0x01;
+	for (i = 1; i < 8; i++)
+		b[i] = size >> (8 * (7 - i));
+}
+
+static void ebmlHead(struct ebml* e, uint32_t id, uint64_t size)
+{
+	unsigned char b[8];
+
+	ebmlId(e, id);
+	ebmlSize(b, size);
+	ebmlBytes(e, b, 8);
+}
+
+static void ebmlUint(struct ebml* e, uint32_t id, uint64_t value)
+{
+	unsigned char b[8];
+	int n = 1, i;
+
+	while (n < 8 && value >> (8 * n))
+		n++;
+	for (i = 0; i < n; i++)
+		b[i] = value >> (8 * (n - 1 - i));
+
+	ebmlHead(e, id, n);
+	ebmlBytes(e, b, n);
+}
+
+static void ebmlData(struct ebml* e, uint32_t id, const void* data, size_t size)
+{
+	ebmlHead(e, id, size);
+	ebmlBytes(e, data, size);
+}
+
+static void ebmlMaster(struct ebml* e, uint32_t id, const struct ebml* child)
+{
+	ebmlData(e, id, child->data, child->size);
+	if (child->failed)
+		e->failed = true;
+}
+
+static void ebmlFree(struct ebml* e)
+{
+	free(e->data);
+	memset(e, 0, sizeof(*e));
+}
+
+/**
+ * Start a Matroska file.
+ *
+ * \param avcc AVCDecoderConfigurationRecord with the SPS and PPS
+ * \param start time of the first frame, CLOCK_REALTIME ns
+ * \returns the writer, NULL on error
+ */
+struct mkv* mkvCreate(const char* path, unsigned int width, unsigned int height,
+	const unsigned char* avcc, size_t avccSize, unsigned long long start)
+{
+	struct ebml head = { 0 }, info = { 0 }, tracks = { 0 }, entry = { 0 }, video = { 0 };
+	unsigned char b[8];
+	uint64_t date = start > MKV_EPOCH_NS ? start - MKV_EPOCH_NS : 0;
+	int i;
+
+	struct mkv* m = calloc(1, sizeof(*m));
+	if (!m || !(m->path = strdup(path)) || !(m->file = fopen(path, "wb"))) {
+		fprintf(stderr, "Cannot create '%s': %d, %s\n", path, errno, strerror(errno));
+		if (m)
+			free(m->path);
+		free(m);
+		return NULL;
+	}
+	m->start = start;
+
+	ebmlUint(&head, EBML_VERSION, 1);
+	ebmlUint(&head, EBML_READ_VERSION, 1);
+	ebmlUint(&head, EBML_MAX_ID_LENGTH, 4);
+	ebmlUint(&head, EBML_MAX_SIZE_LENGTH, 8);
+	ebmlData(&head, EBML_DOC_TYPE, "matroska", 8);
+	ebmlUint(&head, EBML_DOC_TYPE_VERSION, 4);
+	ebmlUint(&head, EBML_DOC_TYPE_READ_VERSION, 2);
+
+	ebmlUint(&info, MKV_TIMESTAMP_SCALE, 1000000);
+	ebmlHead(&info, MKV_DURATION, 8);
+	size_t duration = info.size;
+	memset(b, 0, sizeof(b));
+	ebmlBytes(&info, b, 8);
+	for (i = 0; i < 8; i++)
+		b[i] = date >> (8 * (7 - i));
+	ebmlData(&info, MKV_DATE_UTC, b, 8);
+	ebmlData(&info, MKV_MUXING_APP, "mjpeg-grab", 10);
+	ebmlData(&info, MKV_WRITING_APP, "mjpeg-grab", 10);
+
+	ebmlUint(&video, MKV_PIXEL_WIDTH, width);
+	ebmlUint(&video, MKV_PIXEL_HEIGHT, height);
+	ebmlUint(&entry, MKV_TRACK_NUMBER, 1);
+	ebmlUint(&entry, MKV_TRACK_UID, 1);
+	ebmlUint(&entry, MKV_TRACK_TYPE, 1);
+	ebmlUint(&entry, MKV_FLAG_LACING, 0);
+	ebmlData(&entry, MKV_CODEC_ID, "V_MPEG4/ISO/AVC", 15);
+	ebmlData(&entry, MKV_CODEC_PRIVATE, avcc, avccSize);
+	ebmlMaster(&entry, MKV_VIDEO, &video);
+	ebmlMaster(&tracks, MKV_TRACK_ENTRY, &entry);
+
+	struct ebml file = { 0 };
+	ebmlMaster(&file, EBML_HEADER, &head);
+	ebmlHead(&file, MKV_SEGMENT, 0);
+	m->segment = file.size - 8;
+	/* Info is written with its 4 byte ID and 8 byte size */
+	m->duration = file.size + 12 + duration;
+	ebmlMaster(&file, MKV_INFO, &info);
+	ebmlMaster(&file, MKV_TRACKS, &tracks);
+
+	bool failed = file.failed || fwrite(file.data, 1, file.size, m->file) != file.size;
+
+	ebmlFree(&head);
+	ebmlFree(&info);
+	ebmlFree(&tracks);
+	ebmlFree(&entry);
+	ebmlFree(&video);
+	ebmlFree(&file);
+
+	if (failed) {
+		fclose(m->file);
+		unlink(m->path);
+		free(m->path);
+		free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+static int clusterFlush(struct mkv* m)
+{
+	struct ebml head = { 0 };
+
+	if (!m->clusterOpen)
+		return 0;
+
+	if (m->cueCount == m->cueCapacity) {
+		size_t capacity = m->cueCapacity ? m->cueCapacity * 2 : 64;
+		struct cue* grown = realloc(m->cues, capacity * sizeof(*grown));
+		if (!grown)
+			return -1;
+		m->cues = grown;
+		m->cueCapacity = capacity;
+	}
+
+	/* cue positions count from the start of the segment's data */
+	m->cues[m->cueCount].time = m->clusterTime;
+	m->cues[m->cueCount].position = ftello(m->file) - (m->segment + 8);
+	m->cueCount++;
+
+	ebmlHead(&head, MKV_CLUSTER, m->cluster.size);
+	int r = m->cluster.failed || head.failed
+		|| fwrite(head.data, 1, head.size, m->file) != head.size
+		|| fwrite(m->cluster.data, 1, m->cluster.size, m->file) != m->cluster.size ? -1 : 0;
+
+	ebmlFree(&head);
+	m->cluster.size = 0;
+	m->clusterOpen = false;
+	return r;
+}
+
+/**
+ * Add a frame.
+ *
+ * \param timestamp capture time, CLOCK_REALTIME ns
+ * \param key whether the frame is an IDR frame
+ * \param data NAL units, each with a 4 byte big endian length
+ * \returns 0 on success, -1 on error
+ */
+int mkvWrite(struct mkv* m, unsigned long long timestamp, bool key, const unsigned char* data, size_t size)
+{
+	unsigned char block[4];
+	unsigned long long time = timestamp > m->start ? (timestamp - m->start) / 1000000 : 0;
+
+	/* timestamps must not go back within the file */
+	if (time < m->last)
+		time = m->last;
+	m->last = time;
+
+	/* block times are 16 bit signed offsets from the cluster */
+	if (m->clusterOpen && (key || time - m->clusterTime > 32767) && clusterFlush(m) == -1)
+		return -1;
+
+	if (!m->clusterOpen) {
+		m->clusterTime = time;
+		m->clusterOpen = true;
+		ebmlUint(&m->cluster, MKV_CLUSTER_TIMESTAMP, time);
+	}
+
+	block[0] = 0x81;  /* track 1 */
+	block[1] = (time - m->clusterTime) >> 8;
+	block[2] = time - m->clusterTime;
+	block[3] = key ? 0x80 : 0;
+
+	ebmlHead(&m->cluster, MKV_SIMPLE_BLOCK, sizeof(block) + size);
+	ebmlBytes(&m->cluster, block, sizeof(block));
+	ebmlBytes(&m->cluster, data, size);
+	return m->cluster.failed ? -1 : 0;
+}
+
+/**
+ * Write the cues, patch the sizes and close the file.
+ *
+ * \returns 0 on success, -1 on error
+ */
+int mkvClose(struct mkv* m)
+{
+	struct ebml cues = { 0 }, file = { 0 };
+	unsigned char b[8];
+	size_t i;
+	int r = clusterFlush(m);
+
+	for (i = 0; i < m->cueCount; i++) {
+		struct ebml point = { 0 }, position = { 0 };
+
+		ebmlUint(&position, MKV_CUE_TRACK, 1);
+		ebmlUint(&position, MKV_CUE_CLUSTER_POSITION, m->cues[i].position);
+		ebmlUint(&point, MKV_CUE_TIME, m->cues[i].time);
+		ebmlMaster(&point, MKV_CUE_TRACK_POSITIONS, &position);
+		ebmlMaster(&cues, MKV_CUE_POINT, &point);
+		ebmlFree(&point);
+		ebmlFree(&position);
+	}
+	if (m->cueCount)
+		ebmlMaster(&file, MKV_CUES, &cues);
+
+	if (file.failed || fwrite(file.data, 1, file.size, m->file) != file.size)
+		r = -1;
+
+	off_t end = ftello(m->file);
+	double duration = m->last;
+	uint64_t bits;
+
+	memcpy(&bits, &duration, sizeof(bits));
+	for (i = 0; i < 8; i++)
+		b[i] = bits >> (8 * (7 - i));
+
+	unsigned char size[8];
+	ebmlSize(size, end - (m->segment + 8));
+
+	if (fseeko(m->file, m->segment, SEEK_SET) == -1 || fwrite(size, 1, 8, m->file) != 8
+			|| fseeko(m->file, m->duration, SEEK_SET) == -1 || fwrite(b, 1, 8, m->file) != 8
+			|| fflush(m->file) == EOF || fsync(fileno(m->file)) == -1)
+		r = -1;
+	if (fclose(m->file) == EOF)
+		r = -1;
+
+	if (r == -1)
+		fprintf(stderr, "%s: write error %d, %s\n", m->path, errno, strerror(errno));
+
+	ebmlFree(&cues);
+	ebmlFree(&file);
+	ebmlFree(&m->cluster);
+	free(m->cues);
+	free(m->path);
+	free(m);
+	return r;
+}
+
+/**
+ * Read an EBML variable length number. IDs keep their length marker, sizes
+ * do not.
+ */
+static int readVint(FILE* f, bool id, uint64_t* value)
+{
+	int c = fgetc(f), n = 1, i;
+
+	if (c == EOF || c == 0)
+		return -1;
+	while (!(c & (0x80 >> (n - 1))))
+		n++;
+
+	*value = id ? (uint64_t)c : (uint64_t)(c & (0xFF >> n));
+	for (i = 1; i < n; i++) {
+		int next = fgetc(f);
+		if (next == EOF)
+			return -1;
+		*value = *value << 8 | next;
+	}
+
+	return 0;
+}
+
+/**
+ * Check that every block of every cluster holds whole length prefixed NAL
+ * units and that all sizes add up to the file.
+ *
+ * \returns number of frames, -1 if the file is broken
+ */
+long mkvVerify(const char* path)
+{
+	unsigned char* block = NULL;
+	size_t blockSize = 0;
+	uint64_t id, size;
+	long frames = -1;
+
+	FILE* f = fopen(path, "rb");
+	if (!f)
+		return -1;
+
+	if (fseeko(f, 0, SEEK_END) == -1)
+		goto out;
+	off_t length = ftello(f);
+	rewind(f);
+
+	if (readVint(f, true, &id) == -1 || id != EBML_HEADER || readVint(f, false, &size) == -1
+			|| fseeko(f, size, SEEK_CUR) == -1)
+		goto out;
+	if (readVint(f, true, &id) == -1 || id != MKV_SEGMENT || readVint(f, false, &size) == -1
+			|| (off_t)size != length - ftello(f))
+		goto out;
+
+	long count = 0;
+	while (ftello(f) < length) {
+		if (readVint(f, true, &id) == -1 || readVint(f, false, &size) == -1
+				|| (off_t)size > length - ftello(f))
+			goto out;
+
+		if (id != MKV_CLUSTER) {
+			if (fseeko(f, size, SEEK_CUR) == -1)
+				goto out;
+			continue;
+		}
+
+		off_t clusterEnd = ftello(f) + size;
+		while (ftello(f) < clusterEnd) {
+			if (readVint(f, true, &id) == -1 || readVint(f, false, &size) == -1
+					|| (off_t)size > clusterEnd - ftello(f))
+				goto out;
+
+			if (id != MKV_SIMPLE_BLOCK) {
+				if (fseeko(f, size, SEEK_CUR) == -1)
+					goto out;
+				continue;
+			}
+
+			if (size < 4)
+				goto out;
+			if (size > blockSize) {
+				unsigned char* grown = realloc(block, size);
+				if (!grown)
+					goto out;
+				block = grown;
+				blockSize = size;
+			}
+			if (fread(block, 1, size, f) != size || block[0] != 0x81)
+				goto out;
+
+			size_t at = 4;
+			while (at + 4 <= size) {
+				at += 4 + ((size_t)block[at] << 24 | block[at + 1] << 16 | block[at + 2] << 8 | block[at + 3]);
+			}
+			if (at != size)
+				goto out;
+			count++;
+		}
+	}
+
+	frames = count;
+
+out:
+	free(block);
+	fclose(f);
+	return frames;
+}
@@ -0,0 +1,23 @@
+/**
+ * Minimal Matroska writer for one H.264 video track.
+ *
+ * Frames are stored as SimpleBlocks in millisecond resolution relative to
+ * the segment start, which is kept as the file's DateUTC. Clusters start at
+ * key frames and are listed in the cues, so players can seek.
+ */
+
+#ifndef MKV_H
+#define MKV_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct mkv;
+
+struct mkv* mkvCreate(const char* path, unsigned int width, unsigned int height,
+	const unsigned char* avcc, size_t avccSize, unsigned long long start);
+int mkvWrite(struct mkv* m, unsigned long long timestamp, bool key, const unsigned char* data, size_t size);
+int mkvClose(struct mkv* m);
+long mkvVerify(const char* path);
+
+#endif
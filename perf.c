@@ -0,0 +1,202 @@
+/**
+ * Per stage hardware counters, see perf.h.
+ *
+ * Counters are read with rdpmc when the kernel allows it for mmap'ed events,
+ * which costs a few dozen cycles. Otherwise every stage boundary is a read()
+ * system call per event.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "perf.h"
+
+static const char* const stageNames[STAGE_COUNT] = {
+	"dequeue",
+	"copy",
+	"write",
+};
+
+static const uint64_t eventConfig[EVENT_COUNT] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static int eventOpen(uint64_t config, int group, int excludeKernel)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.exclude_kernel = excludeKernel;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t rdpmc(unsigned int counter)
+{
+	uint32_t low, high;
+
+	__asm__ __volatile__("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+	return (uint64_t)high << 32 | low;
+}
+#endif
+
+/**
+ * Read one counter, from userspace if the mmap page says that is allowed.
+ */
+static uint64_t eventRead(const struct perf_counters* pc, int event)
+{
+	uint64_t value = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	volatile struct perf_event_mmap_page* pg = pc->page[event];
+
+	if (pg) {
+		uint32_t seq;
+		int64_t count;
+		int user;
+
+		do {
+			seq = pg->lock;
+			__sync_synchronize();
+			uint32_t index = pg->index;
+			count = pg->offset;
+			user = pg->cap_user_rdpmc && index;
+			if (user) {
+				int64_t pmc = rdpmc(index - 1);
+				unsigned int shift = 64 - pg->pmc_width;
+				count += (int64_t)((uint64_t)pmc << shift) >> shift;
+			}
+			__sync_synchronize();
+		} while (pg->lock != seq);
+
+		if (user)
+			return count;
+	}
+#endif
+
+	if (read(pc->fd[event], &value, sizeof(value)) != sizeof(value))
+		return 0;
+
+	return value;
+}
+
+/**
+ * Open cycle, instruction and cache miss counters for the calling thread.
+ *
+ * Kernel time is counted when perf_event_paranoid permits it, since most of
+ * the dequeue work happens in the kernel.
+ *
+ * \param pc counters to initialize
+ * \returns 0 on success, -1 with errno set if the counters are unavailable
+ */
+int perfOpen(struct perf_counters* pc)
+{
+	long pageSize = sysconf(_SC_PAGESIZE);
+	int excludeKernel = 0;
+	int i;
+
+	memset(pc, 0, sizeof(*pc));
+	for (i = 0; i < EVENT_COUNT; i++)
+		pc->fd[i] = -1;
+
+	for (i = 0; i < EVENT_COUNT; i++) {
+		int group = i ? pc->fd[0] : -1;
+
+		pc->fd[i] = eventOpen(eventConfig[i], group, excludeKernel);
+		if (pc->fd[i] == -1 && i == 0 && (errno == EACCES || errno == EPERM)) {
+			excludeKernel = 1;
+			pc->fd[i] = eventOpen(eventConfig[i], group, excludeKernel);
+		}
+		if (pc->fd[i] == -1) {
+			int err = errno;
+			perfClose(pc);
+			errno = err;
+			return -1;
+		}
+
+		void* page = mmap(NULL, pageSize, PROT_READ, MAP_SHARED, pc->fd[i], 0);
+		pc->page[i] = page == MAP_FAILED ? NULL : page;
+	}
+
+	return 0;
+}
+
+void perfClose(struct perf_counters* pc)
+{
+	long pageSize = sysconf(_SC_PAGESIZE);
+	int i;
+
+	for (i = EVENT_COUNT - 1; i >= 0; i--) {
+		if (pc->page[i])
+			munmap(pc->page[i], pageSize);
+		if (pc->fd[i] != -1)
+			close(pc->fd[i]);
+		pc->page[i] = NULL;
+		pc->fd[i] = -1;
+	}
+}
+
+/**
+ * Mark the start of a stage. Stages do not nest.
+ */
+void perfStageBegin(struct perf_counters* pc)
+{
+	int i;
+
+	if (pc->fd[0] == -1)
+		return;
+
+	for (i = 0; i < EVENT_COUNT; i++)
+		pc->start[i] = eventRead(pc, i);
+}
+
+/**
+ * Mark the end of a stage and charge one frame's worth of counts to it.
+ */
+void perfStageEnd(struct perf_counters* pc, enum perf_stage stage)
+{
+	int i;
+
+	if (pc->fd[0] == -1)
+		return;
+
+	for (i = 0; i < EVENT_COUNT; i++)
+		pc->total[stage][i] += eventRead(pc, i) - pc->start[i];
+	pc->frames[stage]++;
+}
+
+/**
+ * Print per frame averages for every stage that saw frames.
+ */
+void perfReport(FILE* fp, const struct perf_counters* pc)
+{
+	int s;
+
+	fprintf(fp, "%-8s %8s %14s %14s %14s\n",
+		"stage", "frames", "cycles/frame", "instr/frame", "misses/frame");
+
+	for (s = 0; s < STAGE_COUNT; s++) {
+		unsigned long n = pc->frames[s];
+
+		if (!n)
+			continue;
+
+		fprintf(fp, "%-8s %8lu %14llu %14llu %14llu\n", stageNames[s], n,
+			(unsigned long long)(pc->total[s][EVENT_CYCLES] / n),
+			(unsigned long long)(pc->total[s][EVENT_INSTRUCTIONS] / n),
+			(unsigned long long)(pc->total[s][EVENT_CACHE_MISSES] / n));
+	}
+}
@@ -0,0 +1,43 @@
+/**
+ * Self-profiling with hardware performance counters.
+ *
+ * Counters are opened with perf_event_open() for the calling thread only, so
+ * every thread that wants numbers needs its own struct perf_counters.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <linux/perf_event.h>
+
+enum perf_stage {
+	STAGE_DEQUEUE,
+	STAGE_COPY,
+	STAGE_WRITE,
+	STAGE_COUNT
+};
+
+enum perf_event {
+	EVENT_CYCLES,
+	EVENT_INSTRUCTIONS,
+	EVENT_CACHE_MISSES,
+	EVENT_COUNT
+};
+
+struct perf_counters {
+	int fd[EVENT_COUNT];
+	struct perf_event_mmap_page* page[EVENT_COUNT];
+	uint64_t start[EVENT_COUNT];
+	uint64_t total[STAGE_COUNT][EVENT_COUNT];
+	unsigned long frames[STAGE_COUNT];
+};
+
+int perfOpen(struct perf_counters* pc);
+void perfClose(struct perf_counters* pc);
+void perfStageBegin(struct perf_counters* pc);
+void perfStageEnd(struct perf_counters* pc, enum perf_stage stage);
+void perfReport(FILE* fp, const struct perf_counters* pc);
+
+#endif
@@ -0,0 +1,72 @@
+/**
+ * Minimal fork/join thread pool, see pool.h.
+ *
+ * Workers claim job indices from a shared counter until all are taken, so a
+ * slow job only holds up its own worker. Intended for blocking work such as
+ * device negotiation, not for the per frame path.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+#define POOL_MAX_THREADS 64
+
+struct pool {
+	unsigned int jobs;
+	unsigned int next;
+	pool_job job;
+	void* arg;
+};
+
+static void* worker(void* p)
+{
+	struct pool* pool = p;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->jobs)
+		pool->job(i, pool->arg);
+
+	return NULL;
+}
+
+/**
+ * Run job(0..jobs-1, arg) and wait for all of them to finish.
+ *
+ * \param jobs number of jobs
+ * \param threads maximum number of threads to use, the caller counts as one
+ * \param job function called once per index
+ * \param arg passed to every call
+ * \returns 0, or -1 if no extra thread could be started and the jobs ran on
+ *          the calling thread only
+ */
+int poolRun(unsigned int jobs, unsigned int threads, pool_job job, void* arg)
+{
+	struct pool pool = { jobs, 0, job, arg };
+	pthread_t tid[POOL_MAX_THREADS];
+	unsigned int started = 0;
+	unsigned int i;
+
+	if (threads > jobs)
+		threads = jobs;
+	if (threads > POOL_MAX_THREADS)
+		threads = POOL_MAX_THREADS;
+
+	for (i = 1; i < threads; i++) {
+		int err = pthread_create(&tid[started], NULL, worker, &pool);
+		if (err) {
+			fprintf(stderr, "pthread_create error %d, %s\n", err, strerror(err));
+			break;
+		}
+		started++;
+	}
+
+	worker(&pool);
+
+	for (i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	return threads > 1 && !started ? -1 : 0;
+}
@@ -0,0 +1,12 @@
+/**
+ * Run a batch of independent jobs on a short lived set of threads.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+typedef void (*pool_job)(unsigned int index, void* arg);
+
+int poolRun(unsigned int jobs, unsigned int threads, pool_job job, void* arg);
+
+#endif
@@ -0,0 +1,33 @@
+/**
+ * USDT static tracepoints.
+ *
+ * With the systemtap sdt headers available each probe compiles to a single
+ * nop plus a note in the ELF file, so they are left on in release builds.
+ * List them with `bpftrace -l 'usdt:./mjpeg-grab:*'`. Without the headers
+ * the probes compile to nothing.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(mjpeg_grab, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(mjpeg_grab, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(mjpeg_grab, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(mjpeg_grab, name, a, b, c, d)
+
+#else
+
+/* sizeof keeps the arguments "used" without evaluating them */
+#define PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) \
+	do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#define PROBE4(name, a, b, c, d) \
+	do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); (void)sizeof(d); } while (0)
+
+#endif
+
+#endif
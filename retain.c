@@ -0,0 +1,583 @@
+/**
+ * Retention, see retain.h.
+ *
+ * The writer threads only add to a camera's total and append to its list of
+ * segments under a short lock. Everything that touches the filesystem,
+ * statvfs() and unlink(), happens on the retention thread.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+
+#include "catalog.h"
+#include "clock.h"
+#include "compact.h"
+#include "retain.h"
+#include "store.h"
+#include "trace.h"
+
+#define MAX_CAMERAS 64
+#define MAX_POLICIES 64
+#define RETAIN_INTERVAL_NS 1000000000ULL
+
+struct kept {
+	struct kept* next;
+	unsigned long long start;
+	struct root* root;
+	bool decimated;
+	bool archived;
+	char* path;
+};
+
+struct policy {
+	const char* camera;
+	unsigned long long quota;  /* bytes, 0 for none */
+	int priority;
+};
+
+struct retained {
+	const char* camera;
+	unsigned long long bytes;
+	unsigned long long quota;
+	int priority;
+	struct kept* oldest;
+	struct kept** newest;
+};
+
+static struct policy policies[MAX_POLICIES];
+static unsigned int policy_count;
+static struct retained cameras[MAX_CAMERAS];
+static unsigned long long min_free;
+static unsigned long long decimate_age;
+static unsigned long long decimate_interval = 1000000000ULL;
+static unsigned long long decimate_rate = 8ULL << 20;
+static struct root* roots;
+static unsigned int root_count;
+static bool stopping;
+static bool running;
+static bool warned;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Parse a retention policy, camera:quota MB[:priority]. A quota of 0 means
+ * no quota, cameras with a higher priority are kept longer when space runs
+ * low.
+ *
+ * \returns 0 on success, -1 on a bad policy
+ */
+int retainPolicy(const char* spec)
+{
+	const char* colon = strchr(spec, ':');
+	char* end;
+
+	if (policy_count == MAX_POLICIES || !colon || colon == spec) {
+		fprintf(stderr, "Bad retention policy '%s', expected camera:MB[:priority]\n", spec);
+		return -1;
+	}
+
+	struct policy* p = &policies[policy_count];
+	p->quota = strtoull(colon + 1, &end, 10) << 20;
+	p->priority = *end == ':' ? atoi(end + 1) : 0;
+	p->camera = strndup(spec, colon - spec);
+	if (!p->camera)
+		return -1;
+
+	policy_count++;
+	return 0;
+}
+
+/**
+ * Free space to keep on every root, 0 to let the disks fill up.
+ */
+void retainMinFree(unsigned int megabytes)
+{
+	min_free = (unsigned long long)megabytes << 20;
+}
+
+/**
+ * Decimate segments once they are older than age.
+ *
+ * \param hours age in hours, 0 to keep full frame rate forever
+ * \param fps frame rate to keep, frames per second
+ * \param megabytesPerSecond copy rate limit
+ */
+void retainDecimate(double hours, double fps, unsigned int megabytesPerSecond)
+{
+	if (hours > 0)
+		decimate_age = hours * 3600e9;
+	if (fps > 0)
+		decimate_interval = 1e9 / fps;
+	if (megabytesPerSecond)
+		decimate_rate = (unsigned long long)megabytesPerSecond << 20;
+}
+
+/**
+ * Start tracking a camera, with its policy if one was given.
+ */
+void retainCamera(unsigned int device, const char* camera)
+{
+	unsigned int i;
+
+	if (device >= MAX_CAMERAS)
+		return;
+
+	struct retained* c = &cameras[device];
+	c->camera = camera;
+	c->newest = &c->oldest;
+	for (i = 0; i < policy_count; i++) {
+		if (strcmp(policies[i].camera, camera) == 0) {
+			c->quota = policies[i].quota;
+			c->priority = policies[i].priority;
+		}
+	}
+}
+
+/**
+ * Count bytes written for a camera. Called on the writer threads.
+ */
+void retainWrote(unsigned int device, unsigned long long bytes)
+{
+	if (device < MAX_CAMERAS)
+		__atomic_add_fetch(&cameras[device].bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/**
+ * Make a finished segment on a durable root eligible for deletion. Its
+ * bytes must already be counted. Segments should come oldest first.
+ */
+void retainSegment(const char* camera, unsigned long long start, const char* path, struct root* root)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_CAMERAS; i++) {
+		struct retained* c = &cameras[i];
+
+		if (!c->camera || strcmp(c->camera, camera) != 0)
+			continue;
+
+		struct kept* k = calloc(1, sizeof(*k));
+		if (!k || !(k->path = strdup(path))) {
+			free(k);
+			return;
+		}
+
+		k->start = start;
+		k->root = root;
+		k->archived = strlen(path) > 4 && strcmp(path + strlen(path) - 4, ".mkv") == 0;
+		k->decimated = k->archived;
+
+		pthread_mutex_lock(&lock);
+		*c->newest = k;
+		c->newest = &k->next;
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+}
+
+/**
+ * Take a camera's oldest segment, optionally the oldest one on a given root,
+ * off its list.
+ */
+static struct kept* takeOldest(struct retained* c, struct root* root)
+{
+	struct kept** p;
+
+	for (p = &c->oldest; *p; p = &(*p)->next) {
+		struct kept* k = *p;
+
+		if (root && k->root != root)
+			continue;
+
+		*p = k->next;
+		if (!*p)
+			c->newest = p;
+		return k;
+	}
+
+	return NULL;
+}
+
+/**
+ * Put a segment taken off a camera's list back in its place.
+ */
+static void keepAgain(struct retained* c, struct kept* k)
+{
+	struct kept** p;
+
+	pthread_mutex_lock(&lock);
+	for (p = &c->oldest; *p && (*p)->start < k->start; p = &(*p)->next)
+		;
+	k->next = *p;
+	*p = k;
+	if (!k->next)
+		c->newest = &k->next;
+	pthread_mutex_unlock(&lock);
+}
+
+static unsigned long long segmentBytes(const char* path)
+{
+	char index[PATH_MAX + NAME_MAX + 40];
+	struct stat st;
+	unsigned long long bytes = 0;
+
+	snprintf(index, sizeof(index), "%s.idx", path);
+	if (stat(path, &st) == 0)
+		bytes += st.st_size;
+	if (stat(index, &st) == 0)
+		bytes += st.st_size;
+	return bytes;
+}
+
+/**
+ * Delete a segment, catalog first so it never lists a missing file. If
+ * the catalog cannot be written the segment stays on the list, to be
+ * tried again on the next round.
+ *
+ * \returns 0 on success, -1 if the segment was kept
+ */
+static int delete(struct retained* c, struct kept* k)
+{
+	char index[PATH_MAX + 8];
+
+	unsigned long long start = traceBegin();
+	snprintf(index, sizeof(index), "%s.idx", k->path);
+
+	if (catalogAppend("del", c->camera, k->start, NULL) == -1) {
+		keepAgain(c, k);
+		traceEnd("retain", start, c->camera, 0);
+		return -1;
+	}
+
+	/* data and index, as counted by retainWrote() and retainLoad() */
+	unsigned long long size = segmentBytes(k->path);
+	if (unlink(k->path) == -1 && errno != ENOENT)
+		fprintf(stderr, "Cannot delete '%s': %d, %s\n", k->path, errno, strerror(errno));
+	unlink(index);
+
+	unsigned long long bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&c->bytes, size < bytes ? size : bytes, __ATOMIC_RELAXED);
+	traceEnd("retain", start, c->camera, 0);
+	free(k->path);
+	free(k);
+	return 0;
+}
+
+static unsigned long long freeSpace(const struct root* root)
+{
+	struct statvfs sv;
+
+	return statvfs(root->path, &sv) == 0 ? (unsigned long long)sv.f_bavail * sv.f_frsize : 0;
+}
+
+/**
+ * Delete the oldest segment on a root among the cameras with the lowest
+ * priority that have any there.
+ *
+ * \returns 0 if a segment was deleted, -1 if there was none, 1 if it
+ * could not be deleted this time
+ */
+static int freeRoot(struct root* root)
+{
+	struct retained* victim = NULL;
+	unsigned long long victimStart = 0;
+	unsigned int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < MAX_CAMERAS; i++) {
+		struct retained* c = &cameras[i];
+		struct kept* k;
+
+		for (k = c->oldest; k && k->root != root; k = k->next)
+			;
+		if (!k)
+			continue;
+
+		if (!victim || c->priority < victim->priority
+				|| (c->priority == victim->priority && k->start < victimStart)) {
+			victim = c;
+			victimStart = k->start;
+		}
+	}
+
+	struct kept* k = victim ? takeOldest(victim, root) : NULL;
+	pthread_mutex_unlock(&lock);
+
+	if (!k)
+		return -1;
+
+	return delete(victim, k) == 0 ? 0 : 1;
+}
+
+
+/**
+ * Pick the oldest segment started before a time that has not been archived
+ * yet, and mark it, so a failing segment is not tried again and again.
+ *
+ * \returns 0 if a segment was found, -1 if there is none
+ */
+int retainAged(unsigned long long before, const char** camera, unsigned long long* start,
+	char* path, size_t size, struct root** root)
+{
+	unsigned int i;
+	int r = -1;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < MAX_CAMERAS && r == -1; i++) {
+		struct kept* k;
+
+		for (k = cameras[i].oldest; k && k->archived; k = k->next)
+			;
+		if (!k || k->start >= before)
+			continue;
+
+		k->archived = true;
+		*camera = cameras[i].camera;
+		*start = k->start;
+		*root = k->root;
+		snprintf(path, size, "%s", k->path);
+		r = 0;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return r;
+}
+
+/**
+ * Switch a segment over to a new copy. The catalog is updated first, then
+ * the old files are removed.
+ *
+ * \param op catalog operation to record
+ * \returns 0 on success, -1 if the segment is gone or the catalog failed, in
+ *          which case the new copy is left to the caller
+ */
+int retainReplace(const char* camera, unsigned long long start, const char* old, const char* path, const char* op)
+{
+	char index[PATH_MAX + NAME_MAX + 40];
+	struct retained* c = NULL;
+	struct kept* k = NULL;
+	unsigned int i;
+
+	char* copy = strdup(path);
+	if (!copy)
+		return -1;
+
+	unsigned long long before = segmentBytes(old);
+	unsigned long long after = segmentBytes(path);
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < MAX_CAMERAS && !k; i++) {
+		c = &cameras[i];
+		if (!c->camera || strcmp(c->camera, camera) != 0)
+			continue;
+
+		for (k = c->oldest; k && (k->start != start || strcmp(k->path, old) != 0); k = k->next)
+			;
+	}
+
+	if (!k || catalogAppend(op, camera, start, path) == -1) {
+		pthread_mutex_unlock(&lock);
+		free(copy);
+		return -1;
+	}
+
+	char* gone = k->path;
+	k->path = copy;
+	pthread_mutex_unlock(&lock);
+
+	snprintf(index, sizeof(index), "%s.idx", gone);
+	unlink(gone);
+	unlink(index);
+	free(gone);
+
+	if (before > after) {
+		unsigned long long bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+		unsigned long long saved = before - after;
+		__atomic_sub_fetch(&c->bytes, saved < bytes ? saved : bytes, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&c->bytes, after - before, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+/**
+ * Decimate the oldest segment that is old enough and has not been yet. The
+ * decimated copy gets its own name, the catalog switches to it before the
+ * original is removed.
+ *
+ * \returns true if there may be more to do
+ */
+static bool decimateOne(void)
+{
+	struct retained* c = NULL;
+	struct kept* k = NULL;
+	char path[PATH_MAX + NAME_MAX + 32], dest[PATH_MAX + NAME_MAX + 32];
+	unsigned long long saved = 0, start = 0;
+	unsigned int i;
+
+	if (!decimate_age)
+		return false;
+
+	unsigned long long before = realtimeNs() - decimate_age;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < MAX_CAMERAS && !k; i++) {
+		for (k = cameras[i].oldest; k && k->decimated; k = k->next)
+			;
+		if (k && k->start < before) {
+			c = &cameras[i];
+			k->decimated = true;
+			start = k->start;
+			snprintf(path, sizeof(path), "%s", k->path);
+			snprintf(dest, sizeof(dest), "%s/%s/%llu-%llums.mjpeg", k->root->path, c->camera,
+				k->start, decimate_interval / 1000000);
+		} else {
+			k = NULL;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (!k)
+		return false;
+	if (strcmp(dest, path) == 0)
+		return true;
+
+	unsigned long long begin = traceBegin();
+	if (compactSegment(path, dest, decimate_interval, decimate_rate, &saved) == 1
+			&& retainReplace(c->camera, start, path, dest, "decimate") == -1) {
+		char index[PATH_MAX + NAME_MAX + 40];
+
+		snprintf(index, sizeof(index), "%s.idx", dest);
+		unlink(dest);
+		unlink(index);
+	}
+	traceEnd("decimate", begin, c->camera, 0);
+
+	return true;
+}
+
+/**
+ * \returns true if there may be more to do right away
+ */
+static bool enforce(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_CAMERAS; i++) {
+		struct retained* c = &cameras[i];
+
+		while (c->quota && __atomic_load_n(&c->bytes, __ATOMIC_RELAXED) > c->quota) {
+			pthread_mutex_lock(&lock);
+			struct kept* k = takeOldest(c, NULL);
+			pthread_mutex_unlock(&lock);
+
+			if (!k || delete(c, k) == -1)
+				break;
+		}
+	}
+
+	for (i = 0; min_free && i < root_count; i++) {
+		while (freeSpace(&roots[i]) < min_free) {
+			int r = freeRoot(&roots[i]);
+
+			if (r == 1)
+				break;
+			if (r == -1) {
+				if (!warned)
+					fprintf(stderr, "%s: below %llu MB free and nothing left to delete\n",
+						roots[i].path, min_free >> 20);
+				warned = true;
+				break;
+			}
+		}
+	}
+
+	return decimateOne();
+}
+
+static void* retainThread(void* arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+	traceThreadName("retain");
+
+	pthread_mutex_lock(&lock);
+	while (!stopping) {
+		pthread_mutex_unlock(&lock);
+		bool more = enforce();
+		pthread_mutex_lock(&lock);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += RETAIN_INTERVAL_NS / 1000000000ULL;
+		if (!stopping && !more)
+			pthread_cond_timedwait(&wake, &lock, &ts);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/**
+ * Start enforcing quotas and the free space watermark on roots.
+ *
+ * \returns 0 on success, -1 on error
+ */
+int retainStart(struct root* r, unsigned int count)
+{
+	roots = r;
+	root_count = count;
+
+	int err = pthread_create(&thread, NULL, retainThread, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create error %d, %s\n", err, strerror(err));
+		return -1;
+	}
+
+	running = true;
+	return 0;
+}
+
+void retainStop(void)
+{
+	unsigned int i;
+
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&wake);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+	running = false;
+
+	for (i = 0; i < MAX_CAMERAS; i++) {
+		struct retained* c = &cameras[i];
+
+		while (c->oldest) {
+			struct kept* k = c->oldest;
+			c->oldest = k->next;
+			free(k->path);
+			free(k);
+		}
+		c->newest = &c->oldest;
+	}
+}
@@ -0,0 +1,38 @@
+/**
+ * Retention of recorded segments.
+ *
+ * Every recorded camera has a running total of the bytes it has on disk,
+ * updated as segments are written and deleted, so no directory is ever
+ * scanned while recording. A background thread deletes the oldest segments
+ *
+ *   - of a camera whose total is over its quota (-q), and
+ *   - of a root whose free space is below the watermark (-F, off by
+ *     default), taking the cameras with the lowest priority first.
+ *
+ * The same thread thins out segments older than a given age (-a) to a low
+ * frame rate (-k), see compact.h.
+ *
+ * Deletions are recorded in the catalog before the files are removed.
+ * Segments still in staging are counted but only deleted once migrated.
+ */
+
+#ifndef RETAIN_H
+#define RETAIN_H
+
+#include <stddef.h>
+
+struct root;
+
+int retainPolicy(const char* spec);
+void retainMinFree(unsigned int megabytes);
+void retainDecimate(double hours, double fps, unsigned int megabytesPerSecond);
+void retainCamera(unsigned int device, const char* camera);
+void retainWrote(unsigned int device, unsigned long long bytes);
+void retainSegment(const char* camera, unsigned long long start, const char* path, struct root* root);
+int retainAged(unsigned long long before, const char** camera, unsigned long long* start,
+	char* path, size_t size, struct root** root);
+int retainReplace(const char* camera, unsigned long long start, const char* old, const char* path, const char* op);
+int retainStart(struct root* roots, unsigned int count);
+void retainStop(void);
+
+#endif
@@ -0,0 +1,1046 @@
+/**
+ * HTTP access to the recordings, see serve.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <linux/tls.h>
+#endif
+
+#include "catalog.h"
+#include "loop.h"
+#include "serve.h"
+#include "store.h"
+#include "tail.h"
+#include "trace.h"
+
+#define SERVE_CLIENTS 256
+#define SERVE_REQUEST 4096
+#define SERVE_HEAD 1024
+#define SERVE_EVENTS 64
+/* how often streams waiting for the recorder look for new frames */
+#define SERVE_POLL_MS 20
+/* file data encrypted in userspace goes out this much at a time */
+#define SERVE_CHUNK (64 << 10)
+/* cameras whose catalog view is kept between requests */
+#define SERVE_VIEWS 64
+#define BOUNDARY "mjpeg-grab-frame"
+
+enum stream {
+	STREAM_NONE,
+	STREAM_MULTIPART,
+	STREAM_CONCAT,
+};
+
+struct client {
+	int fd;
+	char request[SERVE_REQUEST];
+	size_t received;
+	bool responding;
+
+	/* response: head, then length bytes of file from offset */
+	char head[SERVE_HEAD];
+	size_t headLength, headSent;
+	int file;                     /* -1 for none */
+	bool ownFile;                 /* else it belongs to the tail */
+	off_t offset;
+	uint64_t remaining;
+
+	/* frames, for frame and streams */
+	struct tail* tail;
+	enum stream stream;
+	unsigned long long to;
+	bool waiting;                 /* for the recorder */
+
+#ifdef HAVE_OPENSSL
+	/* TLS, see serveTls() */
+	SSL* ssl;                     /* NULL for plain HTTP */
+	bool handshaken;
+	bool ktls;                    /* the kernel encrypts, send as if plain */
+	unsigned char* chunk;         /* file data for SSL_write() */
+	size_t chunkLength, chunkSent;
+#endif
+};
+
+static int listener = -1;
+static int epoll = -1;
+static int wake = -1;
+static pthread_t thread;
+static bool running;
+static struct client* clients[SERVE_CLIENTS];
+static unsigned int client_count;
+static struct {
+	char camera[NAME_MAX + 1];
+	struct catalog_view* view;
+} views[SERVE_VIEWS];
+static unsigned int view_count;
+#ifdef HAVE_OPENSSL
+static SSL_CTX* tls;
+#endif
+
+static struct {
+	unsigned long long requests;
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned long long refused;
+	unsigned long long overwritten;
+	unsigned long long tls;
+	unsigned long long ktls;
+	unsigned int peak;
+} stats;
+
+static void clientWatch(struct client* c, unsigned int events)
+{
+	struct epoll_event ev = { .events = events | EPOLLRDHUP, .data.ptr = c };
+
+	epoll_ctl(epoll, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void clientClose(struct client* c)
+{
+	unsigned int i;
+
+	for (i = 0; i < client_count; i++) {
+		if (clients[i] == c) {
+			clients[i] = clients[--client_count];
+			break;
+		}
+	}
+
+	if (c->ownFile && c->file != -1)
+		close(c->file);
+	tailClose(c->tail);
+#ifdef HAVE_OPENSSL
+	if (c->ssl) {
+		if (c->handshaken)
+			SSL_shutdown(c->ssl);
+		SSL_free(c->ssl);
+		ERR_clear_error();
+	}
+	free(c->chunk);
+#endif
+	close(c->fd);
+	free(c);
+}
+
+#ifdef HAVE_OPENSSL
+/**
+ * Turn the outcome of an SSL call into what the socket call would return.
+ */
+static ssize_t tlsResult(struct client* c, int r)
+{
+	if (r > 0)
+		return r;
+
+	switch (SSL_get_error(c->ssl, r)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	default:
+		ERR_clear_error();
+		errno = EIO;
+		return -1;
+	}
+}
+
+/**
+ * Go on with the TLS handshake, then see whether the kernel took over.
+ *
+ * \returns 1 when done, 0 while it goes on, -1 on error
+ */
+static int clientHandshake(struct client* c)
+{
+	int r = SSL_accept(c->ssl);
+
+	if (r != 1) {
+		switch (SSL_get_error(c->ssl, r)) {
+		case SSL_ERROR_WANT_READ:
+			clientWatch(c, EPOLLIN);
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			clientWatch(c, EPOLLOUT);
+			return 0;
+		default:
+			ERR_clear_error();
+			return -1;
+		}
+	}
+
+	c->handshaken = true;
+	c->ktls = BIO_get_ktls_send(SSL_get_wbio(c->ssl));
+	clientWatch(c, EPOLLIN);
+
+	if (!c->ktls) {
+		c->chunk = malloc(SERVE_CHUNK);
+		return c->chunk ? 1 : -1;
+	}
+
+	stats.ktls++;
+#ifdef TLS_TX_ZEROCOPY_RO
+	/* with a NIC doing TLS, sendfile() data is not even copied; the file
+	 * must not change until acknowledged, loop frames may */
+	if (!loopEnabled()) {
+		int one = 1;
+
+		setsockopt(c->fd, SOL_TLS, TLS_TX_ZEROCOPY_RO, &one, sizeof(one));
+	}
+#endif
+	return 1;
+}
+#endif
+
+static ssize_t clientRecv(struct client* c, void* buffer, size_t length)
+{
+#ifdef HAVE_OPENSSL
+	if (c->ssl)
+		return tlsResult(c, SSL_read(c->ssl, buffer, length));
+#endif
+	return recv(c->fd, buffer, length, 0);
+}
+
+/**
+ * Send from memory. With kernel TLS the socket encrypts what it is given.
+ */
+static ssize_t clientWrite(struct client* c, const void* buffer, size_t length, bool more)
+{
+#ifdef HAVE_OPENSSL
+	if (c->ssl && !c->ktls)
+		return tlsResult(c, SSL_write(c->ssl, buffer, length));
+#endif
+	return send(c->fd, buffer, length, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+}
+
+/**
+ * Send from the file, straight from the page cache unless TLS has to be
+ * done in userspace: then it is read in chunks and encrypted by OpenSSL.
+ */
+static ssize_t clientWriteFile(struct client* c)
+{
+	size_t length = c->remaining < (1ULL << 30) ? c->remaining : (1ULL << 30);
+
+#ifdef HAVE_OPENSSL
+	if (c->ssl && !c->ktls) {
+		if (c->chunkSent == c->chunkLength) {
+			ssize_t n = pread(c->file, c->chunk, length < SERVE_CHUNK ? length : SERVE_CHUNK, c->offset);
+
+			if (n <= 0)
+				return n;
+			c->chunkLength = n;
+			c->chunkSent = 0;
+		}
+
+		/* a write that would block is retried with the same data */
+		ssize_t n = tlsResult(c, SSL_write(c->ssl, c->chunk + c->chunkSent, c->chunkLength - c->chunkSent));
+		if (n > 0) {
+			c->chunkSent += n;
+			c->offset += n;
+		}
+		return n;
+	}
+#endif
+	return sendfile(c->fd, c->file, &c->offset, length);
+}
+
+/**
+ * Append to the head of the response.
+ */
+__attribute__((format(printf, 2, 3)))
+static void headAdd(struct client* c, const char* format, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(c->head + c->headLength, sizeof(c->head) - c->headLength, format, ap);
+	va_end(ap);
+
+	if (n > 0)
+		c->headLength += (size_t)n < sizeof(c->head) - c->headLength ? (size_t)n : sizeof(c->head) - c->headLength - 1;
+}
+
+static void respond(struct client* c, const char* status, const char* type, long long length)
+{
+	headAdd(c, "HTTP/1.1 %s\r\nServer: mjpeg-grab\r\nConnection: close\r\nContent-Type: %s\r\n", status, type);
+	if (length >= 0)
+		headAdd(c, "Content-Length: %lld\r\n", length);
+	else
+		headAdd(c, "Cache-Control: no-cache\r\n");
+}
+
+static void respondError(struct client* c, const char* status)
+{
+	c->headLength = 0;
+	respond(c, status, "text/plain", strlen(status) + 1);
+	headAdd(c, "\r\n%s\n", status);
+}
+
+/**
+ * Queue the next frame of a stream, or its end.
+ *
+ * \returns 1 if there is something to send, 0 if the stream waits for the
+ * recorder, -1 on error
+ */
+static int streamNext(struct client* c)
+{
+	struct tail_frame f;
+	int r = tailNext(c->tail, &f, 0);
+
+	c->waiting = r == 0;
+	if (r != 1)
+		return r;
+
+	c->headLength = c->headSent = 0;
+	if (f.timestamp > c->to) {
+		if (c->stream == STREAM_MULTIPART)
+			headAdd(c, "\r\n--" BOUNDARY "--\r\n");
+		tailClose(c->tail);
+		c->tail = NULL;
+		c->stream = STREAM_NONE;
+		return 1;
+	}
+
+	if (c->stream == STREAM_MULTIPART)
+		headAdd(c, "\r\n--" BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n"
+			"X-Timestamp: %llu.%09llu\r\n\r\n", f.length,
+			(unsigned long long)f.timestamp / 1000000000ULL, (unsigned long long)f.timestamp % 1000000000ULL);
+
+	c->file = tailFile(c->tail);
+	c->ownFile = false;
+	c->offset = f.offset;
+	c->remaining = f.length;
+	stats.frames++;
+	return 1;
+}
+
+static int clientRead(struct client* c);
+
+/**
+ * Send what can be sent without blocking.
+ *
+ * \returns 0 to go on, -1 if the client is done or gone
+ */
+static int clientSend(struct client* c)
+{
+#ifdef HAVE_OPENSSL
+	if (c->ssl && !c->handshaken)
+		return clientRead(c);
+#endif
+
+	for (;;) {
+		while (c->headSent < c->headLength) {
+			ssize_t n = clientWrite(c, c->head + c->headSent, c->headLength - c->headSent, c->file != -1);
+
+			if (n == -1 && errno == EAGAIN) {
+				clientWatch(c, EPOLLOUT);
+				return 0;
+			}
+			if (n <= 0)
+				return -1;
+			c->headSent += n;
+			stats.bytes += n;
+		}
+
+		while (c->file != -1 && c->remaining) {
+			ssize_t n = clientWriteFile(c);
+
+			if (n == -1 && errno == EAGAIN) {
+				clientWatch(c, EPOLLOUT);
+				return 0;
+			}
+			/* a segment can be shorter than it was when the request came */
+			if (n <= 0)
+				return -1;
+			c->remaining -= n;
+			stats.bytes += n;
+		}
+
+		/* loop frames can be overwritten while they are sent */
+		if (c->file != -1 && c->tail && !tailIntact(c->tail)) {
+			stats.overwritten++;
+			return -1;
+		}
+
+		if (c->ownFile && c->file != -1)
+			close(c->file);
+		c->file = -1;
+		c->headLength = c->headSent = 0;
+
+		if (c->stream == STREAM_NONE)
+			return -1;
+
+		int r = streamNext(c);
+		if (r == -1)
+			return -1;
+		if (r == 0) {
+			/* only notice the client going away */
+			clientWatch(c, 0);
+			return 0;
+		}
+	}
+}
+
+/**
+ * Seconds since the epoch from a query parameter, in ns.
+ */
+static bool queryTime(const char* query, const char* key, unsigned long long* ns)
+{
+	size_t length = strlen(key);
+	const char* p = query;
+
+	while (p && *p) {
+		if (strncmp(p, key, length) == 0 && p[length] == '=') {
+			*ns = strtod(p + length + 1, NULL) * 1e9;
+			return true;
+		}
+		p = strchr(p, '&');
+		if (p)
+			p++;
+	}
+
+	return false;
+}
+
+static const char* contentType(const char* path)
+{
+	size_t length = strlen(path);
+
+	if (length > 4 && strcmp(path + length - 4, ".mkv") == 0)
+		return "video/x-matroska";
+	if (length > 4 && strcmp(path + length - 4, ".idx") == 0)
+		return "application/octet-stream";
+	return "video/x-motion-jpeg";
+}
+
+/**
+ * Segments of a camera, oldest first. The catalog view of every camera
+ * asked for is kept, a request only reads the records appended since the
+ * last one.
+ *
+ * \param entries receives the segments, valid until the next call
+ * \returns 0 on success, -1 on error
+ */
+static int segments(const char* camera, struct catalog_entry** entries, size_t* count)
+{
+	unsigned int i;
+
+	for (i = 0; i < view_count; i++)
+		if (strcmp(views[i].camera, camera) == 0)
+			return catalogRefresh(views[i].view, entries, count);
+
+	struct catalog_view* v = storeView(camera);
+	if (!v)
+		return -1;
+	if (catalogRefresh(v, entries, count) == -1) {
+		catalogViewClose(v);
+		return -1;
+	}
+
+	/* no view for names nothing was recorded under */
+	if (!*count) {
+		catalogViewClose(v);
+		return 0;
+	}
+
+	if (view_count == SERVE_VIEWS)
+		catalogViewClose(views[--view_count].view);
+	snprintf(views[view_count].camera, sizeof(views[view_count].camera), "%s", camera);
+	views[view_count++].view = v;
+	return 0;
+}
+
+/**
+ * List the segments of a camera, into a memory file sent like any other.
+ * Sizes are looked up once a segment has a successor, only the newest one
+ * can still grow.
+ */
+static void requestList(struct client* c, const char* camera)
+{
+	struct catalog_entry* e;
+	size_t n, i;
+
+	if (segments(camera, &e, &n) == -1) {
+		respondError(c, "404 Not Found");
+		return;
+	}
+
+	c->file = memfd_create("list", MFD_CLOEXEC);
+	if (c->file == -1) {
+		respondError(c, "500 Internal Server Error");
+		return;
+	}
+	c->ownFile = true;
+
+	FILE* fp = fdopen(dup(c->file), "w");
+	for (i = 0; fp && i < n; i++) {
+		const char* name = strrchr(e[i].path, '/');
+		long long bytes = e[i].bytes;
+
+		if (bytes == -1) {
+			struct stat st;
+
+			bytes = stat(e[i].path, &st) == 0 ? (long long)st.st_size : -1LL;
+			if (i + 1 < n)
+				e[i].bytes = bytes;
+		}
+		fprintf(fp, "%llu %lld %s\n", e[i].start, bytes, name ? name + 1 : e[i].path);
+	}
+	if (fp)
+		fclose(fp);
+
+	c->offset = 0;
+	c->remaining = lseek(c->file, 0, SEEK_END);
+	respond(c, "200 OK", "text/plain", c->remaining);
+	headAdd(c, "\r\n");
+}
+
+/**
+ * Parse the value of a Range header: a single bytes=a-b, a- or -n, up to
+ * the end of the header line. Anything else, several ranges included, is
+ * to be answered with the whole file.
+ *
+ * \param first set to the first byte, or for -n to size - n
+ * \param last set to the last byte, ULLONG_MAX if open ended
+ * \returns true if the value is a single range
+ */
+static bool parseRange(const char* range, unsigned long long size, unsigned long long* first, unsigned long long* last)
+{
+	const char* p = range + 6;
+	unsigned long long a, b = ULLONG_MAX;
+	char* end;
+
+	if (strncmp(range, "bytes=", 6) != 0)
+		return false;
+
+	if (*p == '-') {
+		if (!isdigit((unsigned char)p[1]))
+			return false;
+		a = strtoull(p + 1, &end, 10);
+		a = a < size ? size - a : 0;
+	} else {
+		if (!isdigit((unsigned char)*p))
+			return false;
+		a = strtoull(p, &end, 10);
+		if (*end++ != '-')
+			return false;
+		if (isdigit((unsigned char)*end))
+			b = strtoull(end, &end, 10);
+	}
+
+	while (*end == ' ' || *end == '\t')
+		end++;
+	if (*end != '\r' && *end != '\0')
+		return false;
+
+	*first = a;
+	*last = b;
+	return true;
+}
+
+/**
+ * A segment file or its index, whole or the byte range asked for.
+ */
+static void requestSegment(struct client* c, const char* camera, const char* name, const char* range)
+{
+	struct catalog_entry* e;
+	size_t n, i;
+	char* end;
+	unsigned long long start = strtoull(name, &end, 10);
+	bool index = strcmp(end, ".idx") == 0;
+	char path[PATH_MAX + 8];
+	struct stat st;
+
+	if (end == name || (*end && !index) || segments(camera, &e, &n) == -1) {
+		respondError(c, "404 Not Found");
+		return;
+	}
+
+	i = catalogAfter(e, n, start);
+	if (!i || e[i - 1].start != start) {
+		respondError(c, "404 Not Found");
+		return;
+	}
+	snprintf(path, sizeof(path), "%s%s", e[i - 1].path, index ? ".idx" : "");
+
+	c->file = open(path, O_RDONLY | O_CLOEXEC);
+	if (c->file == -1) {
+		respondError(c, "404 Not Found");
+		return;
+	}
+	c->ownFile = true;
+	if (fstat(c->file, &st) == -1) {
+		close(c->file);
+		c->file = -1;
+		c->ownFile = false;
+		respondError(c, "500 Internal Server Error");
+		return;
+	}
+
+	unsigned long long size = st.st_size, first = 0, last = size ? size - 1 : 0;
+	bool partial = false;
+
+	if (range && parseRange(range, size, &first, &last)) {
+		if (last >= size)
+			last = size ? size - 1 : 0;
+
+		if (first >= size || first > last) {
+			close(c->file);
+			c->file = -1;
+			c->ownFile = false;
+			respond(c, "416 Range Not Satisfiable", "text/plain", 0);
+			headAdd(c, "Content-Range: bytes */%llu\r\n\r\n", size);
+			return;
+		}
+		partial = true;
+	}
+
+	c->offset = first;
+	c->remaining = size ? last - first + 1 : 0;
+	respond(c, partial ? "206 Partial Content" : "200 OK", contentType(path), c->remaining);
+	headAdd(c, "Accept-Ranges: bytes\r\n");
+	if (partial)
+		headAdd(c, "Content-Range: bytes %llu-%llu/%llu\r\n", first, last, size);
+	headAdd(c, "\r\n");
+}
+
+/**
+ * One frame, or a stream of them.
+ */
+static void requestFrames(struct client* c, const char* camera, const char* query, enum stream stream)
+{
+	unsigned long long from = TAIL_END;
+
+	c->to = ULLONG_MAX;
+	if (stream == STREAM_NONE && !queryTime(query, "t", &from)) {
+		respondError(c, "400 Bad Request");
+		return;
+	}
+	queryTime(query, "from", &from);
+	queryTime(query, "to", &c->to);
+
+	c->tail = storeTail(camera, from);
+	if (!c->tail) {
+		respondError(c, "404 Not Found");
+		return;
+	}
+
+	if (stream == STREAM_NONE) {
+		struct tail_frame f;
+
+		if (tailNext(c->tail, &f, 0) != 1) {
+			respondError(c, "404 Not Found");
+			return;
+		}
+
+		c->file = tailFile(c->tail);
+		c->offset = f.offset;
+		c->remaining = f.length;
+		stats.frames++;
+		respond(c, "200 OK", "image/jpeg", f.length);
+		headAdd(c, "X-Timestamp: %llu.%09llu\r\n\r\n",
+			(unsigned long long)f.timestamp / 1000000000ULL, (unsigned long long)f.timestamp % 1000000000ULL);
+		return;
+	}
+
+	c->stream = stream;
+	respond(c, "200 OK", stream == STREAM_MULTIPART ? "multipart/x-mixed-replace;boundary=" BOUNDARY
+		: "video/x-motion-jpeg", -1);
+	headAdd(c, "\r\n");
+}
+
+/**
+ * Answer a complete request.
+ */
+static void clientRequest(struct client* c)
+{
+	char method[8], target[1024];
+	char* range = strcasestr(c->request, "\r\nRange:");
+
+	stats.requests++;
+	c->responding = true;
+	c->file = -1;
+
+	if (sscanf(c->request, "%7s %1023s HTTP/1.%*c", method, target) != 2 || target[0] != '/') {
+		respondError(c, "400 Bad Request");
+		return;
+	}
+
+	bool head = strcmp(method, "HEAD") == 0;
+	if (!head && strcmp(method, "GET") != 0) {
+		respondError(c, "405 Method Not Allowed");
+		return;
+	}
+
+	if (range) {
+		range += strlen("\r\nRange:");
+		while (*range == ' ')
+			range++;
+	}
+
+	char* query = strchr(target, '?');
+	if (query)
+		*query++ = '\0';
+	else
+		query = "";
+
+	char* camera = target + 1;
+	char* what = strchr(camera, '/');
+	if (!what || what == camera) {
+		respondError(c, "404 Not Found");
+		return;
+	}
+	*what++ = '\0';
+
+	if (!*what)
+		requestList(c, camera);
+	else if (strcmp(what, "frame") == 0)
+		requestFrames(c, camera, query, STREAM_NONE);
+	else if (strcmp(what, "view") == 0)
+		requestFrames(c, camera, query, STREAM_MULTIPART);
+	else if (strcmp(what, "mjpeg") == 0)
+		requestFrames(c, camera, query, STREAM_CONCAT);
+	else
+		requestSegment(c, camera, what, range);
+
+	if (head) {
+		if (c->ownFile && c->file != -1)
+			close(c->file);
+		c->file = -1;
+		c->stream = STREAM_NONE;
+	}
+}
+
+/**
+ * Take in what a client sent, and answer once the request is complete.
+ *
+ * \returns 0 to go on, -1 if the client is done or gone
+ */
+static int clientRead(struct client* c)
+{
+	char discard[256];
+
+	/* the request is all there is to read, later data means nothing */
+	if (c->responding) {
+		ssize_t n = recv(c->fd, discard, sizeof(discard), 0);
+
+		return n == 0 || (n == -1 && errno != EAGAIN) ? -1 : 0;
+	}
+
+#ifdef HAVE_OPENSSL
+	if (c->ssl && !c->handshaken) {
+		int r = clientHandshake(c);
+
+		if (r != 1)
+			return r;
+	}
+#endif
+
+	/* OpenSSL may hold more than the socket says, read until it is dry */
+	for (;;) {
+		ssize_t n = clientRecv(c, c->request + c->received, sizeof(c->request) - 1 - c->received);
+		if (n == -1 && errno == EAGAIN)
+			return 0;
+		if (n <= 0)
+			return -1;
+
+		c->received += n;
+		c->request[c->received] = '\0';
+
+		if (strstr(c->request, "\r\n\r\n")) {
+			clientRequest(c);
+			break;
+		}
+		if (c->received == sizeof(c->request) - 1) {
+			c->responding = true;
+			c->file = -1;
+			respondError(c, "431 Request Header Fields Too Large");
+			break;
+		}
+	}
+
+	return clientSend(c);
+}
+
+static void clientAccept(void)
+{
+	for (;;) {
+		int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd == -1)
+			return;
+
+		if (client_count == SERVE_CLIENTS) {
+			static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+
+#ifdef HAVE_OPENSSL
+			if (!tls)
+#endif
+				send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+			close(fd);
+			stats.refused++;
+			continue;
+		}
+
+		struct client* c = calloc(1, sizeof(*c));
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+
+		if (!c || (c->fd = fd, c->file = -1, epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev) == -1)) {
+			free(c);
+			close(fd);
+			continue;
+		}
+
+#ifdef HAVE_OPENSSL
+		if (tls) {
+			c->ssl = SSL_new(tls);
+			if (!c->ssl || SSL_set_fd(c->ssl, fd) != 1) {
+				ERR_clear_error();
+				SSL_free(c->ssl);
+				epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
+				free(c);
+				close(fd);
+				continue;
+			}
+			SSL_set_accept_state(c->ssl);
+			stats.tls++;
+		}
+#endif
+
+		clients[client_count++] = c;
+		if (client_count > stats.peak)
+			stats.peak = client_count;
+	}
+}
+
+static void* serveThread(void* arg)
+{
+	struct epoll_event events[SERVE_EVENTS];
+	sigset_t pipe;
+	(void)arg;
+
+	/* a client hanging up during sendfile() is an error, not a signal */
+	sigemptyset(&pipe);
+	sigaddset(&pipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe, NULL);
+	traceThreadName("serve");
+
+	for (;;) {
+		bool waiting = false;
+		unsigned int i;
+
+		for (i = 0; i < client_count && !waiting; i++)
+			waiting = clients[i]->waiting;
+
+		int n = epoll_wait(epoll, events, SERVE_EVENTS, waiting ? SERVE_POLL_MS : -1);
+		if (n == -1 && errno != EINTR) {
+			fprintf(stderr, "epoll_wait error %d, %s\n", errno, strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < (unsigned int)(n > 0 ? n : 0); i++) {
+			struct client* c = events[i].data.ptr;
+
+			if (events[i].data.ptr == &listener) {
+				clientAccept();
+				continue;
+			}
+			if (events[i].data.ptr == &wake)
+				return NULL;
+
+			if (events[i].events & (EPOLLERR | EPOLLHUP)
+					|| ((events[i].events & (EPOLLIN | EPOLLRDHUP)) && clientRead(c) == -1)
+					|| ((events[i].events & EPOLLOUT) && clientSend(c) == -1))
+				clientClose(c);
+		}
+
+		/* streams that caught up with the recorder, from the last one back */
+		for (i = client_count; i-- > 0; ) {
+			struct client* c = clients[i];
+
+			if (!c->waiting)
+				continue;
+
+			int r = streamNext(c);
+			if (r == -1 || (r == 1 && clientSend(c) == -1))
+				clientClose(c);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Listen on address and serve the recordings from a thread of their own.
+ *
+ * \param address [host:]port, host may be a name or an address in brackets
+ * \returns 0 on success, -1 on error
+ */
+int serveStart(const char* address)
+{
+	char host[256] = "";
+	const char* port = strrchr(address, ':');
+	struct addrinfo hints, *ai;
+	int one = 1;
+
+	if (port) {
+		snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+		port++;
+		if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+			memmove(host, host + 1, strlen(host));
+			host[strlen(host) - 1] = '\0';
+		}
+	} else {
+		port = address;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	int err = getaddrinfo(host[0] ? host : NULL, port, &hints, &ai);
+	if (err) {
+		fprintf(stderr, "Cannot resolve '%s': %s\n", address, gai_strerror(err));
+		return -1;
+	}
+
+	listener = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+	if (listener == -1 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1
+			|| bind(listener, ai->ai_addr, ai->ai_addrlen) == -1 || listen(listener, SOMAXCONN) == -1) {
+		fprintf(stderr, "Cannot listen on '%s': %d, %s\n", address, errno, strerror(errno));
+		freeaddrinfo(ai);
+		serveStop();
+		return -1;
+	}
+	freeaddrinfo(ai);
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listener };
+	struct epoll_event stop = { .events = EPOLLIN, .data.ptr = &wake };
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (epoll == -1 || wake == -1 || epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &ev) == -1
+			|| epoll_ctl(epoll, EPOLL_CTL_ADD, wake, &stop) == -1) {
+		fprintf(stderr, "epoll error %d, %s\n", errno, strerror(errno));
+		serveStop();
+		return -1;
+	}
+
+	err = pthread_create(&thread, NULL, serveThread, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create error %d, %s\n", err, strerror(err));
+		serveStop();
+		return -1;
+	}
+
+	running = true;
+	return 0;
+}
+
+/**
+ * Serve over TLS, with the certificate chain and key from PEM files. The
+ * handshake is done by OpenSSL, which then hands encryption over to the
+ * kernel (kTLS) where it can, so file data still goes out with sendfile().
+ * Elsewhere it is encrypted in userspace.
+ *
+ * \param spec cert.pem[:key.pem], the key defaults to the certificate file
+ * \returns 0 on success, -1 on error or without OpenSSL
+ */
+int serveTls(const char* spec)
+{
+#ifdef HAVE_OPENSSL
+	char cert[PATH_MAX];
+	const char* key = strchr(spec, ':');
+
+	snprintf(cert, sizeof(cert), "%.*s", key ? (int)(key - spec) : (int)strlen(spec), spec);
+	key = key ? key + 1 : cert;
+
+	tls = SSL_CTX_new(TLS_server_method());
+	if (!tls || SSL_CTX_set_min_proto_version(tls, TLS1_2_VERSION) != 1
+			|| SSL_CTX_use_certificate_chain_file(tls, cert) != 1
+			|| SSL_CTX_use_PrivateKey_file(tls, key, SSL_FILETYPE_PEM) != 1
+			|| SSL_CTX_check_private_key(tls) != 1) {
+		fprintf(stderr, "Cannot set up TLS with '%s'\n", spec);
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(tls);
+		tls = NULL;
+		return -1;
+	}
+
+	SSL_CTX_set_options(tls, SSL_OP_ENABLE_KTLS);
+	SSL_CTX_set_mode(tls, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	/* every response closes the connection, there is nothing to resume */
+	SSL_CTX_set_num_tickets(tls, 0);
+	return 0;
+#else
+	(void)spec;
+	fprintf(stderr, "TLS needs OpenSSL, rebuild with it installed\n");
+	return -1;
+#endif
+}
+
+/**
+ * Stop serving, dropping the clients.
+ */
+void serveStop(void)
+{
+	if (running) {
+		uint64_t one = 1;
+
+		if (write(wake, &one, sizeof(one)) != sizeof(one))
+			fprintf(stderr, "Cannot stop serving: %d, %s\n", errno, strerror(errno));
+		pthread_join(thread, NULL);
+		running = false;
+	}
+
+	while (client_count)
+		clientClose(clients[0]);
+	while (view_count)
+		catalogViewClose(views[--view_count].view);
+
+	if (listener != -1)
+		close(listener);
+	if (epoll != -1)
+		close(epoll);
+	if (wake != -1)
+		close(wake);
+	listener = epoll = wake = -1;
+}
+
+void serveReport(FILE* fp)
+{
+	fprintf(fp, "http: %llu requests, %llu frames, %.1f MB sent, at most %u clients",
+		stats.requests, stats.frames, stats.bytes / 1e6, stats.peak);
+	if (stats.refused)
+		fprintf(fp, ", %llu refused", stats.refused);
+	if (stats.overwritten)
+		fprintf(fp, ", %llu frames overwritten while sent", stats.overwritten);
+	if (stats.tls)
+		fprintf(fp, ", %llu over TLS, %llu of them with kernel TLS", stats.tls, stats.ktls);
+	fprintf(fp, "\n");
+}
@@ -0,0 +1,39 @@
+/**
+ * Read only HTTP access to the recordings.
+ *
+ * With -H the recordings (segments or loop) are served over HTTP/1.1:
+ *
+ *   GET /<camera>/                  segments, one "<start ns> <bytes> <file>" per line
+ *   GET /<camera>/frame?t=T         the first frame at or after T, image/jpeg
+ *   GET /<camera>/view?from=T&to=T  frames as multipart/x-mixed-replace
+ *   GET /<camera>/mjpeg?from=T&to=T frames concatenated, as -x writes them
+ *   GET /<camera>/<start>           a segment file, with Range requests
+ *   GET /<camera>/<start>.idx       its index, with Range requests
+ *
+ * Times are seconds since the epoch. Without to, streams go on with the
+ * frames as they are recorded; without from they start with the next one.
+ * Frames are found with the index (see tail.h) and sent with sendfile()
+ * straight from the segment or loop, headers and data in one go thanks
+ * to MSG_MORE. One thread serves every client from an epoll loop; streams
+ * waiting for frames to be recorded look for new ones every few
+ * milliseconds. Paths are never taken from the request, segments are
+ * looked up in the catalog by camera and start time.
+ *
+ * With TLS (-E) OpenSSL does the handshake and then hands the connection
+ * to kernel TLS, so the kernel encrypts what sendfile() sends and frames
+ * are still not copied through userspace. Where the kernel cannot (no tls
+ * module, an unsupported cipher) OpenSSL encrypts instead, reading file
+ * data in chunks.
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdio.h>
+
+int serveTls(const char* spec);
+int serveStart(const char* address);
+void serveStop(void);
+void serveReport(FILE* fp);
+
+#endif
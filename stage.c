@@ -0,0 +1,451 @@
+/**
+ * Staging and background migration, see stage.h.
+ *
+ * Segments are copied with copy_file_range(), falling back to sendfile()
+ * where the kernel refuses to copy between the two filesystems. Both keep
+ * the data out of user space. The copy goes to a temporary name and is
+ * renamed into place after fsync(), so a durable path in the catalog always
+ * refers to a complete segment.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "catalog.h"
+#include "clock.h"
+#include "retain.h"
+#include "stage.h"
+#include "store.h"
+#include "trace.h"
+
+#define STAGE_CHUNK (1 << 20)
+#define STAGE_RETRIES 5
+#define STAGE_BACKOFF_NS 1000000000ULL
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+struct staged {
+	struct staged* next;
+	char camera[NAME_MAX + 1];
+	unsigned long long start;
+	char path[PATH_MAX + NAME_MAX + 32];
+	unsigned long long size;      /* staged bytes of data and index, known once migration started */
+	unsigned int attempts;
+	unsigned long long retryAt;   /* realtimeNs() of the next attempt */
+};
+
+static char staging[PATH_MAX];
+static unsigned long long limit = 256ULL << 20;
+static unsigned long long rate = 8ULL << 20;
+static unsigned long long staged;
+static unsigned int pending;
+static bool stopping;
+static bool running;
+static struct staged* head;
+static struct staged** tail = &head;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Use a staging directory for new segments.
+ *
+ * \returns 0 on success, -1 if the directory is not usable
+ */
+int stageSet(const char* dir)
+{
+	if (!realpath(dir, staging)) {
+		fprintf(stderr, "Cannot use staging directory '%s': %d, %s\n", dir, errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * \param megabytes staged data at which the staging writer waits
+ * \param megabytesPerSecond migration rate limit
+ */
+void stageLimits(unsigned int megabytes, unsigned int megabytesPerSecond)
+{
+	if (megabytes)
+		limit = (unsigned long long)megabytes << 20;
+	if (megabytesPerSecond)
+		rate = (unsigned long long)megabytesPerSecond << 20;
+}
+
+bool stageEnabled(void)
+{
+	return staging[0] != '\0';
+}
+
+const char* stageDir(void)
+{
+	return staging;
+}
+
+/**
+ * Queue a finished staged segment for migration.
+ */
+void stageQueue(const char* camera, unsigned long long start, const char* path)
+{
+	struct staged* s = calloc(1, sizeof(*s));
+
+	/* left in staging, picked up again on the next start */
+	if (!s)
+		return;
+
+	snprintf(s->camera, sizeof(s->camera), "%s", camera);
+	snprintf(s->path, sizeof(s->path), "%s", path);
+	s->start = start;
+
+	pthread_mutex_lock(&lock);
+	*tail = s;
+	tail = &s->next;
+	pending++;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+}
+
+void stageWrote(unsigned long long bytes)
+{
+	pthread_mutex_lock(&lock);
+	staged += bytes;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Block the staging writer while staging is full. Only waits while there is
+ * something to migrate, segments still being written cannot be freed.
+ */
+void stageWait(void)
+{
+	pthread_mutex_lock(&lock);
+	while (staged >= limit && pending && !stopping)
+		pthread_cond_wait(&changed, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Copy a file to another filesystem without going through user space,
+ * keeping to the migration rate unless we are shutting down.
+ */
+static int copyFile(const char* from, const char* to, unsigned long long* copied)
+{
+	struct stat st;
+	bool fallback = false;
+	off_t done = 0;
+	int r = -1;
+
+	int in = open(from, O_RDONLY | O_CLOEXEC);
+	int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (in == -1 || out == -1 || fstat(in, &st) == -1)
+		goto out;
+
+	unsigned long long start = nowNs();
+	while (done < st.st_size) {
+		size_t chunk = st.st_size - done < STAGE_CHUNK ? st.st_size - done : STAGE_CHUNK;
+		ssize_t n = -1;
+
+		if (!fallback) {
+			n = copy_file_range(in, &done, out, NULL, chunk, 0);
+			if (n == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+				fallback = true;
+		}
+		if (fallback)
+			n = sendfile(out, in, &done, chunk);
+
+		if (n <= 0)
+			goto out;
+
+		if (!__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+			pace(start, done, rate);
+	}
+
+	if (fsync(out) == -1)
+		goto out;
+
+	*copied += done;
+	r = 0;
+
+out:
+	if (r == -1)
+		fprintf(stderr, "Cannot migrate '%s' to '%s': %d, %s\n", from, to, errno, strerror(errno));
+	if (in != -1)
+		close(in);
+	if (out != -1 && close(out) == -1)
+		r = -1;
+	return r;
+}
+
+/**
+ * Bytes a staged segment takes, data and index.
+ */
+static unsigned long long stagedBytes(const char* path)
+{
+	char index[PATH_MAX + NAME_MAX + 40];
+	struct stat st;
+	unsigned long long bytes = 0;
+
+	snprintf(index, sizeof(index), "%s.idx", path);
+	if (stat(path, &st) == 0)
+		bytes += st.st_size;
+	if (stat(index, &st) == 0)
+		bytes += st.st_size;
+	return bytes;
+}
+
+/**
+ * Account for staged bytes that were migrated or given up on.
+ */
+static void unstage(unsigned long long bytes)
+{
+	pthread_mutex_lock(&lock);
+	staged -= bytes < staged ? bytes : staged;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Move one segment and its index to a durable root. On failure whatever
+ * was written to the root is removed again, the staged copy stays.
+ */
+static int migrate(struct staged* s)
+{
+	char dir[PATH_MAX + NAME_MAX + 2];
+	char dest[PATH_MAX + NAME_MAX + 32];
+	char from[sizeof(s->path) + 8], idx[sizeof(dest) + 16], tmp[sizeof(dest) + 16], final[sizeof(dest) + 8];
+	struct stat st;
+	unsigned long long copied = 0;
+	bool placed = false;
+
+	if (stat(s->path, &st) == -1) {
+		fprintf(stderr, "Cannot migrate '%s': %d, %s\n", s->path, errno, strerror(errno));
+		return -1;
+	}
+	s->size = stagedBytes(s->path);
+
+	struct root* root = storeChooseRoot();
+	snprintf(dir, sizeof(dir), "%s/%s", root->path, s->camera);
+	if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+		fprintf(stderr, "Cannot create '%s': %d, %s\n", dir, errno, strerror(errno));
+		return -1;
+	}
+	snprintf(dest, sizeof(dest), "%s/%llu.mjpeg", dir, s->start);
+
+	/* index first, it is renamed last so the data is always in place */
+	snprintf(from, sizeof(from), "%s.idx", s->path);
+	snprintf(idx, sizeof(idx), "%s.idx.part", dest);
+	snprintf(tmp, sizeof(tmp), "%s.part", dest);
+	snprintf(final, sizeof(final), "%s.idx", dest);
+	if (copyFile(from, idx, &copied) == -1 || copyFile(s->path, tmp, &copied) == -1)
+		goto fail;
+
+	/* from here on dest is ours, an earlier run may have left a complete copy there */
+	if (rename(tmp, dest) == -1)
+		goto fail;
+	placed = true;
+	if (rename(idx, final) == -1)
+		goto fail;
+
+	if (catalogAppend("move", s->camera, s->start, dest) == -1)
+		goto fail;
+	retainSegment(s->camera, s->start, dest, root);
+
+	unlink(from);
+	unlink(s->path);
+	unstage(s->size);
+
+	return 0;
+
+fail:
+	unlink(idx);
+	unlink(tmp);
+	if (placed) {
+		unlink(final);
+		unlink(dest);
+	}
+	return -1;
+}
+
+/**
+ * First queued segment due for migration, segments that failed wait for
+ * their retry unless we are stopping.
+ *
+ * \param due set to the earliest retry, 0 if nothing is queued
+ * \returns the link to the segment, NULL if none is due
+ */
+static struct staged** nextDue(unsigned long long* due)
+{
+	unsigned long long now = realtimeNs();
+	struct staged** link;
+
+	*due = 0;
+	for (link = &head; *link; link = &(*link)->next) {
+		if (stopping || (*link)->retryAt <= now)
+			return link;
+		if (!*due || (*link)->retryAt < *due)
+			*due = (*link)->retryAt;
+	}
+
+	return NULL;
+}
+
+static void* migrateThread(void* arg)
+{
+	(void)arg;
+
+	/* stay out of the way of capture, both on the CPU and on the disk */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+	traceThreadName("migrate");
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		unsigned long long due;
+		struct staged** link = nextDue(&due);
+
+		if (!link && stopping)
+			break;
+		if (!link) {
+			struct timespec ts = { due / 1000000000ULL, due % 1000000000ULL };
+
+			if (due)
+				pthread_cond_timedwait(&changed, &lock, &ts);
+			else
+				pthread_cond_wait(&changed, &lock);
+			continue;
+		}
+
+		struct staged* s = *link;
+		*link = s->next;
+		if (tail == &s->next)
+			tail = link;
+		s->next = NULL;
+		pthread_mutex_unlock(&lock);
+
+		unsigned long long start = traceBegin();
+		int r = migrate(s);
+		traceEnd("migrate", start, s->camera, 0);
+
+		if (r == -1 && s->attempts < STAGE_RETRIES && !__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+			/* back off, the durable root may be full or briefly gone */
+			s->retryAt = realtimeNs() + (STAGE_BACKOFF_NS << s->attempts);
+			fprintf(stderr, "%s: migration failed, retrying in %llu s\n", s->path, 1ULL << s->attempts);
+			s->attempts++;
+
+			pthread_mutex_lock(&lock);
+			*tail = s;
+			tail = &s->next;
+			continue;
+		}
+
+		if (r == -1) {
+			/* picked up again on the next start, until then it does not hold up the writer */
+			fprintf(stderr, "%s: segment stays in staging\n", s->path);
+			unstage(s->size);
+		}
+		free(s);
+
+		pthread_mutex_lock(&lock);
+		pending--;
+		pthread_cond_broadcast(&changed);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/**
+ * Queue segments a previous run left behind, they are complete up to the
+ * point where that run ended.
+ */
+static void recover(void)
+{
+	DIR* top = opendir(staging);
+	struct dirent* cam;
+
+	if (!top)
+		return;
+
+	while ((cam = readdir(top))) {
+		char dir[PATH_MAX + NAME_MAX + 2];
+		struct dirent* seg;
+
+		if (cam->d_name[0] == '.')
+			continue;
+
+		snprintf(dir, sizeof(dir), "%s/%s", staging, cam->d_name);
+		DIR* d = opendir(dir);
+		if (!d)
+			continue;
+
+		while ((seg = readdir(d))) {
+			char path[sizeof(dir) + NAME_MAX + 2];
+			char* end;
+			unsigned long long start = strtoull(seg->d_name, &end, 10);
+
+			if (end == seg->d_name || strcmp(end, ".mjpeg") != 0)
+				continue;
+
+			/* staged by that run, freed when migrated like any other */
+			snprintf(path, sizeof(path), "%s/%s", dir, seg->d_name);
+			stageWrote(stagedBytes(path));
+			stageQueue(cam->d_name, start, path);
+		}
+
+		closedir(d);
+	}
+
+	closedir(top);
+}
+
+/**
+ * Start the migration thread.
+ *
+ * \returns 0 on success, -1 on error
+ */
+int stageStart(void)
+{
+	recover();
+
+	int err = pthread_create(&thread, NULL, migrateThread, NULL);
+	if (err) {
+		fprintf(stderr, "pthread_create error %d, %s\n", err, strerror(err));
+		return -1;
+	}
+
+	running = true;
+	return 0;
+}
+
+/**
+ * Migrate everything still staged, without rate limit, and stop.
+ */
+void stageStop(void)
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	__atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+	running = false;
+}
@@ -0,0 +1,34 @@
+/**
+ * RAM staging tier.
+ *
+ * With a staging directory (normally on tmpfs) new segments are written
+ * there at memory speed. Finished segments are moved to a durable root by a
+ * low priority background thread at a limited rate, so bursts never hit the
+ * slow disk at full speed. The catalog is updated once a segment's durable
+ * copy is complete, before the staged copy is removed.
+ *
+ * A failed migration leaves nothing behind on the root and is retried with
+ * a doubling backoff. After a few attempts the segment is left in staging
+ * for the next start, and no longer counts against the bound below.
+ *
+ * Staged bytes are bounded. Over the bound the staging writer waits for the
+ * migration to catch up, which in turn makes the writer queue drop frames
+ * rather than let memory grow.
+ */
+
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <stdbool.h>
+
+int stageSet(const char* dir);
+void stageLimits(unsigned int megabytes, unsigned int megabytesPerSecond);
+bool stageEnabled(void);
+const char* stageDir(void);
+int stageStart(void);
+void stageWait(void);
+void stageWrote(unsigned long long bytes);
+void stageQueue(const char* camera, unsigned long long start, const char* path);
+void stageStop(void);
+
+#endif
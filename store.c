@@ -0,0 +1,787 @@
+/**
+ * Segmented recording on one or more roots, see store.h.
+ *
+ * Segments are created by the capture threads, which only decide where a
+ * segment goes. Opening, writing and closing the files is done by the writer
+ * thread of the segment's filesystem, in the order the frames were queued.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+
+#include "archive.h"
+#include "catalog.h"
+#include "filter.h"
+#include "flight.h"
+#include "loop.h"
+#include "retain.h"
+#include "stage.h"
+#include "store.h"
+#include "tail.h"
+#include "writer.h"
+
+#define MAX_ROOTS 8
+#define MAX_CAMERAS 64
+#define STORE_RESERVE (256ULL << 20)
+#define STORE_IOV 64
+#define STORE_EXTRACT_BATCH 64
+/* device index of a camera's shrunk copy is its own plus this */
+#define STORE_SCALED (MAX_CAMERAS / 2)
+
+static struct root roots[MAX_ROOTS];
+static unsigned int root_count;
+static struct root staging_root = { .staging = true };
+static unsigned long long segment_ns = 60ULL * 1000000000ULL;
+static struct segment* current[MAX_CAMERAS];
+static const char* cameras[MAX_CAMERAS];
+static char scaled_names[STORE_SCALED][NAME_MAX + 1];
+
+/**
+ * Add an output root. Segments are spread over all roots, the catalog lives
+ * in the first one.
+ *
+ * \returns 0 on success, -1 if the directory is not usable
+ */
+int storeAddRoot(const char* path)
+{
+	if (root_count == MAX_ROOTS) {
+		fprintf(stderr, "At most %d output roots are supported\n", MAX_ROOTS);
+		return -1;
+	}
+
+	/* the catalog stores absolute paths */
+	if (!realpath(path, roots[root_count].path)) {
+		fprintf(stderr, "Cannot use root '%s': %d, %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+
+	root_count++;
+	return 0;
+}
+
+void storeSegmentLength(unsigned int seconds)
+{
+	segment_ns = seconds * 1000000000ULL;
+}
+
+bool storeSegmented(void)
+{
+	return root_count > 0;
+}
+
+/**
+ * Start the writers of all roots and open the catalog.
+ *
+ * \returns 0 on success, -1 on error
+ */
+int storeOpen(bool perf)
+{
+	unsigned int i;
+
+	for (i = 0; i < root_count; i++) {
+		roots[i].writer = writerGet(roots[i].path, perf);
+		if (!roots[i].writer)
+			return -1;
+	}
+
+	if (root_count && catalogOpen(roots[0].path) == -1)
+		return -1;
+
+	if (stageEnabled()) {
+		if (!root_count) {
+			fprintf(stderr, "Staging needs an output root (-R) to move segments to\n");
+			return -1;
+		}
+
+		snprintf(staging_root.path, sizeof(staging_root.path), "%s", stageDir());
+		staging_root.writer = writerGet(staging_root.path, perf);
+		if (!staging_root.writer || stageStart() == -1)
+			return -1;
+	}
+
+	if (loopEnabled()) {
+		if (root_count || stageEnabled()) {
+			fprintf(stderr, "A loop recording (-L) cannot be combined with output roots or staging\n");
+			return -1;
+		}
+		if (loopOpen() == -1)
+			return -1;
+	}
+
+	if (filterScaling() && !root_count) {
+		fprintf(stderr, "A shrunk second stream needs an output root (-R)\n");
+		return -1;
+	}
+
+	if (root_count && retainStart(roots, root_count) == -1)
+		return -1;
+
+	if (archiveEnabled() && (!root_count || archiveStart() == -1))
+		return -1;
+
+	return 0;
+}
+
+static struct segment* segmentNew(struct root* root, struct writer* writer,
+	unsigned int device, unsigned long long start)
+{
+	struct segment* s = calloc(1, sizeof(*s));
+
+	/* preallocated so finishing a segment can never fail */
+	struct frame* closer = frameAlloc(0);
+
+	if (!s || !closer) {
+		free(s);
+		frameFree(closer);
+		return NULL;
+	}
+
+	s->root = root;
+	s->writer = writer;
+	s->camera = cameras[device];
+	s->device = device;
+	s->start = start;
+	s->fd = -1;
+	s->index = -1;
+	s->closer = closer;
+
+	if (root) {
+		snprintf(s->path, sizeof(s->path), "%s/%s/%llu.mjpeg", root->path, s->camera, start);
+		__atomic_add_fetch(&root->open, 1, __ATOMIC_RELAXED);
+	}
+
+	return s;
+}
+
+/**
+ * Queue the end of a segment behind its last frame.
+ */
+static void segmentFinish(struct segment* s)
+{
+	struct frame* f = s->closer;
+
+	f->segment = s;
+	f->device = s->device;
+	f->sequence = 0;
+	f->flags = FRAME_CLOSE;
+	writerSubmit(s->writer, f);
+}
+
+/**
+ * Durable root a path is on, NULL if none.
+ */
+static struct root* rootOf(const char* path)
+{
+	unsigned int i;
+
+	for (i = 0; i < root_count; i++) {
+		size_t n = strlen(roots[i].path);
+
+		if (strncmp(path, roots[i].path, n) == 0 && path[n] == '/')
+			return &roots[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * Count what a camera already has on disk, from the catalog. Done once at
+ * startup, retention keeps the totals up to date from then on.
+ */
+static void retainLoad(unsigned int device, const char* camera)
+{
+	struct catalog_entry* e;
+	size_t n, i;
+
+	retainCamera(device, camera);
+	if (catalogLoad(roots[0].path, camera, &e, &n) == -1)
+		return;
+
+	for (i = 0; i < n; i++) {
+		struct stat st;
+		char index[PATH_MAX + 8];
+
+		if (stat(e[i].path, &st) == -1)
+			continue;
+
+		snprintf(index, sizeof(index), "%s.idx", e[i].path);
+		retainWrote(device, st.st_size);
+		if (stat(index, &st) == 0)
+			retainWrote(device, st.st_size);
+
+		struct root* root = rootOf(e[i].path);
+		if (root)
+			retainSegment(camera, e[i].start, e[i].path, root);
+	}
+
+	catalogFree(e, n);
+}
+
+/**
+ * Set up plain or segmented output for a camera.
+ *
+ * \param device device index frames will carry
+ * \param camera camera name used in segment paths and the catalog
+ * \param output output file when not segmenting
+ * \param perf count hardware events on the writer thread
+ * \returns 0 on success, -1 on error
+ */
+int storeAddCamera(unsigned int device, const char* camera, const char* output, bool perf)
+{
+	char dir[PATH_MAX];
+
+	if (device >= MAX_CAMERAS) {
+		fprintf(stderr, "%s: too many cameras\n", camera);
+		return -1;
+	}
+
+	cameras[device] = camera;
+	if (root_count && filterScaling()) {
+		if (device >= STORE_SCALED) {
+			fprintf(stderr, "%s: too many cameras for a shrunk second stream\n", camera);
+			return -1;
+		}
+
+		snprintf(scaled_names[device], sizeof(scaled_names[device]), "%s-%s",
+			camera, filterScaling() == 2 ? "half" : "quarter");
+		cameras[device + STORE_SCALED] = scaled_names[device];
+		retainLoad(device + STORE_SCALED, scaled_names[device]);
+	}
+
+	if (root_count) {
+		retainLoad(device, camera);
+		return 0;
+	}
+
+	if (loopEnabled()) {
+		if (loopAddCamera(device, camera) == -1)
+			return -1;
+		output = loopPath();
+	}
+
+	snprintf(dir, sizeof(dir), "%s", output);
+	struct writer* w = writerGet(dirname(dir), perf);
+	if (!w)
+		return -1;
+
+	current[device] = segmentNew(NULL, w, device, 0);
+	if (!current[device]) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	snprintf(current[device]->path, sizeof(current[device]->path), "%s", output);
+	current[device]->loop = loopEnabled();
+	return 0;
+}
+
+/**
+ * Pick the root for a new segment: among the roots with room, the one
+ * with the most spare measured write bandwidth per open segment. Roots
+ * that have not written anything yet count as fastest, so every root gets
+ * measured.
+ */
+struct root* storeChooseRoot(void)
+{
+	struct root* best = NULL;
+	bool bestRoom = false;
+	double bestScore = 0;
+	unsigned long long bestFree = 0;
+	unsigned int i;
+
+	for (i = 0; i < root_count; i++) {
+		struct statvfs sv;
+		double rate, utilization;
+
+		unsigned long long avail = statvfs(roots[i].path, &sv) == 0
+			? (unsigned long long)sv.f_bavail * sv.f_frsize : 0;
+		bool room = avail >= STORE_RESERVE;
+
+		writerLoad(roots[i].writer, &rate, &utilization);
+		double spare = rate > 0 ? rate * (1 - utilization) : 1e12;
+		double score = spare / (1 + __atomic_load_n(&roots[i].open, __ATOMIC_RELAXED));
+
+		if (!best || (room && !bestRoom)
+				|| (room == bestRoom && (score > bestScore
+					|| (score == bestScore && avail > bestFree)))) {
+			best = &roots[i];
+			bestRoom = room;
+			bestScore = score;
+			bestFree = avail;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Queue a copy of a frame for the camera's shrunk stream. The writer's
+ * filters shrink it, off the capture thread.
+ */
+static void submitScaled(const struct frame* f)
+{
+	struct frame* g = frameAlloc(f->length);
+
+	if (!g) {
+		flightTrigger(FLIGHT_DROP, f->device + STORE_SCALED, f->sequence, f->length);
+		return;
+	}
+
+	g->device = f->device + STORE_SCALED;
+	g->sequence = f->sequence;
+	g->flags = FRAME_SCALE;
+	g->timestamp = f->timestamp;
+	memcpy(g->data, f->data, f->length);
+	storeSubmit(g);
+}
+
+/**
+ * Hand a frame to the writer of its camera's current segment, starting a new
+ * segment when the current one is long enough. Never blocks on the disk.
+ */
+void storeSubmit(struct frame* f)
+{
+	struct segment* s = current[f->device];
+
+	if (f->device < STORE_SCALED && cameras[f->device + STORE_SCALED])
+		submitScaled(f);
+
+	/* a clock stepping back also starts a new segment */
+	if (root_count && (!s || f->timestamp - s->start >= segment_ns)) {
+		struct root* root = stageEnabled() ? &staging_root : storeChooseRoot();
+		struct segment* next = segmentNew(root, root->writer, f->device, f->timestamp);
+
+		if (!next) {
+			flightTrigger(FLIGHT_DROP, f->device, f->sequence, f->length);
+			frameFree(f);
+			return;
+		}
+
+		if (s)
+			segmentFinish(s);
+		current[f->device] = s = next;
+	}
+
+	f->segment = s;
+	writerSubmit(s->writer, f);
+}
+
+/**
+ * Finish all segments, wait for the writers and the migration of staged
+ * segments, stop archiving and retention and close the catalog.
+ */
+void storeClose(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < MAX_CAMERAS; i++) {
+		if (current[i])
+			segmentFinish(current[i]);
+		current[i] = NULL;
+	}
+
+	writersStop();
+	filterStop();
+	loopClose();
+	stageStop();
+	archiveStop();
+	retainStop();
+	catalogClose();
+}
+
+static int segmentOpen(struct segment* s)
+{
+	char path[sizeof(s->path) + 8];
+
+	if (!s->root) {
+		s->fd = open(s->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+		if (s->fd == -1)
+			fprintf(stderr, "Cannot open '%s': %d, %s\n", s->path, errno, strerror(errno));
+		return s->fd == -1 ? -1 : 0;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", s->root->path, s->camera);
+	if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+		fprintf(stderr, "Cannot create '%s': %d, %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+
+	/* all or nothing, the next batch tries again */
+	snprintf(path, sizeof(path), "%s.idx", s->path);
+	s->fd = open(s->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	s->index = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+	if (s->fd == -1 || s->index == -1)
+		fprintf(stderr, "Cannot create segment '%s': %d, %s\n", s->path, errno, strerror(errno));
+	else if (catalogAppend("add", s->camera, s->start, s->path) == 0)
+		return 0;
+
+	/* a segment missing from the catalog is invisible to retention, tail and serve */
+	if (s->fd != -1) {
+		close(s->fd);
+		unlink(s->path);
+	}
+	if (s->index != -1) {
+		close(s->index);
+		unlink(path);
+	}
+	s->fd = s->index = -1;
+	return -1;
+}
+
+/**
+ * Append frames of a segment to its data file and index. Called on the
+ * writer thread, opens the segment on its first frame.
+ *
+ * \returns number of bytes of frame data written
+ */
+size_t segmentWrite(struct segment* s, struct frame** frames, unsigned int n)
+{
+	struct iovec iov[STORE_IOV];
+	struct index_entry entries[STORE_IOV];
+	size_t length = 0, done = 0, indexBytes = 0;
+	unsigned int i, first = 0, indexed = 0;
+
+	if (s->loop)
+		return loopWrite(frames, n);
+
+	if (s->fd == -1 && segmentOpen(s) == -1)
+		return 0;
+
+	if (s->root && s->root->staging)
+		stageWait();
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = frames[i]->data;
+		iov[i].iov_len = frames[i]->length;
+		length += frames[i]->length;
+	}
+
+	/* writev may stop early on a full disk or a signal, finish the job */
+	while (done < length) {
+		ssize_t written = writev(s->fd, iov + first, n - first);
+		if (written <= 0)
+			break;
+
+		done += written;
+		while (first < n && (size_t)written >= iov[first].iov_len) {
+			written -= iov[first].iov_len;
+			first++;
+		}
+		if (first < n) {
+			iov[first].iov_base = (char*)iov[first].iov_base + written;
+			iov[first].iov_len -= written;
+		}
+	}
+
+	/* data first, so the index never points past the end of the data */
+	if (s->index != -1) {
+		uint64_t offset = s->size;
+
+		for (i = 0; i < n && offset + frames[i]->length <= s->size + done; i++) {
+			entries[i].timestamp = frames[i]->timestamp;
+			entries[i].offset = offset;
+			entries[i].length = frames[i]->length;
+			entries[i].sequence = frames[i]->sequence;
+			offset += frames[i]->length;
+			indexed++;
+		}
+
+		ssize_t size = indexed * sizeof(entries[0]);
+		if (indexed && write(s->index, entries, size) != size)
+			fprintf(stderr, "%s: index write error %d, %s\n", s->path, errno, strerror(errno));
+		else
+			indexBytes = size;
+		retainWrote(s->device, done + size);
+	}
+
+	s->size += done;
+	s->frames += indexed;
+	if (s->root && s->root->staging)
+		stageWrote(done + indexBytes);
+	return done;
+}
+
+/**
+ * Close a finished segment and free it. Called on the writer thread after
+ * the segment's last frame.
+ */
+void segmentClose(struct segment* s)
+{
+	if (s->fd != -1 && close(s->fd) == -1)
+		fprintf(stderr, "%s: close error %d, %s\n", s->path, errno, strerror(errno));
+	if (s->index != -1)
+		close(s->index);
+
+	if (s->root)
+		__atomic_sub_fetch(&s->root->open, 1, __ATOMIC_RELAXED);
+
+	/* segments that never got a file have nothing to move or delete */
+	if (s->root && s->fd != -1) {
+		if (s->root->staging)
+			stageQueue(s->camera, s->start, s->path);
+		else
+			retainSegment(s->camera, s->start, s->path, s->root);
+	}
+
+	free(s);
+}
+
+/**
+ * First index entry at or after a timestamp.
+ */
+static size_t indexSeek(const struct index_entry* e, size_t n, unsigned long long t)
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (e[mid].timestamp < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/**
+ * Run a batch of extracted frames through the filters and write them out.
+ */
+static void extractFlush(struct frame* list, FILE* out)
+{
+	long long growth;
+
+	list = filterList(list, &growth);
+	while (list) {
+		struct frame* next = list->next;
+
+		fwrite(list->data, 1, list->length, out);
+		frameFree(list);
+		list = next;
+	}
+}
+
+/**
+ * Copy one segment's frames in [from, to] to out.
+ *
+ * \returns number of frames copied, -1 on error
+ */
+static long extractSegment(const char* path, unsigned long long from, unsigned long long to, FILE* out)
+{
+	char name[PATH_MAX + 8];
+	struct stat st;
+	struct frame* list = NULL;
+	struct frame** tail = &list;
+	unsigned int batched = 0;
+	long frames = 0;
+
+	snprintf(name, sizeof(name), "%s.idx", path);
+	int data = open(path, O_RDONLY | O_CLOEXEC);
+	int index = open(name, O_RDONLY | O_CLOEXEC);
+	if (data == -1 || index == -1 || fstat(index, &st) == -1) {
+		fprintf(stderr, "Cannot open segment '%s': %d, %s\n", path, errno, strerror(errno));
+		if (data != -1)
+			close(data);
+		if (index != -1)
+			close(index);
+		return -1;
+	}
+
+	size_t n = st.st_size / sizeof(struct index_entry);
+	const struct index_entry* e = n ? mmap(NULL, n * sizeof(*e), PROT_READ, MAP_SHARED, index, 0) : NULL;
+	if (e == MAP_FAILED) {
+		close(data);
+		close(index);
+		return -1;
+	}
+
+	/* batches give the filters frames to work on in parallel */
+	size_t i;
+	for (i = indexSeek(e, n, from); i < n && e[i].timestamp <= to; i++) {
+		struct frame* f = frameAlloc(e[i].length);
+
+		if (!f || pread(data, f->data, e[i].length, e[i].offset) != (ssize_t)e[i].length) {
+			frameFree(f);
+			break;
+		}
+
+		f->next = NULL;
+		f->flags = filterScaling() ? FRAME_SCALE : 0;
+		f->timestamp = e[i].timestamp;
+		f->sequence = e[i].sequence;
+		*tail = f;
+		tail = &f->next;
+		frames++;
+
+		if (++batched == STORE_EXTRACT_BATCH) {
+			extractFlush(list, out);
+			list = NULL;
+			tail = &list;
+			batched = 0;
+		}
+	}
+	extractFlush(list, out);
+
+	if (e)
+		munmap((void*)e, n * sizeof(*e));
+	close(data);
+	close(index);
+	return frames;
+}
+
+/**
+ * Write all recorded frames of a camera between two times to out, reading
+ * each segment from whichever root the catalog says it is on.
+ *
+ * \param camera camera name
+ * \param from start, CLOCK_REALTIME ns
+ * \param to end, CLOCK_REALTIME ns, inclusive
+ * \param out stream the JPEGs are concatenated to
+ * \returns number of frames written, -1 on error
+ */
+int storeExtract(const char* camera, unsigned long long from, unsigned long long to, FILE* out)
+{
+	struct catalog_entry* e;
+	size_t n, i;
+	long total = 0;
+
+	if (loopEnabled())
+		return loopExport(loopPath(), camera, from, to, out);
+
+	if (!root_count) {
+		fprintf(stderr, "Extracting needs the output root (-R) or loop (-L)\n");
+		return -1;
+	}
+
+	if (catalogLoad(roots[0].path, camera, &e, &n) == -1)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		/* a segment lasts until the next one starts */
+		if ((i + 1 < n && e[i + 1].start <= from) || e[i].start > to)
+			continue;
+
+		size_t length = strlen(e[i].path);
+		if (length > 4 && strcmp(e[i].path + length - 4, ".mkv") == 0) {
+			fprintf(stderr, "%s: archived as H.264, not extracted\n", e[i].path);
+			continue;
+		}
+
+		long frames = extractSegment(e[i].path, from, to, out);
+		if (frames > 0)
+			total += frames;
+	}
+
+	catalogFree(e, n);
+	return total;
+}
+
+/**
+ * Follow the recording of a camera, in the loop or the segments.
+ *
+ * \param camera camera name
+ * \param from first frame time, CLOCK_REALTIME ns, or TAIL_END
+ * \returns the tail, NULL on error
+ */
+struct tail* storeTail(const char* camera, unsigned long long from)
+{
+	if (loopEnabled())
+		return tailLoop(loopPath(), camera, from);
+	if (root_count)
+		return tailSegments(roots[0].path, camera, from);
+
+	fprintf(stderr, "Following needs the output root (-R) or loop (-L)\n");
+	return NULL;
+}
+
+/**
+ * Follow the segments of a camera in the catalog, see catalogView().
+ *
+ * \returns the view, NULL on error or without output roots
+ */
+struct catalog_view* storeView(const char* camera)
+{
+	if (!root_count) {
+		fprintf(stderr, "Segments need the output root (-R)\n");
+		return NULL;
+	}
+
+	return catalogView(roots[0].path, camera);
+}
+
+/**
+ * Write the frames of a camera to out as they are recorded, from a time on
+ * until the first frame after another.
+ *
+ * \param camera camera name
+ * \param from start, CLOCK_REALTIME ns
+ * \param to end, CLOCK_REALTIME ns, inclusive
+ * \param out stream the JPEGs are concatenated to, flushed after every batch
+ * \returns number of frames written, -1 on error
+ */
+int storeFollow(const char* camera, unsigned long long from, unsigned long long to, FILE* out)
+{
+	struct tail* t = storeTail(camera, from);
+	struct tail_frame tf;
+	struct frame* list = NULL;
+	struct frame** tail = &list;
+	unsigned int batched = 0;
+	long total = 0;
+	int r;
+
+	if (!t)
+		return -1;
+
+	/* catch up in batches, then wait for frames one by one */
+	while ((r = tailNext(t, &tf, batched ? 0 : 1000)) != -1) {
+		if (r == 1 && tf.timestamp > to)
+			break;
+
+		if (r == 1) {
+			struct frame* f = frameAlloc(tf.length);
+
+			if (!f)
+				break;
+			memcpy(f->data, tf.data, tf.length);
+			if (!tailIntact(t)) {
+				frameFree(f);
+				continue;
+			}
+
+			f->next = NULL;
+			f->flags = filterScaling() ? FRAME_SCALE : 0;
+			f->timestamp = tf.timestamp;
+			f->sequence = tf.sequence;
+			*tail = f;
+			tail = &f->next;
+			total++;
+			batched++;
+		}
+
+		if (batched && (r == 0 || batched == STORE_EXTRACT_BATCH)) {
+			extractFlush(list, out);
+			fflush(out);
+			list = NULL;
+			tail = &list;
+			batched = 0;
+		}
+	}
+	extractFlush(list, out);
+
+	if (tailLost(t))
+		fprintf(stderr, "%s: %llu frames overwritten before they were read\n", camera, tailLost(t));
+	tailClose(t);
+	return r == -1 ? -1 : total;
+}
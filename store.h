@@ -0,0 +1,82 @@
+/**
+ * Recording storage.
+ *
+ * Without output roots every camera appends to a single output file. With
+ * one or more roots (-R) recordings are cut into segments of a fixed length,
+ * each stored as
+ *
+ *   <root>/<camera>/<start ns>.mjpeg      concatenated JPEG frames
+ *   <root>/<camera>/<start ns>.mjpeg.idx  one struct index_entry per frame
+ *
+ * and listed in the catalog of the first root. New segments go to the root
+ * with the most spare write bandwidth that still has room, or to the
+ * staging directory (see stage.h) from where they are moved later.
+ *
+ * When frames are shrunk (-y) every camera gets a second camera,
+ * <camera>-half or <camera>-quarter, fed with copies of its frames that the
+ * writer's filters shrink.
+ *
+ * With a loop recording (-L) there are no segments, every camera writes
+ * into the loop instead.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+struct writer;
+struct frame;
+struct tail;
+struct catalog_view;
+
+struct index_entry {
+	uint64_t timestamp;  /* CLOCK_REALTIME ns */
+	uint64_t offset;
+	uint32_t length;
+	uint32_t sequence;
+};
+
+struct root {
+	char path[PATH_MAX];
+	struct writer* writer;
+	unsigned int open;  /* segments being written */
+	bool staging;
+};
+
+struct segment {
+	struct root* root;
+	struct writer* writer;
+	struct frame* closer;
+	const char* camera;
+	unsigned int device;
+	unsigned long long start;
+	char path[PATH_MAX + NAME_MAX + 32];
+	int fd;
+	int index;
+	uint64_t size;
+	unsigned long long frames;
+	bool loop;  /* frames go to the loop recording, see loop.h */
+};
+
+int storeAddRoot(const char* path);
+void storeSegmentLength(unsigned int seconds);
+bool storeSegmented(void);
+int storeOpen(bool perf);
+int storeAddCamera(unsigned int device, const char* camera, const char* output, bool perf);
+void storeSubmit(struct frame* f);
+void storeClose(void);
+struct root* storeChooseRoot(void);
+
+size_t segmentWrite(struct segment* s, struct frame** frames, unsigned int n);
+void segmentClose(struct segment* s);
+
+int storeExtract(const char* camera, unsigned long long from, unsigned long long to, FILE* out);
+int storeFollow(const char* camera, unsigned long long from, unsigned long long to, FILE* out);
+struct tail* storeTail(const char* camera, unsigned long long from);
+struct catalog_view* storeView(const char* camera);
+
+#endif
@@ -0,0 +1,523 @@
+/**
+ * Following recordings, see tail.h.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "catalog.h"
+#include "clock.h"
+#include "loop.h"
+#include "store.h"
+#include "tail.h"
+
+#define TAIL_BATCH 64
+/* data mapped at first, doubled as the segment grows */
+#define TAIL_MAP (64ULL << 20)
+/* a segment is done at the latest this long after the next one started */
+#define TAIL_LINGER 5000000000ULL
+
+struct tail {
+	char camera[NAME_MAX + 1];
+	bool loop;
+	unsigned long long lost;
+
+	/* segments */
+	struct catalog_view* view;
+	int notify;
+	int catalogWatch;
+	int indexWatch;
+	bool stale;                  /* catalog changed since it was read */
+	bool closed;                 /* writer closed the current segment */
+	unsigned long long start;    /* of the current segment, 0 before the first */
+	unsigned long long newer;    /* start of the next segment, 0 if none yet */
+	unsigned long long from;
+	int data;
+	int index;
+	const unsigned char* map;
+	size_t mapped;
+	uint64_t next;               /* next index entry to read */
+	struct index_entry pending[TAIL_BATCH];
+	unsigned int have, used;
+
+	/* loop */
+	int fd;
+	int id;
+	const struct loop_header* header;
+	const struct loop_entry* ring;
+	size_t total;
+	uint64_t frame;              /* next frame number */
+	uint64_t position;           /* of the last frame handed out */
+};
+
+static struct tail* tailNew(const char* camera, unsigned long long from)
+{
+	struct tail* t = calloc(1, sizeof(*t));
+
+	if (!t) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+
+	snprintf(t->camera, sizeof(t->camera), "%s", camera);
+	t->from = from;
+	t->notify = t->catalogWatch = t->indexWatch = -1;
+	t->data = t->index = t->fd = -1;
+	t->stale = true;
+	return t;
+}
+
+/**
+ * Follow the segments of a camera.
+ *
+ * \param root first output root, the one with the catalog
+ * \param camera camera to follow
+ * \param from first frame time, CLOCK_REALTIME ns
+ * \returns the tail, NULL on error
+ */
+struct tail* tailSegments(const char* root, const char* camera, unsigned long long from)
+{
+	char path[PATH_MAX + 16];
+	struct tail* t = tailNew(camera, from);
+
+	if (!t)
+		return NULL;
+
+	snprintf(path, sizeof(path), "%s/catalog", root);
+
+	t->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (t->notify == -1 || (t->catalogWatch = inotify_add_watch(t->notify, path, IN_MODIFY)) == -1) {
+		fprintf(stderr, "Cannot watch '%s': %d, %s\n", path, errno, strerror(errno));
+		tailClose(t);
+		return NULL;
+	}
+
+	t->view = catalogView(root, camera);
+	if (!t->view) {
+		tailClose(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+/**
+ * Follow a camera in a loop recording.
+ *
+ * \param path loop file or block device
+ * \param camera camera to follow
+ * \param from first frame time, CLOCK_REALTIME ns
+ * \returns the tail, NULL on error
+ */
+struct tail* tailLoop(const char* path, const char* camera, unsigned long long from)
+{
+	struct loop_header h;
+	struct tail* t = tailNew(camera, from);
+
+	if (!t)
+		return NULL;
+	t->loop = true;
+
+	t->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (t->fd == -1 || pread(t->fd, &h, sizeof(h), 0) != sizeof(h)) {
+		fprintf(stderr, "Cannot read loop '%s': %d, %s\n", path, errno, strerror(errno));
+		tailClose(t);
+		return NULL;
+	}
+
+	if (memcmp(h.magic, LOOP_MAGIC, sizeof(h.magic)) != 0) {
+		fprintf(stderr, "'%s' is not a loop recording\n", path);
+		tailClose(t);
+		return NULL;
+	}
+
+	for (t->id = 0; t->id < LOOP_CAMERAS; t->id++)
+		if (strncmp(h.cameras[t->id], camera, LOOP_NAME - 1) == 0)
+			break;
+	if (t->id == LOOP_CAMERAS) {
+		fprintf(stderr, "No camera '%s' in loop '%s'\n", camera, path);
+		tailClose(t);
+		return NULL;
+	}
+
+	/* header, index ring and data in one mapping */
+	t->total = h.data + h.size;
+	t->header = mmap(NULL, t->total, PROT_READ, MAP_SHARED, t->fd, 0);
+	if (t->header == MAP_FAILED) {
+		t->header = NULL;
+		fprintf(stderr, "Cannot map loop '%s': %d, %s\n", path, errno, strerror(errno));
+		tailClose(t);
+		return NULL;
+	}
+	t->ring = (const struct loop_entry*)((const char*)t->header + h.index);
+
+	/* frames of all cameras are committed in about time order */
+	uint64_t frames = __atomic_load_n(&t->header->frames, __ATOMIC_ACQUIRE);
+	uint64_t lo = loopOldest(t->header, t->ring, frames), hi = frames;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (t->ring[mid % h.entries].timestamp < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	t->frame = lo;
+	if (from == TAIL_END)
+		t->from = 0;
+	return t;
+}
+
+/**
+ * Wait for the writer to commit to a loop.
+ */
+static void loopWait(struct tail* t, uint32_t commits, unsigned long long ns)
+{
+	struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+	syscall(SYS_futex, &t->header->commits, FUTEX_WAIT, commits, &ts, NULL, 0);
+}
+
+static int loopNext(struct tail* t, struct tail_frame* f, unsigned long long deadline)
+{
+	const struct loop_header* h = t->header;
+
+	for (;;) {
+		uint32_t commits = __atomic_load_n(&h->commits, __ATOMIC_ACQUIRE);
+		uint64_t frames = __atomic_load_n(&h->frames, __ATOMIC_ACQUIRE);
+		uint64_t oldest = loopOldest(h, t->ring, frames);
+
+		if (t->frame < oldest) {
+			t->lost += oldest - t->frame;
+			t->frame = oldest;
+		}
+
+		while (t->frame < frames) {
+			struct loop_entry e = t->ring[t->frame++ % h->entries];
+
+			if (e.camera != t->id || e.timestamp < t->from)
+				continue;
+
+			uint64_t offset = h->data + e.position % h->size;
+			struct loop_record r = *(const struct loop_record*)((const char*)h + offset);
+
+			/* the record was read before head, like the frame will be */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (r.magic != LOOP_RECORD_MAGIC || r.length != e.length || r.timestamp != e.timestamp
+					|| __atomic_load_n(&h->head, __ATOMIC_RELAXED) > e.position + h->size) {
+				t->lost++;
+				continue;
+			}
+
+			t->position = e.position;
+			f->data = (const unsigned char*)h + offset + sizeof(r);
+			f->offset = offset + sizeof(r);
+			f->timestamp = r.timestamp;
+			f->length = r.length;
+			f->sequence = r.sequence;
+			return 1;
+		}
+
+		unsigned long long now = nowNs();
+		if (now >= deadline)
+			return 0;
+		loopWait(t, commits, deadline - now);
+	}
+}
+
+/**
+ * Make the data mapping of a segment reach end. Mapping past the end of
+ * the file is fine as long as nobody touches those pages.
+ */
+static int mapData(struct tail* t, uint64_t end)
+{
+	size_t length = t->mapped ? t->mapped : TAIL_MAP;
+
+	if (end <= t->mapped)
+		return 0;
+
+	while (length < end)
+		length *= 2;
+
+	if (t->map)
+		munmap((void*)t->map, t->mapped);
+	t->mapped = 0;
+	t->map = mmap(NULL, length, PROT_READ, MAP_SHARED, t->data, 0);
+	if (t->map == MAP_FAILED) {
+		t->map = NULL;
+		fprintf(stderr, "Cannot map segment: %d, %s\n", errno, strerror(errno));
+		return -1;
+	}
+
+	t->mapped = length;
+	return 0;
+}
+
+static void segmentDrop(struct tail* t)
+{
+	if (t->map)
+		munmap((void*)t->map, t->mapped);
+	if (t->indexWatch != -1)
+		inotify_rm_watch(t->notify, t->indexWatch);
+	if (t->data != -1)
+		close(t->data);
+	if (t->index != -1)
+		close(t->index);
+
+	t->map = NULL;
+	t->mapped = 0;
+	t->indexWatch = t->data = t->index = -1;
+	t->have = t->used = 0;
+	t->next = 0;
+	t->closed = false;
+}
+
+/**
+ * Entries in the index of the current segment so far.
+ */
+static uint64_t indexCount(const struct tail* t)
+{
+	off_t end = t->index != -1 ? lseek(t->index, 0, SEEK_END) : 0;
+
+	return end > 0 ? end / sizeof(struct index_entry) : 0;
+}
+
+/**
+ * Switch to a segment, at its first frame at or after from.
+ */
+static int segmentOpen(struct tail* t, const struct catalog_entry* e)
+{
+	char name[PATH_MAX + 8];
+	struct index_entry entry;
+
+	segmentDrop(t);
+	t->start = e->start;
+	t->newer = 0;
+
+	size_t length = strlen(e->path);
+	if (length > 4 && strcmp(e->path + length - 4, ".mkv") == 0) {
+		fprintf(stderr, "%s: archived as H.264, skipped\n", e->path);
+		t->closed = t->stale = true;
+		return 0;
+	}
+
+	/* watch first, so no write after the open goes unnoticed */
+	snprintf(name, sizeof(name), "%s.idx", e->path);
+	t->indexWatch = inotify_add_watch(t->notify, name, IN_MODIFY | IN_CLOSE_WRITE);
+	t->data = open(e->path, O_RDONLY | O_CLOEXEC);
+	t->index = open(name, O_RDONLY | O_CLOEXEC);
+	if (t->indexWatch == -1 || t->data == -1 || t->index == -1) {
+		fprintf(stderr, "Cannot follow segment '%s': %d, %s\n", e->path, errno, strerror(errno));
+		segmentDrop(t);
+		t->closed = t->stale = true;
+		return 0;
+	}
+
+	/* entries are in time order, skip to from */
+	uint64_t lo = 0, hi = indexCount(t);
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (pread(t->index, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry))
+			break;
+		if (entry.timestamp < t->from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	t->next = lo;
+	if (t->from == TAIL_END)
+		t->from = 0;
+	return mapData(t, 1);
+}
+
+/**
+ * Look for the segment after the current one, or the first one to follow.
+ */
+static int catalogCheck(struct tail* t)
+{
+	struct catalog_entry* e;
+	size_t n, i;
+	int r = 0;
+
+	/* a closed segment with a known successor needs no reload to move on */
+	if (!t->stale && !(t->closed && t->newer))
+		return 0;
+	t->stale = false;
+
+	/* only reads what was appended since */
+	if (catalogRefresh(t->view, &e, &n) == -1)
+		return -1;
+
+	/* nothing recorded yet, everything to come is new */
+	if (!n && t->from == TAIL_END)
+		t->from = 0;
+
+	if (!t->start && n) {
+		/* the segment from falls into, or the first one after it */
+		i = catalogAfter(e, n, t->from);
+		r = segmentOpen(t, &e[i ? i - 1 : 0]);
+	}
+
+	i = catalogAfter(e, n, t->start);
+	t->newer = i < n ? e[i].start : 0;
+
+	/* the current one is done, go on once its last frames are read */
+	if (r == 0 && t->newer && t->closed && t->next == indexCount(t)) {
+		r = segmentOpen(t, &e[i]);
+		t->stale = true;
+	}
+
+	return r;
+}
+
+/**
+ * Read what inotify has to say, waiting at most ns.
+ */
+static void notifyWait(struct tail* t, unsigned long long ns)
+{
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd p = { t->notify, POLLIN, 0 };
+	ssize_t n;
+
+	if (poll(&p, 1, (ns + 999999) / 1000000) <= 0)
+		return;
+
+	while ((n = read(t->notify, buffer, sizeof(buffer))) > 0) {
+		char* q;
+
+		for (q = buffer; q < buffer + n; q += sizeof(struct inotify_event) + ((struct inotify_event*)q)->len) {
+			const struct inotify_event* ev = (const struct inotify_event*)q;
+
+			if (ev->wd == t->catalogWatch)
+				t->stale = true;
+			else if (ev->wd == t->indexWatch && (ev->mask & IN_CLOSE_WRITE))
+				t->closed = true;
+		}
+	}
+}
+
+static int segmentsNext(struct tail* t, struct tail_frame* f, unsigned long long deadline)
+{
+	bool polled = false;
+
+	for (;;) {
+		if (t->used == t->have && t->index != -1) {
+			ssize_t n = pread(t->index, t->pending, sizeof(t->pending), t->next * sizeof(t->pending[0]));
+
+			t->have = n > 0 ? n / sizeof(t->pending[0]) : 0;
+			t->used = 0;
+		}
+
+		if (t->used < t->have) {
+			const struct index_entry* e = &t->pending[t->used++];
+
+			t->next++;
+			if (mapData(t, e->offset + e->length) == -1)
+				return -1;
+
+			f->data = t->map + e->offset;
+			f->offset = e->offset;
+			f->timestamp = e->timestamp;
+			f->length = e->length;
+			f->sequence = e->sequence;
+			return 1;
+		}
+
+		/* not closed in time, its writer is gone or we missed the close */
+		if (t->newer && realtimeNs() > t->newer + TAIL_LINGER) {
+			t->closed = true;
+			t->stale = true;
+		}
+		unsigned long long start = t->start;
+		if (catalogCheck(t) == -1)
+			return -1;
+		if (t->start != start)
+			continue;
+
+		unsigned long long now = nowNs();
+		if (now >= deadline) {
+			/* take in what happened meanwhile, even without waiting */
+			if (polled)
+				return 0;
+			polled = true;
+			notifyWait(t, 0);
+			continue;
+		}
+		/* wake up now and then to notice a writer that went away */
+		notifyWait(t, deadline - now < 1000000000ULL ? deadline - now : 1000000000ULL);
+	}
+}
+
+/**
+ * Next frame of the camera, waiting for it to be committed if needed.
+ *
+ * \param f receives the frame
+ * \param timeout how long to wait in ms
+ * \returns 1 if there is a frame, 0 on timeout, -1 on error
+ */
+int tailNext(struct tail* t, struct tail_frame* f, int timeout)
+{
+	unsigned long long deadline = nowNs() + timeout * 1000000ULL;
+
+	return t->loop ? loopNext(t, f, deadline) : segmentsNext(t, f, deadline);
+}
+
+/**
+ * Check that the last frame tailNext() handed out was not overwritten in
+ * the meantime. Call it after using the frame; segments are never
+ * overwritten.
+ */
+bool tailIntact(const struct tail* t)
+{
+	if (!t->loop)
+		return true;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&t->header->head, __ATOMIC_RELAXED) <= t->position + t->header->size;
+}
+
+/**
+ * File the offsets of frames refer to.
+ */
+int tailFile(const struct tail* t)
+{
+	return t->loop ? t->fd : t->data;
+}
+
+/**
+ * Frames overwritten before they could be handed out.
+ */
+unsigned long long tailLost(const struct tail* t)
+{
+	return t->lost;
+}
+
+void tailClose(struct tail* t)
+{
+	if (!t)
+		return;
+
+	segmentDrop(t);
+	catalogViewClose(t->view);
+	if (t->header)
+		munmap((void*)t->header, t->total);
+	if (t->fd != -1)
+		close(t->fd);
+	if (t->notify != -1)
+		close(t->notify);
+	free(t);
+}
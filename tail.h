@@ -0,0 +1,49 @@
+/**
+ * Following recordings while they are written.
+ *
+ * A tail hands out the frames of one camera as the recorder commits them,
+ * oldest first, starting at a given time. Frames are not copied: each one
+ * comes as an offset and length in the file tailFile() returns (for
+ * sendfile() and friends) and a pointer into a read only mapping of it.
+ *
+ * Segments (-R) are followed with inotify on the segment's index, which
+ * the writer appends to only after the frame data is on disk, and on the
+ * catalog to find the next segment. A segment is done when the writer
+ * closes its index, or a few seconds after the next one started.
+ *
+ * A loop (-L) is followed through its header: the writer bumps the commits
+ * counter after every batch and wakes waiters with a futex on it, so a
+ * reader sleeps until something is committed. Readers never block the
+ * writer, which may overwrite a frame while it is being read;
+ * tailIntact() says whether the last frame handed out survived.
+ */
+
+#ifndef TAIL_H
+#define TAIL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+/* start with the next frame committed */
+#define TAIL_END ULLONG_MAX
+
+struct tail;
+
+struct tail_frame {
+	const unsigned char* data;  /* mapped, valid until the next tailNext() */
+	uint64_t offset;            /* of the frame in tailFile() */
+	uint64_t timestamp;         /* CLOCK_REALTIME ns of capture */
+	uint32_t length;
+	uint32_t sequence;
+};
+
+struct tail* tailSegments(const char* root, const char* camera, unsigned long long from);
+struct tail* tailLoop(const char* path, const char* camera, unsigned long long from);
+int tailNext(struct tail* t, struct tail_frame* f, int timeout);
+bool tailIntact(const struct tail* t);
+int tailFile(const struct tail* t);
+unsigned long long tailLost(const struct tail* t);
+void tailClose(struct tail* t);
+
+#endif
@@ -0,0 +1,204 @@
+/**
+ * Per thread span recording, see trace.h.
+ *
+ * Buffers are rings that keep the most recent TRACE_CAPACITY spans of each
+ * thread. A buffer is registered on a thread's first span by pushing it onto
+ * a lock free list and is never freed, so the dumper can walk the list while
+ * threads come and go.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "clock.h"
+#include "trace.h"
+
+#define TRACE_CAPACITY 65536
+
+struct span {
+	const char* name;
+	const char* device;
+	unsigned long long start;
+	unsigned long long end;
+	unsigned int seq;
+};
+
+struct trace_buffer {
+	struct trace_buffer* next;
+	const char* thread;
+	long tid;
+	unsigned long head;
+	struct span spans[TRACE_CAPACITY];
+};
+
+bool trace_enabled = false;
+
+static const char* tracePath;
+static struct trace_buffer* buffers;
+static __thread struct trace_buffer* local;
+
+static struct trace_buffer* localBuffer(void)
+{
+	if (local)
+		return local;
+
+	struct trace_buffer* b = calloc(1, sizeof(*b));
+	if (!b)
+		return NULL;
+
+	b->tid = syscall(SYS_gettid);
+	b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&buffers, &b->next, b, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	local = b;
+	return b;
+}
+
+/**
+ * Enable tracing. The trace is written to path by traceDump() and at exit.
+ *
+ * \param path output file for the JSON trace
+ * \returns 0 on success, -1 if the exit handler could not be registered
+ */
+int traceOpen(const char* path)
+{
+	tracePath = path;
+	trace_enabled = true;
+
+	if (atexit(traceDump) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Name the calling thread in the trace. The string must stay valid.
+ */
+void traceThreadName(const char* name)
+{
+	struct trace_buffer* b;
+
+	if (!trace_enabled || !(b = localBuffer()))
+		return;
+
+	b->thread = name;
+}
+
+/**
+ * \returns start timestamp to hand to traceEnd(), 0 when tracing is off
+ */
+unsigned long long traceBegin(void)
+{
+	return trace_enabled ? nowNs() : 0;
+}
+
+/**
+ * Record a span from start until now on the calling thread.
+ *
+ * \param name span name, must be a string literal or otherwise static
+ * \param start value returned by traceBegin()
+ * \param device device the span belongs to, may be NULL
+ * \param seq frame sequence number
+ */
+void traceEnd(const char* name, unsigned long long start, const char* device, unsigned int seq)
+{
+	struct trace_buffer* b;
+
+	if (!trace_enabled || !(b = localBuffer()))
+		return;
+
+	unsigned long head = b->head;
+	struct span* s = &b->spans[head % TRACE_CAPACITY];
+
+	s->name = name;
+	s->device = device;
+	s->start = start;
+	s->end = nowNs();
+	s->seq = seq;
+
+	__atomic_store_n(&b->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void jsonString(FILE* fp, const char* s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', fp);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void dumpBuffer(FILE* fp, const struct trace_buffer* b, int pid, bool* first)
+{
+	unsigned long head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+	unsigned long tail = head > TRACE_CAPACITY ? head - TRACE_CAPACITY : 0;
+	unsigned long i;
+
+	if (b->thread) {
+		fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,"
+			"\"args\":{\"name\":", *first ? "" : ",", pid, b->tid);
+		jsonString(fp, b->thread);
+		fputs("}}", fp);
+		*first = false;
+	}
+
+	for (i = tail; i < head; i++) {
+		struct span s = b->spans[i % TRACE_CAPACITY];
+
+		/* the owner may have lapped us while we were copying */
+		unsigned long now = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+		if (now > TRACE_CAPACITY && i < now - TRACE_CAPACITY)
+			continue;
+
+		fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,"
+			"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"seq\":%u",
+			*first ? "" : ",", s.name, pid, b->tid,
+			s.start / 1000.0, (s.end - s.start) / 1000.0, s.seq);
+		if (s.device) {
+			fputs(",\"device\":", fp);
+			jsonString(fp, s.device);
+		}
+		fputs("}}", fp);
+		*first = false;
+	}
+}
+
+/**
+ * Write every thread's spans to the trace file, replacing earlier dumps.
+ * Safe to call while other threads keep recording, but not from a signal
+ * handler.
+ */
+void traceDump(void)
+{
+	struct trace_buffer* b;
+	bool first = true;
+
+	if (!trace_enabled)
+		return;
+
+	FILE* fp = fopen(tracePath, "w");
+	if (!fp) {
+		fprintf(stderr, "Cannot write trace '%s': %d, %s\n", tracePath, errno, strerror(errno));
+		return;
+	}
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fp);
+	for (b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b; b = b->next)
+		dumpBuffer(fp, b, getpid(), &first);
+	fputs("\n]}\n", fp);
+
+	fclose(fp);
+}
@@ -0,0 +1,22 @@
+/**
+ * Timeline tracing in the Chrome trace event format.
+ *
+ * Every thread records complete spans into its own ring buffer without
+ * locking. traceDump() writes all buffers as JSON that loads into
+ * chrome://tracing or ui.perfetto.dev.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+
+extern bool trace_enabled;
+
+int traceOpen(const char* path);
+void traceThreadName(const char* name);
+unsigned long long traceBegin(void);
+void traceEnd(const char* name, unsigned long long start, const char* device, unsigned int seq);
+void traceDump(void);
+
+#endif
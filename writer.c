@@ -0,0 +1,472 @@
+/**
+ * Writer threads, see writer.h.
+ *
+ * The queue is an intrusive stack: producers push with a compare and swap,
+ * the writer takes the whole stack with one exchange and reverses it. A
+ * semaphore wakes the writer, sem_post() does not enter the kernel unless
+ * the writer is actually asleep.
+ *
+ * Queued bytes are bounded. A frame that does not fit is dropped at submit
+ * time, so a disk that stops keeping up costs frames instead of memory.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+
+#include "clock.h"
+#include "filter.h"
+#include "flight.h"
+#include "perf.h"
+#include "probes.h"
+#include "store.h"
+#include "trace.h"
+#include "writer.h"
+
+#define MAX_WRITERS 16
+#define MAX_STREAMS 64
+#define WRITER_BATCH (4 << 20)
+#define WRITER_LINGER 50000000ULL
+#define WRITER_MAX_QUEUED (256 << 20)
+#define WRITER_IOV 64
+#define WRITER_STALL 1000000000ULL
+#define LATENCY_BUCKETS 32
+
+struct stream {
+	const char* name;
+	unsigned long long frames;
+	unsigned long long bytes;
+	unsigned long long dropped;
+	unsigned long long latencySum;
+	unsigned long long latencyMax;
+	unsigned long long latency[LATENCY_BUCKETS];
+};
+
+struct writer {
+	dev_t fs;
+	pthread_t thread;
+	sem_t wake;
+	struct frame* head;
+	size_t queued;
+	bool stop;
+	bool perfEnabled;
+	char thread_name[32];
+	struct stream* streams[MAX_STREAMS];
+	unsigned long long dropped[MAX_STREAMS];
+	unsigned long long writes;
+	unsigned long long bytes;
+	unsigned long long busyNs;
+	unsigned long long lastBatch;
+	double utilization;
+	unsigned long long started;
+	unsigned long long stopped;
+	struct perf_counters perf;
+};
+
+static struct writer* writers[MAX_WRITERS];
+static unsigned int writer_count;
+
+struct frame* frameAlloc(size_t length)
+{
+	struct frame* f = malloc(sizeof(*f) + length);
+
+	if (f)
+		f->length = length;
+
+	return f;
+}
+
+void frameFree(struct frame* f)
+{
+	free(f);
+}
+
+/**
+ * Index of the latency histogram bucket, powers of two in microseconds.
+ */
+static unsigned int latencyBucket(unsigned long long ns)
+{
+	unsigned long long us = ns / 1000;
+	unsigned int b = 0;
+
+	while (us > 1 && b < LATENCY_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+
+	return b;
+}
+
+static struct stream* streamFor(struct writer* w, const struct frame* f)
+{
+	struct stream* s;
+
+	if (f->device >= MAX_STREAMS)
+		return NULL;
+
+	s = w->streams[f->device];
+	if (!s && (s = calloc(1, sizeof(*s)))) {
+		s->name = f->segment->camera;
+		w->streams[f->device] = s;
+	}
+
+	return s;
+}
+
+/**
+ * Write a batch of frames of one segment and account for them.
+ */
+static void streamWrite(struct writer* w, struct frame** frames, unsigned int n)
+{
+	struct segment* seg = frames[0]->segment;
+	size_t length = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		length += frames[i]->length;
+
+	unsigned long long start = nowNs();
+	PROBE4(write_start, seg->camera, frames[0]->sequence, length, start);
+
+	size_t done = segmentWrite(seg, frames, n);
+
+	unsigned long long end = nowNs();
+	PROBE4(write_end, seg->camera, frames[n - 1]->sequence, done, end);
+
+	w->writes++;
+	__atomic_add_fetch(&w->bytes, done, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&w->busyNs, end - start, __ATOMIC_RELAXED);
+
+	flightRecord(FLIGHT_WRITE, frames[0]->device, frames[0]->sequence, (end - start) / 1000);
+	if (done < length) {
+		flightTrigger(FLIGHT_DROP, frames[0]->device, frames[0]->sequence, length - done);
+		fprintf(stderr, "%s: write error %d, %s\n", seg->path, errno, strerror(errno));
+	} else if (end - start > WRITER_STALL) {
+		flightTrigger(FLIGHT_STALL, frames[0]->device, frames[0]->sequence, (end - start) / 1000);
+	}
+
+	struct stream* s = streamFor(w, frames[0]);
+	if (!s)
+		return;
+
+	for (i = 0; i < n; i++) {
+		unsigned long long latency = end - frames[i]->queued;
+
+		s->frames++;
+		s->bytes += frames[i]->length;
+		s->latencySum += latency;
+		if (latency > s->latencyMax)
+			s->latencyMax = latency;
+		s->latency[latencyBucket(latency)]++;
+	}
+	if (done < length)
+		s->dropped++;
+}
+
+/**
+ * Write out a FIFO list of frames, grouped per segment.
+ */
+static void batchWrite(struct writer* w, struct frame* list)
+{
+	unsigned long long start = nowNs();
+
+	while (list) {
+		struct frame* batch[WRITER_IOV];
+		struct frame** link = &list;
+		struct segment* seg = list->segment;
+		struct frame* closer = NULL;
+		unsigned int n = 0;
+		size_t length = 0;
+
+		/*
+		 * Pull this segment's frames out of the list, keeping their order
+		 * and stopping at the end of the segment.
+		 */
+		while (*link && n < WRITER_IOV && !closer) {
+			struct frame* f = *link;
+
+			if (f->segment != seg) {
+				link = &f->next;
+				continue;
+			}
+
+			*link = f->next;
+			if (f->flags & FRAME_CLOSE) {
+				closer = f;
+			} else {
+				batch[n++] = f;
+				length += f->length;
+			}
+		}
+
+		if (n) {
+			perfStageBegin(&w->perf);
+			streamWrite(w, batch, n);
+			perfStageEnd(&w->perf, STAGE_WRITE);
+		}
+
+		if (closer) {
+			segmentClose(seg);
+			frameFree(closer);
+		}
+
+		__atomic_sub_fetch(&w->queued, length, __ATOMIC_RELAXED);
+		while (n)
+			frameFree(batch[--n]);
+	}
+
+	/* utilization over roughly the last few batches */
+	unsigned long long end = nowNs();
+	if (w->lastBatch && end > w->lastBatch) {
+		double sample = (double)(end - start) / (end - w->lastBatch);
+		double utilization = 0.75 * w->utilization + 0.25 * sample;
+		__atomic_store(&w->utilization, &utilization, __ATOMIC_RELAXED);
+	}
+	w->lastBatch = end;
+}
+
+static struct frame* takeAll(struct writer* w)
+{
+	struct frame* f = __atomic_exchange_n(&w->head, NULL, __ATOMIC_ACQUIRE);
+	struct frame* list = NULL;
+
+	/* the stack is newest first */
+	while (f) {
+		struct frame* next = f->next;
+		f->next = list;
+		list = f;
+		f = next;
+	}
+
+	return list;
+}
+
+/**
+ * Wait for the semaphore, at most until deadline (CLOCK_MONOTONIC ns).
+ */
+static void waitUntil(struct writer* w, unsigned long long deadline)
+{
+	struct timespec ts;
+
+	/* sem_timedwait only knows CLOCK_REALTIME */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	unsigned long long abs = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec
+		+ (deadline - nowNs());
+	ts.tv_sec = abs / 1000000000ULL;
+	ts.tv_nsec = abs % 1000000000ULL;
+
+	while (sem_timedwait(&w->wake, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static void* writerThread(void* arg)
+{
+	struct writer* w = arg;
+
+	traceThreadName(w->thread_name);
+	if (w->perfEnabled && perfOpen(&w->perf) == -1)
+		fprintf(stderr, "%s: unable to open performance counters: %s\n", w->thread_name, strerror(errno));
+
+	for (;;) {
+		while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)
+				&& sem_wait(&w->wake) == -1 && errno == EINTR)
+			;
+
+		/*
+		 * Give a small batch a moment to grow into a large one. Frames
+		 * wait at most WRITER_LINGER for this.
+		 */
+		unsigned long long deadline = nowNs() + WRITER_LINGER;
+		while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)
+				&& __atomic_load_n(&w->queued, __ATOMIC_RELAXED) < WRITER_BATCH
+				&& nowNs() < deadline)
+			waitUntil(w, deadline);
+
+		struct frame* list = takeAll(w);
+		if (list) {
+			long long growth;
+			unsigned long long start = traceBegin();
+
+			list = filterList(list, &growth);
+			__atomic_add_fetch(&w->queued, (size_t)growth, __ATOMIC_RELAXED);
+			traceEnd("filter", start, NULL, 0);
+
+			start = traceBegin();
+			batchWrite(w, list);
+			traceEnd("write", start, NULL, 0);
+		} else if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Writer for the filesystem a directory is on. Writers are started on first
+ * use.
+ *
+ * \param dir directory output files will be created in
+ * \param perf count hardware events on the writer thread
+ * \returns the writer, NULL on error
+ */
+struct writer* writerGet(const char* dir, bool perf)
+{
+	struct stat st;
+	unsigned int i;
+
+	if (stat(dir, &st) == -1) {
+		fprintf(stderr, "Cannot stat '%s': %d, %s\n", dir, errno, strerror(errno));
+		return NULL;
+	}
+
+	for (i = 0; i < writer_count; i++)
+		if (writers[i]->fs == st.st_dev)
+			return writers[i];
+
+	if (writer_count == MAX_WRITERS) {
+		fprintf(stderr, "Too many output filesystems\n");
+		return NULL;
+	}
+
+	struct writer* w = calloc(1, sizeof(*w));
+	if (!w) {
+		fprintf(stderr, "Out of memory\n");
+		return NULL;
+	}
+
+	w->fs = st.st_dev;
+	w->perfEnabled = perf;
+	w->perf.fd[0] = w->perf.fd[1] = w->perf.fd[2] = -1;
+	w->started = nowNs();
+	snprintf(w->thread_name, sizeof(w->thread_name), "writer %u:%u",
+		major(st.st_dev), minor(st.st_dev));
+	sem_init(&w->wake, 0, 0);
+
+	int err = pthread_create(&w->thread, NULL, writerThread, w);
+	if (err) {
+		fprintf(stderr, "pthread_create error %d, %s\n", err, strerror(err));
+		sem_destroy(&w->wake);
+		free(w);
+		return NULL;
+	}
+
+	writers[writer_count++] = w;
+	return w;
+}
+
+/**
+ * Measured write rate in bytes per second of busy time, 0 if nothing was
+ * written yet, and the recent fraction of time the writer was busy.
+ */
+void writerLoad(struct writer* w, double* rate, double* utilization)
+{
+	unsigned long long busy = __atomic_load_n(&w->busyNs, __ATOMIC_RELAXED);
+	unsigned long long bytes = __atomic_load_n(&w->bytes, __ATOMIC_RELAXED);
+
+	*rate = busy ? bytes * 1e9 / busy : 0;
+	__atomic_load(&w->utilization, utilization, __ATOMIC_RELAXED);
+}
+
+/**
+ * Queue a frame for writing. Never blocks. The writer owns the frame
+ * afterwards, also when it has to be dropped.
+ */
+void writerSubmit(struct writer* w, struct frame* f)
+{
+	size_t queued = __atomic_add_fetch(&w->queued, f->length, __ATOMIC_RELAXED);
+
+	if (queued > WRITER_MAX_QUEUED && !(f->flags & FRAME_CLOSE)) {
+		__atomic_sub_fetch(&w->queued, f->length, __ATOMIC_RELAXED);
+		if (f->device < MAX_STREAMS)
+			__atomic_add_fetch(&w->dropped[f->device], 1, __ATOMIC_RELAXED);
+		PROBE3(frame_discard, f->segment->camera, f->sequence, f->length);
+		flightTrigger(FLIGHT_DROP, f->device, f->sequence, f->length);
+		frameFree(f);
+		return;
+	}
+
+	f->queued = nowNs();
+	f->next = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&w->head, &f->next, f, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	sem_post(&w->wake);
+}
+
+/**
+ * Write out everything still queued and stop all writers.
+ */
+void writersStop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < writer_count; i++) {
+		__atomic_store_n(&writers[i]->stop, true, __ATOMIC_RELEASE);
+		sem_post(&writers[i]->wake);
+	}
+
+	for (i = 0; i < writer_count; i++) {
+		struct writer* w = writers[i];
+
+		pthread_join(w->thread, NULL);
+		w->stopped = nowNs();
+		perfClose(&w->perf);
+	}
+}
+
+/**
+ * Print throughput per writer and latency from capture to disk per stream.
+ * Call after writersStop().
+ */
+void writersReport(FILE* fp)
+{
+	unsigned int i, j, b;
+
+	for (i = 0; i < writer_count; i++) {
+		const struct writer* w = writers[i];
+		double seconds = (w->stopped - w->started) / 1e9;
+
+		fprintf(fp, "%s: %llu writes, %.1f MB, %.2f MB/s, %.1f kB per write, busy %.1f%%\n",
+			w->thread_name, w->writes, w->bytes / 1e6,
+			seconds > 0 ? w->bytes / 1e6 / seconds : 0,
+			w->writes ? w->bytes / 1e3 / w->writes : 0,
+			seconds > 0 ? w->busyNs / 1e7 / seconds : 0);
+
+		for (j = 0; j < MAX_STREAMS; j++) {
+			const struct stream* s = w->streams[j];
+			unsigned long long below = 0;
+
+			if (!s)
+				continue;
+
+			/* upper bound of the bucket holding the 99th percentile */
+			for (b = 0; b < LATENCY_BUCKETS - 1; b++) {
+				below += s->latency[b];
+				if (below * 100 >= s->frames * 99)
+					break;
+			}
+
+			fprintf(fp, "  %s: %llu frames, %llu dropped, latency avg %.2f ms, p99 < %.2f ms, max %.2f ms\n",
+				s->name, s->frames, s->dropped + w->dropped[j],
+				s->frames ? s->latencySum / 1e6 / s->frames : 0,
+				(2ULL << b) / 1e3, s->latencyMax / 1e6);
+		}
+
+		if (w->perfEnabled)
+			perfReport(fp, &w->perf);
+	}
+}
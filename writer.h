@@ -0,0 +1,52 @@
+/**
+ * Per filesystem writer threads.
+ *
+ * All cameras whose output lives on the same filesystem share one writer
+ * thread. Capture threads hand over copies of their frames through a lock
+ * free multi producer queue and never block on the disk. The writer drains
+ * the queue in batches and turns them into one large writev() per output
+ * file, so a spinning disk sees a few long sequential writes instead of many
+ * small interleaved ones.
+ */
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* no data, close the segment once the frames queued before it are written */
+#define FRAME_CLOSE 1
+/* shrink the frame by the filter scale before writing it, see filter.h */
+#define FRAME_SCALE 2
+/* crc holds the CRC-32C of the data */
+#define FRAME_CRC 4
+
+struct writer;
+struct segment;
+
+struct frame {
+	struct frame* next;
+	struct segment* segment;
+	unsigned int device;
+	unsigned int sequence;
+	unsigned int flags;
+	unsigned long long timestamp;  /* CLOCK_REALTIME ns of capture */
+	unsigned long long queued;
+	uint32_t crc;
+	size_t length;
+	unsigned char data[];
+};
+
+struct frame* frameAlloc(size_t length);
+void frameFree(struct frame* f);
+
+struct writer* writerGet(const char* dir, bool perf);
+void writerSubmit(struct writer* w, struct frame* f);
+void writerLoad(struct writer* w, double* rate, double* utilization);
+void writersStop(void);
+void writersReport(FILE* fp);
+
+#endif